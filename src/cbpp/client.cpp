@@ -76,6 +76,11 @@ namespace Cbpp {
 			: SyncJobBase(client)
 		{ }
 
+		// 只关闭连接，不会让出，不需要纤程。
+		bool may_yield() const OVERRIDE {
+			return false;
+		}
+
 	protected:
 		void really_perform(const boost::shared_ptr<Client> &client) OVERRIDE {
 			PROFILE_ME;
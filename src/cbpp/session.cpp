@@ -19,11 +19,21 @@ namespace Cbpp {
 	private:
 		const SocketBase::DelayedShutdownGuard m_guard;
 		const boost::weak_ptr<Session> m_weak_session;
+		const boost::uint64_t m_queued_size;
 
 	protected:
-		explicit SyncJobBase(const boost::shared_ptr<Session> &session)
-			: m_guard(session), m_weak_session(session)
-		{ }
+		explicit SyncJobBase(const boost::shared_ptr<Session> &session, boost::uint64_t queued_size = 0)
+			: m_guard(session), m_weak_session(session), m_queued_size(queued_size)
+		{
+			session->notify_receive_queued(m_queued_size);
+		}
+		~SyncJobBase(){
+			// 无论任务是否被执行，都要归还排队的数据量。
+			const AUTO(session, m_weak_session.lock());
+			if(session){
+				session->notify_receive_consumed(m_queued_size);
+			}
+		}
 
 	private:
 		boost::weak_ptr<const void> get_category() const FINAL {
@@ -62,6 +72,11 @@ namespace Cbpp {
 			: SyncJobBase(session)
 		{ }
 
+		// 只关闭连接，不会让出，不需要纤程。
+		bool may_yield() const OVERRIDE {
+			return false;
+		}
+
 	protected:
 		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
 			PROFILE_ME;
@@ -78,7 +93,7 @@ namespace Cbpp {
 	public:
 		DataMessageJob(const boost::shared_ptr<Session> &session,
 			boost::uint16_t message_id, StreamBuffer payload)
-			: SyncJobBase(session)
+			: SyncJobBase(session, payload.size())
 			, m_message_id(message_id), m_payload(STD_MOVE(payload))
 		{ }
 
@@ -102,7 +117,7 @@ namespace Cbpp {
 	public:
 		ControlMessageJob(const boost::shared_ptr<Session> &session,
 			StatusCode status_code, StreamBuffer param)
-			: SyncJobBase(session)
+			: SyncJobBase(session, param.size())
 			, m_status_code(status_code), m_param(STD_MOVE(param))
 		{ }
 
@@ -0,0 +1,185 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2017, LH_Mouse. All wrongs reserved.
+
+#include "precompiled.hpp"
+#include "fiber_context.hpp"
+#include <stdint.h>
+#include <cstdlib>
+
+// 本文件不依赖日志等其他组件，可以被独立的测试程序直接包含。
+
+extern "C" {
+
+#ifdef POSEIDON_HAS_ASM_FIBER_CONTEXT
+// 保存当前的寄存器到 *from_sp 指向的栈上，然后从 to_sp 恢复。
+extern void poseidon_fiber_context_swap(void **from_sp, void *to_sp);
+// 新上下文的入口，从寄存器中取出 proc 和 param。
+extern void poseidon_fiber_context_trampoline();
+#endif
+
+}
+
+#if defined(__x86_64__)
+
+// 栈帧布局（由低到高）：mxcsr/x87cw (8), r15, r14, r13, r12, rbx, rbp, 返回地址。
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl poseidon_fiber_context_swap\n"
+	".hidden poseidon_fiber_context_swap\n"
+	".type poseidon_fiber_context_swap, @function\n"
+	"poseidon_fiber_context_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size poseidon_fiber_context_swap, .-poseidon_fiber_context_swap\n"
+
+	".p2align 4\n"
+	".globl poseidon_fiber_context_trampoline\n"
+	".hidden poseidon_fiber_context_trampoline\n"
+	".type poseidon_fiber_context_trampoline, @function\n"
+	"poseidon_fiber_context_trampoline:\n"
+	"	movq %r13, %rdi\n"
+	"	callq *%r12\n"
+	"	ud2\n"
+	".size poseidon_fiber_context_trampoline, .-poseidon_fiber_context_trampoline\n"
+);
+
+#elif defined(__aarch64__)
+
+// 栈帧布局（由低到高）：x19-x30 (96), d8-d15 (64), 填充 (16)。
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".globl poseidon_fiber_context_swap\n"
+	".hidden poseidon_fiber_context_swap\n"
+	".type poseidon_fiber_context_swap, %function\n"
+	"poseidon_fiber_context_swap:\n"
+	"	sub sp, sp, #176\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #176\n"
+	"	ret\n"
+	".size poseidon_fiber_context_swap, .-poseidon_fiber_context_swap\n"
+
+	".p2align 4\n"
+	".globl poseidon_fiber_context_trampoline\n"
+	".hidden poseidon_fiber_context_trampoline\n"
+	".type poseidon_fiber_context_trampoline, %function\n"
+	"poseidon_fiber_context_trampoline:\n"
+	"	mov x0, x20\n"
+	"	blr x19\n"
+	"	brk #0\n"
+	".size poseidon_fiber_context_trampoline, .-poseidon_fiber_context_trampoline\n"
+);
+
+#endif
+
+namespace Poseidon {
+
+#ifdef POSEIDON_HAS_ASM_FIBER_CONTEXT
+void AsmFiberContext::prepare(void *stack, std::size_t size, void (*proc)(void *), void *param) NOEXCEPT {
+	AUTO(top, reinterpret_cast<uintptr_t>(stack) + size);
+	top &= ~static_cast<uintptr_t>(15);
+# if defined(__x86_64__)
+	// 进入 trampoline 时 rsp 是 16 的倍数，这样 call 之后 proc 看到的栈是对齐的。
+	AUTO(frame, reinterpret_cast<uint64_t *>(top) - 10);
+	uint32_t csr[2];
+	__asm__ volatile ("stmxcsr %0" : "=m"(csr[0]));
+	__asm__ volatile ("fnstcw %0" : "=m"(csr[1]));
+	frame[0] = csr[0] | (static_cast<uint64_t>(csr[1] & 0xFFFF) << 32);
+	frame[1] = 0; // r15
+	frame[2] = 0; // r14
+	frame[3] = reinterpret_cast<uintptr_t>(param); // r13
+	frame[4] = reinterpret_cast<uintptr_t>(proc); // r12
+	frame[5] = 0; // rbx
+	frame[6] = 0; // rbp
+	frame[7] = reinterpret_cast<uintptr_t>(&poseidon_fiber_context_trampoline);
+	frame[8] = 0;
+	frame[9] = 0;
+# elif defined(__aarch64__)
+	AUTO(frame, reinterpret_cast<uint64_t *>(top) - 22);
+	for(unsigned i = 0; i < 22; ++i){
+		frame[i] = 0;
+	}
+	frame[0] = reinterpret_cast<uintptr_t>(proc); // x19
+	frame[1] = reinterpret_cast<uintptr_t>(param); // x20
+	frame[11] = reinterpret_cast<uintptr_t>(&poseidon_fiber_context_trampoline); // x30
+# endif
+	m_sp = frame;
+}
+void AsmFiberContext::switch_to(AsmFiberContext &to) NOEXCEPT {
+	::poseidon_fiber_context_swap(&m_sp, to.m_sp);
+}
+#endif
+
+namespace {
+	// makecontext() 只能传递 int 参数，因此把上下文的地址拆成两半。
+	void ucontext_entry(unsigned lo, unsigned hi){
+		const AUTO(ctx, reinterpret_cast<void **>((static_cast<uintptr_t>(hi) << 16 << 16) | lo));
+		const AUTO(proc, reinterpret_cast<void (*)(void *)>(ctx[0]));
+		(*proc)(ctx[1]);
+		std::abort();
+	}
+}
+
+void UcontextFiberContext::prepare(void *stack, std::size_t size, void (*proc)(void *), void *param) NOEXCEPT {
+	m_ctx[0] = reinterpret_cast<void *>(proc);
+	m_ctx[1] = param;
+
+	if(::getcontext(&m_uc) != 0){
+		std::abort();
+	}
+	m_uc.uc_stack.ss_sp = stack;
+	m_uc.uc_stack.ss_size = size;
+	m_uc.uc_link = NULLPTR;
+	const AUTO(addr, reinterpret_cast<uintptr_t>(m_ctx));
+	::makecontext(&m_uc, reinterpret_cast<void (*)()>(&ucontext_entry), 2,
+		static_cast<unsigned>(addr), static_cast<unsigned>(addr >> 16 >> 16));
+}
+void UcontextFiberContext::switch_to(UcontextFiberContext &to) NOEXCEPT {
+	if(::swapcontext(&m_uc, &to.m_uc) != 0){
+		std::abort();
+	}
+}
+
+}
@@ -0,0 +1,64 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2017, LH_Mouse. All wrongs reserved.
+
+#ifndef POSEIDON_FIBER_CONTEXT_HPP_
+#define POSEIDON_FIBER_CONTEXT_HPP_
+
+#include "cxx_ver.hpp"
+#include "cxx_util.hpp"
+#include <cstddef>
+#include <ucontext.h>
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#   define POSEIDON_HAS_ASM_FIBER_CONTEXT   1
+#endif
+
+namespace Poseidon {
+
+// 用于在纤程之间切换的执行上下文。
+// prepare() 在指定的栈上准备一个新的上下文，第一次切换到该上下文时调用 proc(param)。
+// proc 不可返回，它必须在结束前切换到其他上下文。
+
+#ifdef POSEIDON_HAS_ASM_FIBER_CONTEXT
+// 只保存被调用者保存的寄存器，不涉及信号掩码，因此不需要任何系统调用。
+class AsmFiberContext : NONCOPYABLE {
+private:
+	void *m_sp;
+
+public:
+	AsmFiberContext() NOEXCEPT
+		: m_sp(NULLPTR)
+	{ }
+
+public:
+	void prepare(void *stack, std::size_t size, void (*proc)(void *), void *param) NOEXCEPT;
+	void switch_to(AsmFiberContext &to) NOEXCEPT;
+};
+#endif
+
+// 使用 ucontext 实现。每次切换都会调用 sigprocmask()。
+class UcontextFiberContext : NONCOPYABLE {
+private:
+	::ucontext_t m_uc;
+	void *m_ctx[2];
+
+public:
+	UcontextFiberContext() NOEXCEPT {
+		m_ctx[0] = NULLPTR;
+		m_ctx[1] = NULLPTR;
+	}
+
+public:
+	void prepare(void *stack, std::size_t size, void (*proc)(void *), void *param) NOEXCEPT;
+	void switch_to(UcontextFiberContext &to) NOEXCEPT;
+};
+
+#if defined(POSEIDON_ENABLE_ASM_FIBER) && defined(POSEIDON_HAS_ASM_FIBER_CONTEXT)
+typedef AsmFiberContext FiberContext;
+#else
+typedef UcontextFiberContext FiberContext;
+#endif
+
+}
+
+#endif
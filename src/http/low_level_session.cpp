@@ -92,6 +92,12 @@ namespace Http {
 
 		return TcpSessionBase::send(STD_MOVE(encoded));
 	}
+	long LowLevelSession::on_encoded_file_avail(StreamBuffer encoded, int fd, boost::uint64_t offset, boost::uint64_t bytes){
+		PROFILE_ME;
+
+		// 头部和文件必须一起排队，否则其他线程发送的数据可能插入两者之间。
+		return TcpSessionBase::send_file(STD_MOVE(encoded), fd, offset, bytes);
+	}
 
 	boost::shared_ptr<UpgradedSessionBase> LowLevelSession::get_upgraded_session() const {
 		const Mutex::UniqueLock lock(m_upgraded_session_mutex);
@@ -136,6 +142,12 @@ namespace Http {
 		return ServerWriter::put_default_response(STD_MOVE(response_headers));
 	}
 
+	bool LowLevelSession::send_file(ResponseHeaders response_headers, int fd, boost::uint64_t offset, boost::uint64_t bytes){
+		PROFILE_ME;
+
+		return ServerWriter::put_file_response(STD_MOVE(response_headers), fd, offset, bytes);
+	}
+
 	bool LowLevelSession::send_chunked_header(ResponseHeaders response_headers){
 		PROFILE_ME;
 
@@ -48,6 +48,7 @@ namespace Http {
 
 		// ServerWriter
 		long on_encoded_data_avail(StreamBuffer encoded) OVERRIDE;
+		long on_encoded_file_avail(StreamBuffer encoded, int fd, boost::uint64_t offset, boost::uint64_t bytes) OVERRIDE;
 
 		// 可覆写。
 		virtual void on_low_level_request_headers(RequestHeaders request_headers, boost::uint64_t content_length) = 0;
@@ -62,6 +63,8 @@ namespace Http {
 		bool send(StatusCode status_code, StreamBuffer entity, const HeaderOption &content_type);
 		bool send(StatusCode status_code, OptionalMap headers, StreamBuffer entity = StreamBuffer());
 		bool send_default(StatusCode status_code, OptionalMap headers = OptionalMap());
+		// 发送文件 fd 中从 offset 开始的 bytes 字节作为响应实体。fd 会被复制，调用者可以在返回后关闭它。
+		bool send_file(ResponseHeaders response_headers, int fd, boost::uint64_t offset, boost::uint64_t bytes);
 
 		bool send_chunked_header(ResponseHeaders response_headers);
 		bool send_chunk(StreamBuffer entity);
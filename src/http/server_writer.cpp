@@ -11,21 +11,44 @@
 namespace Poseidon {
 
 namespace Http {
+	namespace {
+		// 状态行和头部，以空行结束。
+		void put_response_headers(StreamBuffer &data, const ResponseHeaders &response_headers){
+			const unsigned ver_major = response_headers.version / 10000, ver_minor = response_headers.version % 10000;
+			const unsigned status_code = static_cast<unsigned>(response_headers.status_code);
+			char temp[64];
+			const unsigned len = (unsigned)std::sprintf(temp, "HTTP/%u.%u %u ", ver_major, ver_minor, status_code);
+			data.put(temp, len);
+			data.put(response_headers.reason);
+			data.put("\r\n");
+
+			const AUTO_REF(headers, response_headers.headers);
+			for(AUTO(it, headers.begin()); it != headers.end(); ++it){
+				data.put(it->first.get());
+				data.put(": ");
+				data.put(it->second);
+				data.put("\r\n");
+			}
+			data.put("\r\n");
+		}
+	}
+
 	ServerWriter::ServerWriter(){ }
 	ServerWriter::~ServerWriter(){ }
 
-	long ServerWriter::put_response(ResponseHeaders response_headers, StreamBuffer entity, bool set_content_length){
+	long ServerWriter::on_encoded_file_avail(StreamBuffer encoded, int fd, boost::uint64_t offset, boost::uint64_t bytes){
 		PROFILE_ME;
 
-		StreamBuffer data;
+		if(bytes > SIZE_MAX){
+			LOG_POSEIDON_ERROR("File segment is too large: bytes = ", bytes);
+			DEBUG_THROW(BasicException, sslit("File segment is too large"));
+		}
+		encoded.put_file(fd, offset, static_cast<std::size_t>(bytes));
+		return on_encoded_data_avail(STD_MOVE(encoded));
+	}
 
-		const unsigned ver_major = response_headers.version / 10000, ver_minor = response_headers.version % 10000;
-		const unsigned status_code = static_cast<unsigned>(response_headers.status_code);
-		char temp[64];
-		unsigned len = (unsigned)std::sprintf(temp, "HTTP/%u.%u %u ", ver_major, ver_minor, status_code);
-		data.put(temp, len);
-		data.put(response_headers.reason);
-		data.put("\r\n");
+	long ServerWriter::put_response(ResponseHeaders response_headers, StreamBuffer entity, bool set_content_length){
+		PROFILE_ME;
 
 		AUTO_REF(headers, response_headers.headers);
 		if(entity.empty()){
@@ -37,19 +60,14 @@ namespace Http {
 		} else {
 			headers.erase("Transfer-Encoding");
 			if(set_content_length){
-				len = (unsigned)std::sprintf(temp, "%llu", (unsigned long long)entity.size());
+				char temp[64];
+				const unsigned len = (unsigned)std::sprintf(temp, "%llu", (unsigned long long)entity.size());
 				headers.set(sslit("Content-Length"), std::string(temp, len));
 			}
 		}
 
-		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
-			data.put(it->first.get());
-			data.put(": ");
-			data.put(it->second);
-			data.put("\r\n");
-		}
-		data.put("\r\n");
-
+		StreamBuffer data;
+		put_response_headers(data, response_headers);
 		data.splice(entity);
 
 		return on_encoded_data_avail(STD_MOVE(data));
@@ -77,18 +95,22 @@ namespace Http {
 		return put_response(STD_MOVE(response_headers), STD_MOVE(entity), true);
 	}
 
-	long ServerWriter::put_chunked_header(ResponseHeaders response_headers){
+	long ServerWriter::put_file_response(ResponseHeaders response_headers, int fd, boost::uint64_t offset, boost::uint64_t bytes){
 		PROFILE_ME;
 
+		AUTO_REF(headers, response_headers.headers);
+		headers.erase("Transfer-Encoding");
+		char temp[64];
+		const unsigned len = (unsigned)std::sprintf(temp, "%llu", (unsigned long long)bytes);
+		headers.set(sslit("Content-Length"), std::string(temp, len));
+
 		StreamBuffer data;
+		put_response_headers(data, response_headers);
+		return on_encoded_file_avail(STD_MOVE(data), fd, offset, bytes);
+	}
 
-		const unsigned ver_major = response_headers.version / 10000, ver_minor = response_headers.version % 10000;
-		const unsigned status_code = static_cast<unsigned>(response_headers.status_code);
-		char temp[64];
-		unsigned len = (unsigned)std::sprintf(temp, "HTTP/%u.%u %u ", ver_major, ver_minor, status_code);
-		data.put(temp, len);
-		data.put(response_headers.reason);
-		data.put("\r\n");
+	long ServerWriter::put_chunked_header(ResponseHeaders response_headers){
+		PROFILE_ME;
 
 		AUTO_REF(headers, response_headers.headers);
 		const AUTO_REF(transfer_encoding, headers.get("Transfer-Encoding"));
@@ -96,14 +118,8 @@ namespace Http {
 			headers.set(sslit("Transfer-Encoding"), "chunked");
 		}
 
-		for(AUTO(it, headers.begin()); it != headers.end(); ++it){
-			data.put(it->first.get());
-			data.put(": ");
-			data.put(it->second);
-			data.put("\r\n");
-		}
-		data.put("\r\n");
-
+		StreamBuffer data;
+		put_response_headers(data, response_headers);
 		return on_encoded_data_avail(STD_MOVE(data));
 	}
 	long ServerWriter::put_chunk(StreamBuffer entity){
@@ -21,10 +21,13 @@ namespace Http {
 
 	protected:
 		virtual long on_encoded_data_avail(StreamBuffer encoded) = 0;
+		// encoded 之后紧跟文件 fd 中从 offset 开始的 bytes 字节。默认实现把文件映射到 encoded 中。
+		virtual long on_encoded_file_avail(StreamBuffer encoded, int fd, boost::uint64_t offset, boost::uint64_t bytes);
 
 	public:
 		long put_response(ResponseHeaders response_headers, StreamBuffer entity, bool set_content_length);
 		long put_default_response(ResponseHeaders response_headers);
+		long put_file_response(ResponseHeaders response_headers, int fd, boost::uint64_t offset, boost::uint64_t bytes);
 
 		long put_chunked_header(ResponseHeaders response_headers);
 		long put_chunk(StreamBuffer entity);
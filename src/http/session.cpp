@@ -74,6 +74,11 @@ namespace Http {
 			: SyncJobBase(session)
 		{ }
 
+		// 只关闭连接，不会让出，不需要纤程。
+		bool may_yield() const OVERRIDE {
+			return false;
+		}
+
 	protected:
 		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
 			PROFILE_ME;
@@ -102,16 +107,28 @@ namespace Http {
 
 	class Session::RequestJob : public Session::SyncJobBase {
 	private:
+		const boost::weak_ptr<Session> m_weak_session;
 		RequestHeaders m_request_headers;
 		StreamBuffer m_entity;
 		bool m_keep_alive;
+		const boost::uint64_t m_queued_size;
 
 	public:
 		RequestJob(const boost::shared_ptr<Session> &session,
 			RequestHeaders request_headers, StreamBuffer entity, bool keep_alive)
 			: SyncJobBase(session)
-			, m_request_headers(STD_MOVE(request_headers)), m_entity(STD_MOVE(entity)), m_keep_alive(keep_alive)
-		{ }
+			, m_weak_session(session), m_request_headers(STD_MOVE(request_headers)), m_entity(STD_MOVE(entity)), m_keep_alive(keep_alive)
+			, m_queued_size(m_entity.size())
+		{
+			session->notify_receive_queued(m_queued_size);
+		}
+		~RequestJob(){
+			// 无论任务是否被执行，都要归还排队的数据量。
+			const AUTO(session, m_weak_session.lock());
+			if(session){
+				session->notify_receive_consumed(m_queued_size);
+			}
+		}
 
 	protected:
 		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
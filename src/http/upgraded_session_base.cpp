@@ -89,6 +89,21 @@ namespace Http {
 		parent->set_timeout(timeout);
 	}
 
+	void UpgradedSessionBase::notify_receive_queued(boost::uint64_t bytes) NOEXCEPT {
+		const AUTO(parent, get_parent());
+		if(!parent){
+			return;
+		}
+		parent->notify_receive_queued(bytes);
+	}
+	void UpgradedSessionBase::notify_receive_consumed(boost::uint64_t bytes) NOEXCEPT {
+		const AUTO(parent, get_parent());
+		if(!parent){
+			return;
+		}
+		parent->notify_receive_consumed(bytes);
+	}
+
 	bool UpgradedSessionBase::send(StreamBuffer buffer){
 		const AUTO(parent, get_parent());
 		if(!parent){
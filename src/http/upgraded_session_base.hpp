@@ -64,6 +64,9 @@ namespace Http {
 		void set_no_delay(bool enabled = true);
 		void set_timeout(boost::uint64_t timeout);
 
+		void notify_receive_queued(boost::uint64_t bytes) NOEXCEPT;
+		void notify_receive_consumed(boost::uint64_t bytes) NOEXCEPT;
+
 		bool send(StreamBuffer buffer) OVERRIDE;
 	};
 }
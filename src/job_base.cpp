@@ -9,6 +9,10 @@ namespace Poseidon {
 
 JobBase::~JobBase(){ }
 
+bool JobBase::may_yield() const {
+	return true;
+}
+
 void enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<const bool> withdrawn){
 	JobDispatcher::enqueue(STD_MOVE(job), STD_MOVE(withdrawn));
 }
@@ -21,6 +21,9 @@ public:
 	// 则所有具有相同 Category 的后续任务都会被推迟，以维持其相对顺序。
 	virtual boost::weak_ptr<const void> get_category() const = 0;
 	virtual void perform() = 0;
+
+	// 如果返回 false，该任务将直接在工作线程的栈上执行而不会创建纤程，此时不能调用 yield()。
+	virtual bool may_yield() const;
 };
 
 extern void enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<const bool> withdrawn);
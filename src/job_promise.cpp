@@ -9,8 +9,23 @@
 
 namespace Poseidon {
 
+namespace {
+	void wake_waiters(std::vector<boost::function<void ()> > &waiters) NOEXCEPT {
+		for(AUTO(it, waiters.begin()); it != waiters.end(); ++it){
+			try {
+				(*it)();
+			} catch(std::exception &e){
+				LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
+			} catch(...){
+				LOG_POSEIDON_ERROR("Unknown exception thrown");
+			}
+		}
+		waiters.clear();
+	}
+}
+
 JobPromise::JobPromise() NOEXCEPT
-	: m_satisfied(false), m_except()
+	: m_satisfied(false), m_except(), m_waiters()
 { }
 JobPromise::~JobPromise(){
 	if(!m_satisfied){
@@ -42,6 +57,15 @@ void JobPromise::check_and_rethrow() const {
 	}
 }
 
+bool JobPromise::add_waiter(boost::function<void ()> waiter) const {
+	const RecursiveMutex::UniqueLock lock(m_mutex);
+	if(m_satisfied){
+		return false;
+	}
+	m_waiters.push_back(STD_MOVE_IDN(waiter));
+	return true;
+}
+
 void JobPromise::set_success(){
 	const RecursiveMutex::UniqueLock lock(m_mutex);
 	if(m_satisfied){
@@ -49,6 +73,7 @@ void JobPromise::set_success(){
 	}
 	m_satisfied = true;
 //	m_except = VAL_INIT;
+	wake_waiters(m_waiters);
 }
 #ifdef POSEIDON_CXX11
 void JobPromise::set_exception(std::exception_ptr except)
@@ -62,6 +87,7 @@ void JobPromise::set_exception(boost::exception_ptr except)
 	}
 	m_satisfied = true;
 	m_except = STD_MOVE_IDN(except);
+	wake_waiters(m_waiters);
 }
 
 void yield(const boost::shared_ptr<const JobPromise> &promise, bool insignificant){
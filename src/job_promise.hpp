@@ -8,7 +8,9 @@
 #include "cxx_util.hpp"
 #include "recursive_mutex.hpp"
 #include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
 #include <boost/type_traits/remove_const.hpp>
+#include <vector>
 
 #ifdef POSEIDON_CXX11
 #	include <exception>
@@ -28,6 +30,7 @@ protected:
 #else
 	boost::exception_ptr m_except;
 #endif
+	mutable std::vector<boost::function<void ()> > m_waiters;
 
 public:
 	JobPromise() NOEXCEPT;
@@ -41,6 +44,10 @@ public:
 	bool would_throw() const NOEXCEPT;
 	void check_and_rethrow() const;
 
+	// 在该对象被满足时调用 waiter。如果已经被满足则不会保存 waiter，并返回 false。
+	// waiter 是在持有该对象的锁的情况下被调用的，因此不可以抛出异常，也不可以再次访问该对象。
+	bool add_waiter(boost::function<void ()> waiter) const;
+
 	void set_success();
 #ifdef POSEIDON_CXX11
 	void set_exception(std::exception_ptr except);
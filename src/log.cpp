@@ -5,8 +5,14 @@
 #include "log.hpp"
 #include "atomic.hpp"
 #include "time.hpp"
+#include "checked_arithmetic.hpp"
 #include "flags.hpp"
 #include "singletons/main_config.hpp"
+#include "thread.hpp"
+#include "mutex.hpp"
+#include "condition_variable.hpp"
+#include <sys/uio.h>
+#include <limits.h>
 
 namespace Poseidon {
 
@@ -39,6 +45,404 @@ namespace {
 	}
 
 	__thread char t_tag[5] = "----";
+
+	// 把 val 写到 end 之前，返回起始位置。
+	char *format_decimal(char *end, unsigned long long val) NOEXCEPT {
+		AUTO(begin, end);
+		do {
+			*--begin = static_cast<char>('0' + val % 10);
+			val /= 10;
+		} while(val != 0);
+		return begin;
+	}
+	char *format_hex(char *end, unsigned long long val) NOEXCEPT {
+		AUTO(begin, end);
+		do {
+			*--begin = "0123456789abcdef"[val % 16];
+			val /= 16;
+		} while(val != 0);
+		return begin;
+	}
+
+	// 每个线程缓存当前这一秒的时间字符串。
+	__thread boost::uint64_t t_time_cache_second = 0;
+	__thread char t_time_cache[32];
+	__thread std::size_t t_time_cache_size = 0;
+
+	// 组装一行日志。短的日志不分配内存。
+	class LineBuffer : NONCOPYABLE {
+	private:
+		char m_small[1024];
+		std::size_t m_small_size;
+		std::string m_large;
+
+	public:
+		LineBuffer()
+			: m_small_size(0)
+		{ }
+
+	public:
+		const char *data() const NOEXCEPT {
+			return m_large.empty() ? m_small : m_large.data();
+		}
+		std::size_t size() const NOEXCEPT {
+			return m_large.empty() ? m_small_size : m_large.size();
+		}
+
+		void append(const char *data, std::size_t size){
+			if(m_large.empty() && (size <= sizeof(m_small) - m_small_size)){
+				std::memcpy(m_small + m_small_size, data, size);
+				m_small_size += size;
+				return;
+			}
+			if(m_large.empty()){
+				m_large.reserve(m_small_size + size + 1024);
+				m_large.assign(m_small, m_small_size);
+			}
+			m_large.append(data, size);
+		}
+		void append(const char *str){
+			append(str, std::strlen(str));
+		}
+		void push_back(char ch){
+			if(m_large.empty() && (m_small_size < sizeof(m_small))){
+				m_small[m_small_size++] = ch;
+				return;
+			}
+			append(&ch, 1);
+		}
+
+		void append_decimal(unsigned long long val){
+			char temp[32];
+			const AUTO(begin, format_decimal(temp + sizeof(temp), val));
+			append(begin, static_cast<std::size_t>(temp + sizeof(temp) - begin));
+		}
+		void append_hex2(unsigned val){
+			push_back("0123456789ABCDEF"[(val >> 4) & 0x0F]);
+			push_back("0123456789ABCDEF"[val & 0x0F]);
+		}
+		void append_time(boost::uint64_t now){
+			const AUTO(second, now / 1000);
+			if(t_time_cache_second != second + 1){
+				char temp[64];
+				const AUTO(len, format_time(temp, sizeof(temp), second * 1000, false));
+				t_time_cache_size = std::min(len, sizeof(t_time_cache));
+				std::memcpy(t_time_cache, temp, t_time_cache_size);
+				t_time_cache_second = second + 1;
+			}
+			append(t_time_cache, t_time_cache_size);
+			const AUTO(ms, static_cast<unsigned>(now % 1000));
+			push_back('.');
+			push_back(static_cast<char>('0' + ms / 100));
+			push_back(static_cast<char>('0' + ms / 10 % 10));
+			push_back(static_cast<char>('0' + ms % 10));
+		}
+		// 控制字符替换为空格。
+		void append_sanitized(const char *data, std::size_t size){
+			for(std::size_t i = 0; i < size; ++i){
+				const AUTO(ch, static_cast<unsigned char>(data[i]));
+				if((ch < 0x20) || (ch == 0x7F)){
+					push_back(' ');
+				} else {
+					push_back(static_cast<char>(ch));
+				}
+			}
+		}
+	};
+
+	void write_all(int fd, ::iovec *vecs, std::size_t count) NOEXCEPT {
+		while(count != 0){
+			const ::ssize_t written = ::writev(fd, vecs, static_cast<int>(std::min<std::size_t>(count, IOV_MAX)));
+			if(written <= 0){
+				if((written < 0) && (errno == EINTR)){
+					continue;
+				}
+				break;
+			}
+			std::size_t remaining = static_cast<std::size_t>(written);
+			while((count != 0) && (remaining >= vecs->iov_len)){
+				remaining -= vecs->iov_len;
+				++vecs;
+				--count;
+			}
+			if(remaining != 0){
+				vecs->iov_base = static_cast<char *>(vecs->iov_base) + remaining;
+				vecs->iov_len -= remaining;
+			}
+		}
+	}
+	void write_sync(int fd, const char *data, std::size_t size) NOEXCEPT {
+		::iovec vec;
+		vec.iov_base = const_cast<char *>(data);
+		vec.iov_len = size;
+
+		int err_code = ::pthread_mutex_lock(&g_mutex);
+		(void)err_code;
+		assert(err_code == 0);
+		write_all(fd, &vec, 1);
+		err_code = ::pthread_mutex_unlock(&g_mutex);
+		assert(err_code == 0);
+	}
+
+	// 异步模式下，每个线程把格式化好的日志写入自己的环形缓冲区，由日志线程批量写出。
+	struct RecordHeader {
+		boost::uint32_t size; // 不含头部和对齐的字节。
+		boost::int32_t fd; // -1 表示跳到缓冲区开头。
+	};
+
+	std::size_t get_record_size(std::size_t size) NOEXCEPT {
+		return sizeof(RecordHeader) + (size + sizeof(RecordHeader) - 1) / sizeof(RecordHeader) * sizeof(RecordHeader);
+	}
+
+	struct LogRing {
+		LogRing *prev;
+		LogRing *next;
+		bool orphaned; // 所属线程已经退出。
+
+		char *data;
+		std::size_t capacity; // sizeof(RecordHeader) 的整数倍。
+		volatile std::size_t head; // 只由所属线程修改。
+		volatile std::size_t tail; // 只由日志线程修改。
+	};
+
+	volatile bool g_async_running = false;
+	std::size_t g_async_buffer_size = 262144;
+	bool g_async_block_on_overflow = false;
+	volatile boost::uint64_t g_dropped = 0;
+
+	// 保护 g_rings 和每个缓冲区的 prev、next、orphaned 成员。
+	Mutex g_ring_mutex;
+	LogRing *g_rings = NULLPTR;
+	// 同一时刻只有一个线程读取缓冲区。只有持有这个锁的线程才能释放缓冲区。
+	Mutex g_drain_mutex;
+
+	Mutex g_writer_mutex;
+	ConditionVariable g_writer_avail;
+	volatile bool g_writer_sleeping = false;
+	Thread g_writer;
+
+	__thread LogRing *t_ring = 0; // XXX: NULLPTR
+	__thread bool t_in_logger = false;
+
+	::pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+	::pthread_key_t g_ring_key;
+
+	void wake_writer() NOEXCEPT {
+		if(atomic_load(g_writer_sleeping, ATOMIC_CONSUME)){
+			g_writer_avail.signal();
+		}
+	}
+
+	// 调用者必须持有 g_drain_mutex。写文件时不持有 g_ring_mutex，线程创建和退出不会被输出阻塞。
+	void drain_rings_unlocked(std::vector< ::iovec> (&vecs)[2], std::vector<std::pair<LogRing *, std::size_t> > &ends){
+		vecs[0].clear();
+		vecs[1].clear();
+		ends.clear();
+		Mutex::UniqueLock ring_lock(g_ring_mutex);
+		for(AUTO(ring, g_rings); ring; ring = ring->next){
+			const AUTO(head, atomic_load(ring->head, ATOMIC_ACQUIRE));
+			AUTO(pos, ring->tail);
+			if(pos == head){
+				continue;
+			}
+			while(pos != head){
+				const AUTO(offset, pos % ring->capacity);
+				RecordHeader header;
+				std::memcpy(&header, ring->data + offset, sizeof(header));
+				if(header.fd < 0){
+					pos += ring->capacity - offset;
+					continue;
+				}
+				::iovec vec;
+				vec.iov_base = ring->data + offset + sizeof(header);
+				vec.iov_len = header.size;
+				vecs[header.fd == STDERR_FILENO].push_back(vec);
+				pos += get_record_size(header.size);
+			}
+			ends.push_back(std::make_pair(ring, pos));
+		}
+		if(ends.empty()){
+			return;
+		}
+		// 缓冲区只由持有 g_drain_mutex 的线程释放，因此解锁之后 iovec 仍然有效。
+		ring_lock.unlock();
+
+		int err_code = ::pthread_mutex_lock(&g_mutex);
+		(void)err_code;
+		assert(err_code == 0);
+		if(!vecs[0].empty()){
+			write_all(STDOUT_FILENO, vecs[0].data(), vecs[0].size());
+		}
+		if(!vecs[1].empty()){
+			write_all(STDERR_FILENO, vecs[1].data(), vecs[1].size());
+		}
+		err_code = ::pthread_mutex_unlock(&g_mutex);
+		assert(err_code == 0);
+
+		for(AUTO(it, ends.begin()); it != ends.end(); ++it){
+			atomic_store(it->first->tail, it->second, ATOMIC_RELEASE);
+		}
+
+		ring_lock.lock();
+		AUTO(ring, g_rings);
+		while(ring){
+			const AUTO(next, ring->next);
+			if(ring->orphaned && (ring->tail == atomic_load(ring->head, ATOMIC_ACQUIRE))){
+				if(ring->prev){
+					ring->prev->next = next;
+				} else {
+					g_rings = next;
+				}
+				if(next){
+					next->prev = ring->prev;
+				}
+				delete[] ring->data;
+				delete ring;
+			}
+			ring = next;
+		}
+	}
+	void drain_all() NOEXCEPT
+	try {
+		std::vector< ::iovec> vecs[2];
+		std::vector<std::pair<LogRing *, std::size_t> > ends;
+		const Mutex::UniqueLock lock(g_drain_mutex);
+		drain_rings_unlocked(vecs, ends);
+	} catch(...){
+		//
+	}
+
+	void writer_proc(){
+		std::vector< ::iovec> vecs[2];
+		std::vector<std::pair<LogRing *, std::size_t> > ends;
+		boost::uint64_t reported = 0;
+		boost::uint64_t last_report_time = 0;
+		for(;;){
+			const bool running = atomic_load(g_async_running, ATOMIC_CONSUME);
+			bool busy;
+			{
+				const Mutex::UniqueLock lock(g_drain_mutex);
+				drain_rings_unlocked(vecs, ends);
+				busy = !ends.empty();
+			}
+			// 每秒最多报告一次。
+			const AUTO(dropped, atomic_load(g_dropped, ATOMIC_RELAXED));
+			const AUTO(now, get_fast_mono_clock());
+			if((dropped != reported) && (!running || (now >= saturated_add(last_report_time, static_cast<boost::uint64_t>(1000))))){
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_WARNING,
+					"Log buffer overflow: ", dropped - reported, " message(s) dropped, ", dropped, " in total");
+				reported = dropped;
+				last_report_time = now;
+				busy = true;
+			}
+			if(!running){
+				break;
+			}
+			if(!busy){
+				Mutex::UniqueLock lock(g_writer_mutex);
+				atomic_store(g_writer_sleeping, true, ATOMIC_RELEASE);
+				g_writer_avail.timed_wait(lock, 100);
+				atomic_store(g_writer_sleeping, false, ATOMIC_RELEASE);
+			}
+		}
+	}
+
+	void ring_destructor(void *p) NOEXCEPT {
+		const AUTO(ring, static_cast<LogRing *>(p));
+		t_ring = NULLPTR;
+		{
+			const Mutex::UniqueLock lock(g_ring_mutex);
+			ring->orphaned = true;
+		}
+		if(!atomic_load(g_async_running, ATOMIC_CONSUME)){
+			drain_all();
+		}
+	}
+	void create_ring_key() NOEXCEPT {
+		const int err_code = ::pthread_key_create(&g_ring_key, &ring_destructor);
+		if(err_code != 0){
+			std::abort();
+		}
+	}
+	LogRing *get_thread_ring() NOEXCEPT {
+		AUTO(ring, t_ring);
+		if(ring){
+			return ring;
+		}
+		::pthread_once(&g_ring_key_once, &create_ring_key);
+		ring = new(std::nothrow) LogRing();
+		if(!ring){
+			return NULLPTR;
+		}
+		ring->capacity = std::max<std::size_t>(g_async_buffer_size / sizeof(RecordHeader), 64) * sizeof(RecordHeader);
+		ring->data = new(std::nothrow) char[ring->capacity];
+		if(!ring->data || (::pthread_setspecific(g_ring_key, ring) != 0)){
+			delete[] ring->data;
+			delete ring;
+			return NULLPTR;
+		}
+		{
+			const Mutex::UniqueLock lock(g_ring_mutex);
+			ring->prev = NULLPTR;
+			ring->next = g_rings;
+			if(g_rings){
+				g_rings->prev = ring;
+			}
+			g_rings = ring;
+		}
+		t_ring = ring;
+		return ring;
+	}
+
+	// 返回 false 表示调用者应该同步写出。
+	bool push_async(int fd, const char *data, std::size_t size) NOEXCEPT {
+		const AUTO(ring, get_thread_ring());
+		if(!ring){
+			return false;
+		}
+		const AUTO(record_size, get_record_size(size));
+		if(record_size > ring->capacity / 2){
+			return false;
+		}
+		for(;;){
+			const AUTO(head, ring->head);
+			const AUTO(tail, atomic_load(ring->tail, ATOMIC_ACQUIRE));
+			const AUTO(offset, head % ring->capacity);
+			const AUTO(bytes_to_end, ring->capacity - offset);
+			// 放不下的话，用一个空的头部跳到开头。
+			const AUTO(bytes_needed, (bytes_to_end < record_size) ? (bytes_to_end + record_size) : record_size);
+			if(ring->capacity - (head - tail) >= bytes_needed){
+				RecordHeader header;
+				AUTO(pos, offset);
+				if(bytes_to_end < record_size){
+					header.size = 0;
+					header.fd = -1;
+					std::memcpy(ring->data + pos, &header, sizeof(header));
+					pos = 0;
+				}
+				header.size = static_cast<boost::uint32_t>(size);
+				header.fd = fd;
+				std::memcpy(ring->data + pos, &header, sizeof(header));
+				std::memcpy(ring->data + pos + sizeof(header), data, size);
+				atomic_store(ring->head, head + bytes_needed, ATOMIC_RELEASE);
+				wake_writer();
+				return true;
+			}
+			if(!g_async_block_on_overflow){
+				atomic_add(g_dropped, 1, ATOMIC_RELAXED);
+				wake_writer();
+				return true;
+			}
+			if(!atomic_load(g_async_running, ATOMIC_CONSUME)){
+				return false;
+			}
+			wake_writer();
+			::timespec req;
+			req.tv_sec = 0;
+			req.tv_nsec = 1000000;
+			::nanosleep(&req, NULLPTR);
+		}
+	}
 }
 
 boost::uint64_t Logger::get_mask() NOEXCEPT {
@@ -71,6 +475,39 @@ void Logger::finalize_mask() NOEXCEPT {
 	set_mask(0, SP_POSEIDON | SP_MAJOR | LV_INFO | LV_WARNING | LV_ERROR | LV_FATAL);
 }
 
+bool Logger::initialize_async_from_config(){
+	bool enabled = false;
+	MainConfig::get(enabled, "log_async_enabled");
+	if(!enabled){
+		return false;
+	}
+	MainConfig::get(g_async_buffer_size, "log_async_buffer_size");
+	MainConfig::get(g_async_block_on_overflow, "log_async_block_on_overflow");
+
+	if(atomic_exchange(g_async_running, true, ATOMIC_ACQ_REL) != false){
+		return true;
+	}
+	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Starting asynchronous log writer...");
+	LOG_POSEIDON_DEBUG("log_async_buffer_size = ", g_async_buffer_size, ", log_async_block_on_overflow = ", g_async_block_on_overflow);
+	Thread(writer_proc, "   L").swap(g_writer);
+	return true;
+}
+void Logger::finalize_async() NOEXCEPT {
+	if(atomic_exchange(g_async_running, false, ATOMIC_ACQ_REL) == false){
+		return;
+	}
+	g_writer_avail.signal();
+	if(g_writer.joinable()){
+		g_writer.join();
+	}
+	// 日志线程退出之后写入的数据。
+	drain_all();
+	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopped asynchronous log writer.");
+}
+boost::uint64_t Logger::get_dropped_count() NOEXCEPT {
+	return atomic_load(g_dropped, ATOMIC_RELAXED);
+}
+
 const char *Logger::get_thread_tag() NOEXCEPT {
 	return t_tag;
 }
@@ -90,6 +527,7 @@ void Logger::set_thread_tag(const char *new_tag) NOEXCEPT {
 
 Logger::Logger(boost::uint64_t mask, const char *file, std::size_t line) NOEXCEPT
 	: m_mask(mask), m_file(file), m_line(line)
+	, m_small_size(0)
 { }
 Logger::~Logger() NOEXCEPT
 try {
@@ -108,133 +546,252 @@ try {
 
 	AUTO_REF(level_elem, LEVEL_ELEMENTS[__builtin_ctzll(m_mask | LV_TRACE)]);
 
-	char temp[256];
-	unsigned len;
-
-	std::string line;
-	line.reserve(255);
+	LineBuffer line;
 
 	if(use_ascii_colors){
-		line += "\x1B[0;32m";
+		line.append("\x1B[0;32m");
 	}
-	len = format_time(temp, sizeof(temp), get_local_time(), true);
-	line.append(temp, len);
+	line.append_time(get_local_time());
 
 	if(use_ascii_colors){
-		line += "\x1B[0;33m";
+		line.append("\x1B[0;33m");
 	}
-	len = (unsigned)std::sprintf(temp, " %02X ", (unsigned)((m_mask >> 8) & 0xFF));
-	line.append(temp, len);
+	line.push_back(' ');
+	line.append_hex2(static_cast<unsigned>((m_mask >> 8) & 0xFF));
+	line.push_back(' ');
 
 	if(use_ascii_colors){
-		line += "\x1B[0;39m";
+		line.append("\x1B[0;39m");
 	}
-	line += '[';
+	line.push_back('[');
 	line.append(t_tag, sizeof(t_tag) - 1);
-	line += ']';
-	line += ' ';
+	line.push_back(']');
+	line.push_back(' ');
 
 	if(use_ascii_colors){
-		line +="\x1B[0;30;4";
-		line += level_elem.color;
-		line += 'm';
+		line.append("\x1B[0;30;4");
+		line.push_back(level_elem.color);
+		line.push_back('m');
 	}
-	line += level_elem.text;
+	line.append(level_elem.text);
 	if(use_ascii_colors){
-		line +="\x1B[0;3";
-		line += level_elem.color;
+		line.append("\x1B[0;3");
+		line.push_back(level_elem.color);
 		if(level_elem.highlighted){
-			line += ';';
-			line += '1';
+			line.push_back(';');
+			line.push_back('1');
 		}
-		line += 'm';
+		line.push_back('m');
 	}
-	line += ' ';
+	line.push_back(' ');
 
-	StreamBuffer buffer = STD_MOVE(m_stream.get_buffer());
-	int ch;
-	while((ch = buffer.get()) >= 0){
-		if((ch + 1 <= 0x20) || (ch == 0x7F)){
-			ch = ' ';
-		}
-		line.push_back((char)ch);
+	const char *text;
+	std::size_t text_size;
+	if(m_large.empty()){
+		text = m_small;
+		text_size = m_small_size;
+	} else {
+		text = m_large.data();
+		text_size = m_large.size();
 	}
-	line += ' ';
+	line.append_sanitized(text, text_size);
+	line.push_back(' ');
 
 	if(use_ascii_colors){
-		line += "\x1B[0;34m";
+		line.append("\x1B[0;34m");
 	}
-	line += '#';
-	line += m_file;
-	len = (unsigned)std::sprintf(temp, ":%lu", (unsigned long)m_line);
-	line.append(temp, len);
+	line.push_back('#');
+	line.append(m_file);
+	line.push_back(':');
+	line.append_decimal(m_line);
 
 	if(use_ascii_colors){
-		line += "\x1B[0m";
+		line.append("\x1B[0m");
 	}
-	line += '\n';
+	line.push_back('\n');
 
-	int err_code = ::pthread_mutex_lock(&g_mutex);
-	(void)err_code;
-	assert(err_code == 0);
-	std::size_t total = 0;
-	::ssize_t written;
-	while((total < line.size()) && (written = ::write(fd, line.data() + total, line.size() - total)) > 0){
-		total += (std::size_t)written;
+	// 致命错误之后进程可能立即退出，因此总是同步写出。在信号处理函数中重入时也是如此。
+	if((&level_elem != LEVEL_ELEMENTS) && !t_in_logger && atomic_load(g_async_running, ATOMIC_CONSUME)){
+		t_in_logger = true;
+		const bool queued = push_async(fd, line.data(), line.size());
+		t_in_logger = false;
+		if(queued){
+			return;
+		}
 	}
-	err_code = ::pthread_mutex_unlock(&g_mutex);
-	assert(err_code == 0);
+	write_sync(fd, line.data(), line.size());
 } catch(...){
 	return;
 }
 
+void Logger::append(const char *data, std::size_t size){
+	if(m_large.empty() && (size <= sizeof(m_small) - m_small_size)){
+		std::memcpy(m_small + m_small_size, data, size);
+		m_small_size += size;
+		return;
+	}
+	if(m_large.empty()){
+		m_large.reserve(m_small_size + size + 256);
+		m_large.assign(m_small, m_small_size);
+	}
+	m_large.append(data, size);
+}
+void Logger::append_unsigned(unsigned long long val){
+	char temp[32];
+	const AUTO(begin, format_decimal(temp + sizeof(temp), val));
+	append(begin, static_cast<std::size_t>(temp + sizeof(temp) - begin));
+}
+void Logger::append_signed(long long val){
+	char temp[32];
+	AUTO(begin, format_decimal(temp + sizeof(temp), (val < 0) ? (0ull - static_cast<unsigned long long>(val)) : static_cast<unsigned long long>(val)));
+	if(val < 0){
+		*--begin = '-';
+	}
+	append(begin, static_cast<std::size_t>(temp + sizeof(temp) - begin));
+}
+Buffer_ostream &Logger::get_stream(){
+	if(!m_stream){
+		m_stream.reset(new Buffer_ostream);
+	}
+	return *m_stream;
+}
+void Logger::flush_stream(){
+	AUTO_REF(buffer, m_stream->get_buffer());
+	char temp[256];
+	std::size_t size;
+	while((size = buffer.get(temp, sizeof(temp))) != 0){
+		append(temp, size);
+	}
+}
+
 void Logger::put(bool val){
-	m_stream <<std::boolalpha <<val;
+	if(m_stream){
+		*m_stream <<std::boolalpha <<val;
+		flush_stream();
+		return;
+	}
+	if(val){
+		append("true", 4);
+	} else {
+		append("false", 5);
+	}
 }
 void Logger::put(char val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append(&val, 1);
 }
 void Logger::put(signed char val){
-	m_stream <<static_cast<int>(val);
+	if(put_to_stream(static_cast<int>(val))){
+		return;
+	}
+	append_signed(val);
 }
 void Logger::put(unsigned char val){
-	m_stream <<static_cast<unsigned>(val);
+	if(put_to_stream(static_cast<unsigned>(val))){
+		return;
+	}
+	append_unsigned(val);
 }
 void Logger::put(short val){
-	m_stream <<static_cast<int>(val);
+	if(put_to_stream(static_cast<int>(val))){
+		return;
+	}
+	append_signed(val);
 }
 void Logger::put(unsigned short val){
-	m_stream <<static_cast<unsigned>(val);
+	if(put_to_stream(static_cast<unsigned>(val))){
+		return;
+	}
+	append_unsigned(val);
 }
 void Logger::put(int val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append_signed(val);
 }
 void Logger::put(unsigned val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append_unsigned(val);
 }
 void Logger::put(long val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append_signed(val);
 }
 void Logger::put(unsigned long val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append_unsigned(val);
 }
 void Logger::put(long long val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append_signed(val);
 }
 void Logger::put(unsigned long long val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	append_unsigned(val);
 }
 void Logger::put(const char *val){
-	m_stream <<val;
+	if(val && put_to_stream(val)){
+		return;
+	}
+	if(!val){
+		append("(null)", 6);
+		return;
+	}
+	append(val, std::strlen(val));
 }
 void Logger::put(const signed char *val){
-	m_stream <<static_cast<const void *>(val);
+	put(static_cast<const void *>(val));
 }
 void Logger::put(const unsigned char *val){
-	m_stream <<static_cast<const void *>(val);
+	put(static_cast<const void *>(val));
 }
 void Logger::put(const void *val){
-	m_stream <<val;
+	if(put_to_stream(val)){
+		return;
+	}
+	// 与 std::ostream 的输出一致。
+	if(!val){
+		append("0", 1);
+		return;
+	}
+	char temp[32];
+	AUTO(begin, format_hex(temp + sizeof(temp), reinterpret_cast<std::size_t>(val)));
+	*--begin = 'x';
+	*--begin = '0';
+	append(begin, static_cast<std::size_t>(temp + sizeof(temp) - begin));
+}
+void Logger::put(const std::string &val){
+	if(put_to_stream(val)){
+		return;
+	}
+	append(val.data(), val.size());
+}
+void Logger::put(float val){
+	put(static_cast<double>(val));
+}
+void Logger::put(double val){
+	if(put_to_stream(val)){
+		return;
+	}
+	// 与 std::ostream 的默认格式一致。
+	char temp[64];
+	const int len = std::snprintf(temp, sizeof(temp), "%g", val);
+	if(len > 0){
+		append(temp, std::min(static_cast<std::size_t>(len), sizeof(temp) - 1));
+	}
 }
 
 }
@@ -8,7 +8,19 @@
 #include "cxx_util.hpp"
 #include "buffer_streams.hpp"
 #include <cstddef>
+#include <string>
 #include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+
+// 编译期的日志级别下限，取 Logger::LV_* 的低六位。级别更低的日志（SP_MAJOR 除外）在编译期被移除。
+// 默认在定义了 NDEBUG 时移除 DEBUG 和 TRACE。
+#ifndef POSEIDON_LOG_MIN_LEVEL
+#  ifdef NDEBUG
+#    define POSEIDON_LOG_MIN_LEVEL  0x08
+#  else
+#    define POSEIDON_LOG_MIN_LEVEL  0x20
+#  endif
+#endif
 
 namespace Poseidon {
 
@@ -36,6 +48,12 @@ public:
 	static bool initialize_mask_from_config();
 	static void finalize_mask() NOEXCEPT;
 
+	// 异步模式下日志由单独的线程批量写出。finalize_async() 写出所有剩余的日志。
+	static bool initialize_async_from_config();
+	static void finalize_async() NOEXCEPT;
+	// 缓冲区满时丢弃的日志条数。
+	static boost::uint64_t get_dropped_count() NOEXCEPT;
+
 	static const char *get_thread_tag() NOEXCEPT;
 	static void set_thread_tag(const char *new_tag) NOEXCEPT;
 
@@ -44,13 +62,34 @@ private:
 	const char *const m_file;
 	const std::size_t m_line;
 
-	Buffer_ostream m_stream;
+	// 短的日志只使用栈上的缓冲区。
+	char m_small[256];
+	std::size_t m_small_size;
+	std::string m_large;
+	// 只在输出其他类型或者 std::hex 等操纵符时创建，之后的所有参数都通过它格式化。
+	boost::scoped_ptr<Buffer_ostream> m_stream;
 
 public:
 	Logger(boost::uint64_t mask, const char *file, std::size_t line) NOEXCEPT;
 	~Logger() NOEXCEPT;
 
 private:
+	void append(const char *data, std::size_t size);
+	void append_unsigned(unsigned long long val);
+	void append_signed(long long val);
+	Buffer_ostream &get_stream();
+	void flush_stream();
+
+	template<typename T>
+	bool put_to_stream(const T &val){
+		if(!m_stream){
+			return false;
+		}
+		*m_stream <<val;
+		flush_stream();
+		return true;
+	}
+
 	// operator<< 的 name lookup 拖慢编译速度。
 	void put(bool val);
 	void put(char val);
@@ -68,10 +107,15 @@ private:
 	void put(const signed char *val);
 	void put(const unsigned char *val);
 	void put(const void *val);
+	void put(const std::string &val);
+	void put(float val);
+	void put(double val);
 
+	// 其他类型通过 std::ostream 格式化。
 	template<typename T>
 	void put(const T &val){
-		m_stream <<val;
+		get_stream() <<val;
+		flush_stream();
 	}
 
 public:
@@ -87,7 +131,9 @@ public:
 
 }
 
-#define LOG_MASK(mask_, ...)	    (::Poseidon::Logger::check_mask(mask_) &&	\
+#define LOG_MASK_ENABLED_(mask_)    (((mask_) & ::Poseidon::Logger::SP_MAJOR) || (((mask_) & 0x3F) <= POSEIDON_LOG_MIN_LEVEL))
+
+#define LOG_MASK(mask_, ...)	    (LOG_MASK_ENABLED_(mask_) && ::Poseidon::Logger::check_mask(mask_) &&	\
                                       (static_cast<void>(::Poseidon::Logger(mask_, __FILE__, __LINE__), __VA_ARGS__), true))
 
 #define LOG_POSEIDON(level_, ...)   LOG_MASK(::Poseidon::Logger::SP_POSEIDON | (level_), __VA_ARGS__)
@@ -69,6 +69,15 @@ namespace {
 
 #define START(x_)   const RaiiSingletonRunner<x_> UNIQUE_ID
 
+	struct RaiiAsyncLogger : NONCOPYABLE {
+		RaiiAsyncLogger(){
+			Logger::initialize_async_from_config();
+		}
+		~RaiiAsyncLogger(){
+			Logger::finalize_async();
+		}
+	};
+
 	void run(){
 		PROFILE_ME;
 
@@ -159,6 +168,7 @@ try {
 	MainConfig::set_run_path(run_path);
 	MainConfig::reload();
 
+	const RaiiAsyncLogger async_logger;
 	START(ProfileDepository);
 	run();
 
@@ -13,6 +13,7 @@
 #include "../time.hpp"
 #include "../system_exception.hpp"
 #include "../uuid.hpp"
+#include "../atomic.hpp"
 
 namespace Poseidon {
 
@@ -35,15 +36,29 @@ namespace MySql {
 			}
 		};
 
+		struct StatementCloser {
+			CONSTEXPR ::MYSQL_STMT *operator()() const NOEXCEPT {
+				return NULLPTR;
+			}
+			void operator()(::MYSQL_STMT *stmt) const NOEXCEPT {
+				::mysql_stmt_close(stmt);
+			}
+		};
+
 		struct FieldComparator {
 			bool operator()(const char *lhs, const char *rhs) const NOEXCEPT {
 				return std::strcmp(lhs, rhs) < 0;
 			}
 		};
 
+		volatile boost::uint64_t g_result_serial = 0;
+
 #define DEBUG_THROW_MYSQL_EXCEPTION(mysql_, schema_)	\
 		DEBUG_THROW(::Poseidon::MySql::Exception, schema_, ::mysql_errno(mysql_), ::Poseidon::SharedNts(::mysql_error(mysql_)))
 
+#define DEBUG_THROW_MYSQL_STMT_EXCEPTION(stmt_, schema_)	\
+		DEBUG_THROW(::Poseidon::MySql::Exception, schema_, ::mysql_stmt_errno(stmt_), ::Poseidon::SharedNts(::mysql_stmt_error(stmt_)))
+
 		class DelegatedConnection : public Connection {
 		private:
 			const ThreadContext m_context;
@@ -56,12 +71,17 @@ namespace MySql {
 			boost::container::flat_map<const char *, std::size_t, FieldComparator> m_fields;
 			::MYSQL_ROW m_row;
 			unsigned long *m_lengths;
+			boost::uint64_t m_result_serial;
+
+			boost::container::flat_map<std::string, ::MYSQL_STMT *> m_statements;
+			::MYSQL_STMT *m_last_statement; // 用于 get_insert_id()。
 
 		public:
 			DelegatedConnection(const char *server_addr, unsigned server_port,
 				const char *user_name, const char *password, const char *schema, bool use_ssl, const char *charset)
 				: m_schema(schema)
-				, m_row(NULLPTR), m_lengths(NULLPTR)
+				, m_row(NULLPTR), m_lengths(NULLPTR), m_result_serial(0)
+				, m_last_statement(NULLPTR)
 			{
 				if(!m_mysql.reset(::mysql_init(&m_mysql_storage))){
 					DEBUG_THROW(SystemException, ENOMEM);
@@ -86,6 +106,12 @@ namespace MySql {
 					DEBUG_THROW_MYSQL_EXCEPTION(m_mysql.get(), m_schema);
 				}
 			}
+			~DelegatedConnection(){
+				// 预处理语句必须在连接关闭之前释放。
+				for(AUTO(it, m_statements.begin()); it != m_statements.end(); ++it){
+					::mysql_stmt_close(it->second);
+				}
+			}
 
 		private:
 			bool find_field_and_check(const char *&data, std::size_t &size, const char *name) const {
@@ -98,22 +124,35 @@ namespace MySql {
 					LOG_POSEIDON_WARNING("Field not found: name = ", name);
 					return false;
 				}
-				data = m_row[it->second];
+				return check_field(data, size, it->second);
+			}
+			bool check_field(const char *&data, std::size_t &size, std::size_t index) const {
+				if(!m_row){
+					LOG_POSEIDON_WARNING("No more results available.");
+					return false;
+				}
+				if(index >= m_fields.size()){
+					// 由 find_field_index() 返回的无效索引，查找时已经报告过了。
+					return false;
+				}
+				data = m_row[index];
 				if(!data){
-					LOG_POSEIDON_DEBUG("Field is null: name = ", name);
+					LOG_POSEIDON_DEBUG("Field is null: index = ", index);
 					return false;
 				}
-				size = m_lengths[it->second];
+				size = m_lengths[index];
 				return true;
 			}
 
 		public:
 			void do_execute_sql(const char *sql, std::size_t len){
 				do_discard_result();
+				m_last_statement = NULLPTR;
 
 				if(::mysql_real_query(m_mysql.get(), sql, len) != 0){
 					DEBUG_THROW_MYSQL_EXCEPTION(m_mysql.get(), m_schema);
 				}
+				m_result_serial = atomic_add(g_result_serial, 1, ATOMIC_RELAXED);
 
 				if(!m_result.reset(::mysql_use_result(m_mysql.get()))){
 					if(::mysql_errno(m_mysql.get()) != 0){
@@ -141,7 +180,125 @@ namespace MySql {
 				m_lengths = NULLPTR;
 			}
 
+			bool do_has_prepared_statement(const std::string &key) const {
+				return m_statements.find(key) != m_statements.end();
+			}
+			void do_prepare_statement(const std::string &key, const std::string &sql){
+				do_discard_result();
+
+				UniqueHandle<StatementCloser> stmt;
+				if(!stmt.reset(::mysql_stmt_init(m_mysql.get()))){
+					DEBUG_THROW_MYSQL_EXCEPTION(m_mysql.get(), m_schema);
+				}
+				if(::mysql_stmt_prepare(stmt.get(), sql.data(), sql.size()) != 0){
+					DEBUG_THROW_MYSQL_STMT_EXCEPTION(stmt.get(), m_schema);
+				}
+				LOG_POSEIDON_DEBUG("Prepared MySQL statement: key = ", key, ", sql = ", sql);
+
+				AUTO_REF(old_stmt, m_statements[key]);
+				if(old_stmt){
+					if(m_last_statement == old_stmt){
+						m_last_statement = NULLPTR;
+					}
+					::mysql_stmt_close(old_stmt);
+				}
+				old_stmt = stmt.release();
+			}
+			void do_execute_prepared(const std::string &key, const Connection::StatementParams &params){
+				do_discard_result();
+				m_last_statement = NULLPTR;
+
+				const AUTO(it, m_statements.find(key));
+				if(it == m_statements.end()){
+					LOG_POSEIDON_ERROR("Prepared statement not found: key = ", key);
+					DEBUG_THROW(BasicException, sslit("Prepared statement not found"));
+				}
+				::MYSQL_STMT *const stmt = it->second;
+				const std::size_t count = params.size();
+				if(::mysql_stmt_param_count(stmt) != count){
+					LOG_POSEIDON_ERROR("Parameter count mismatch: key = ", key,
+						", expecting ", ::mysql_stmt_param_count(stmt), ", got ", count);
+					DEBUG_THROW(BasicException, sslit("Parameter count mismatch"));
+				}
+
+				// MYSQL_BIND 指向的数据在 mysql_stmt_execute() 返回之前必须有效。
+				boost::container::vector< ::MYSQL_BIND> binds(count);
+				boost::container::vector< ::MYSQL_TIME> times(count);
+				boost::container::vector<unsigned long> lengths(count);
+				for(std::size_t i = 0; i < count; ++i){
+					const AUTO_REF(elem, params.at(i));
+					AUTO_REF(bind, binds.at(i));
+					std::memset(&bind, 0, sizeof(bind));
+					switch(elem.type){
+					case Connection::StatementParams::T_SIGNED:
+						bind.buffer_type = MYSQL_TYPE_LONGLONG;
+						bind.buffer = const_cast<boost::int64_t *>(&(elem.num.i));
+						break;
+					case Connection::StatementParams::T_UNSIGNED:
+						bind.buffer_type = MYSQL_TYPE_LONGLONG;
+						bind.buffer = const_cast<boost::uint64_t *>(&(elem.num.u));
+						bind.is_unsigned = true;
+						break;
+					case Connection::StatementParams::T_DOUBLE:
+						bind.buffer_type = MYSQL_TYPE_DOUBLE;
+						bind.buffer = const_cast<double *>(&(elem.num.d));
+						break;
+					case Connection::StatementParams::T_DATETIME:
+						{
+							// 与 format_time() 保持一致：0 和 -1 分别表示最小和最大的时间。
+							DateTime dt = { 1234, 1, 1, 0, 0, 0, 0 };
+							if(elem.num.u == 0){
+								dt.yr = 0;
+							} else if(elem.num.u == (boost::uint64_t)-1){
+								dt.yr = 9999;
+							} else {
+								dt = break_down_time(elem.num.u);
+							}
+							AUTO_REF(time, times.at(i));
+							std::memset(&time, 0, sizeof(time));
+							time.year = dt.yr;
+							time.month = dt.mon;
+							time.day = dt.day;
+							time.hour = dt.hr;
+							time.minute = dt.min;
+							time.second = dt.sec;
+							time.second_part = dt.ms * 1000ul;
+							time.time_type = MYSQL_TIMESTAMP_DATETIME;
+							bind.buffer_type = MYSQL_TYPE_DATETIME;
+							bind.buffer = &time;
+						}
+						break;
+					case Connection::StatementParams::T_STRING:
+					case Connection::StatementParams::T_BLOB:
+						lengths.at(i) = elem.str.size();
+						bind.buffer_type = (elem.type == Connection::StatementParams::T_BLOB) ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+						bind.buffer = const_cast<char *>(elem.str.data());
+						bind.buffer_length = elem.str.size();
+						bind.length = &(lengths.at(i));
+						break;
+					default:
+						LOG_POSEIDON_ERROR("Unknown parameter type: ", static_cast<int>(elem.type));
+						DEBUG_THROW(BasicException, sslit("Unknown parameter type"));
+					}
+				}
+				if(::mysql_stmt_bind_param(stmt, binds.data()) != 0){
+					DEBUG_THROW_MYSQL_STMT_EXCEPTION(stmt, m_schema);
+				}
+				if(::mysql_stmt_execute(stmt) != 0){
+					const AUTO(err_code, ::mysql_stmt_errno(stmt));
+					const SharedNts err_msg(::mysql_stmt_error(stmt));
+					// 出错之后语句句柄可能已经失效（比如连接被重置），下次重新准备。
+					::mysql_stmt_close(stmt);
+					m_statements.erase(it);
+					DEBUG_THROW(Exception, m_schema, err_code, err_msg);
+				}
+				m_last_statement = stmt;
+			}
+
 			boost::uint64_t do_get_insert_id() const {
+				if(m_last_statement){
+					return ::mysql_stmt_insert_id(m_last_statement);
+				}
 				return ::mysql_insert_id(m_mysql.get());
 			}
 
@@ -162,12 +319,19 @@ namespace MySql {
 				return true;
 			}
 
-			boost::int64_t do_get_signed(const char *name) const {
-				const char *data;
-				std::size_t size;
-				if(!find_field_and_check(data, size, name)){
-					return VAL_INIT;
+			boost::uint64_t do_get_result_serial() const {
+				return m_result_serial;
+			}
+			std::size_t do_find_field_index(const char *name) const {
+				const AUTO(it, m_fields.find(name));
+				if(it == m_fields.end()){
+					LOG_POSEIDON_WARNING("Field not found: name = ", name);
+					return static_cast<std::size_t>(-1);
 				}
+				return it->second;
+			}
+
+			static boost::int64_t parse_signed(const char *data, std::size_t /* size */){
 				char *endptr;
 				const AUTO(val, ::strtoll(data, &endptr, 10));
 				if(*endptr){
@@ -176,12 +340,23 @@ namespace MySql {
 				}
 				return val;
 			}
-			boost::uint64_t do_get_unsigned(const char *name) const {
+			boost::int64_t do_get_signed(const char *name) const {
 				const char *data;
 				std::size_t size;
 				if(!find_field_and_check(data, size, name)){
 					return VAL_INIT;
 				}
+				return parse_signed(data, size);
+			}
+			boost::int64_t do_get_signed_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_signed(data, size);
+			}
+			static boost::uint64_t parse_unsigned(const char *data, std::size_t /* size */){
 				char *endptr;
 				const AUTO(val, ::strtoull(data, &endptr, 10));
 				if(*endptr){
@@ -190,12 +365,23 @@ namespace MySql {
 				}
 				return val;
 			}
-			double do_get_double(const char *name) const {
+			boost::uint64_t do_get_unsigned(const char *name) const {
 				const char *data;
 				std::size_t size;
 				if(!find_field_and_check(data, size, name)){
 					return VAL_INIT;
 				}
+				return parse_unsigned(data, size);
+			}
+			boost::uint64_t do_get_unsigned_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_unsigned(data, size);
+			}
+			static double parse_double(const char *data, std::size_t /* size */){
 				char *endptr;
 				const AUTO(val, ::strtod(data, &endptr));
 				if(*endptr){
@@ -204,45 +390,126 @@ namespace MySql {
 				}
 				return val;
 			}
-			std::string do_get_string(const char *name) const {
+			double do_get_double(const char *name) const {
 				const char *data;
 				std::size_t size;
 				if(!find_field_and_check(data, size, name)){
 					return VAL_INIT;
 				}
+				return parse_double(data, size);
+			}
+			double do_get_double_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_double(data, size);
+			}
+			static std::string parse_string(const char *data, std::size_t size){
 				return std::string(data, size);
 			}
-			boost::uint64_t do_get_datetime(const char *name) const {
+			std::string do_get_string(const char *name) const {
 				const char *data;
 				std::size_t size;
 				if(!find_field_and_check(data, size, name)){
 					return VAL_INIT;
 				}
+				return parse_string(data, size);
+			}
+			std::string do_get_string_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_string(data, size);
+			}
+			static boost::uint64_t parse_datetime(const char *data, std::size_t /* size */){
 				return scan_time(data);
 			}
-			Uuid do_get_uuid(const char *name) const {
+			boost::uint64_t do_get_datetime(const char *name) const {
 				const char *data;
 				std::size_t size;
 				if(!find_field_and_check(data, size, name)){
 					return VAL_INIT;
 				}
+				return parse_datetime(data, size);
+			}
+			boost::uint64_t do_get_datetime_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_datetime(data, size);
+			}
+			static Uuid parse_uuid(const char *data, std::size_t size){
 				if(size != 36){
 					LOG_POSEIDON_ERROR("Invalid UUID string: ", data);
 					DEBUG_THROW(BasicException, sslit("Invalid UUID string"));
 				}
 				return Uuid(reinterpret_cast<const char (&)[36]>(data[0]));
 			}
-			std::basic_string<unsigned char> do_get_blob(const char *name) const {
+			Uuid do_get_uuid(const char *name) const {
 				const char *data;
 				std::size_t size;
 				if(!find_field_and_check(data, size, name)){
 					return VAL_INIT;
 				}
+				return parse_uuid(data, size);
+			}
+			Uuid do_get_uuid_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_uuid(data, size);
+			}
+			static std::basic_string<unsigned char> parse_blob(const char *data, std::size_t size){
 				return std::basic_string<unsigned char>(reinterpret_cast<const unsigned char *>(data), size);
 			}
+			std::basic_string<unsigned char> do_get_blob(const char *name) const {
+				const char *data;
+				std::size_t size;
+				if(!find_field_and_check(data, size, name)){
+					return VAL_INIT;
+				}
+				return parse_blob(data, size);
+			}
+			std::basic_string<unsigned char> do_get_blob_at(std::size_t index) const {
+				const char *data;
+				std::size_t size;
+				if(!check_field(data, size, index)){
+					return VAL_INIT;
+				}
+				return parse_blob(data, size);
+			}
+			const char *do_get_raw(const char *name, std::size_t &size) const {
+				const char *data;
+				if(!find_field_and_check(data, size, name)){
+					size = 0;
+					return NULLPTR;
+				}
+				return data;
+			}
+			const char *do_get_raw_at(std::size_t index, std::size_t &size) const {
+				const char *data;
+				if(!check_field(data, size, index)){
+					size = 0;
+					return NULLPTR;
+				}
+				return data;
+			}
 		};
 	}
 
+	void Connection::StatementParams::add_uuid(const Uuid &val){
+		Element &elem = push(T_STRING);
+		val.to_string(elem.str);
+	}
+
 	boost::shared_ptr<Connection> Connection::create(const char *server_addr, unsigned server_port,
 		const char *user_name, const char *password, const char *schema, bool use_ssl, const char *charset)
 	{
@@ -259,6 +526,16 @@ namespace MySql {
 		static_cast<DelegatedConnection &>(*this).do_discard_result();
 	}
 
+	bool Connection::has_prepared_statement(const std::string &key) const {
+		return static_cast<const DelegatedConnection &>(*this).do_has_prepared_statement(key);
+	}
+	void Connection::prepare_statement(const std::string &key, const std::string &sql){
+		static_cast<DelegatedConnection &>(*this).do_prepare_statement(key, sql);
+	}
+	void Connection::execute_prepared(const std::string &key, const StatementParams &params){
+		static_cast<DelegatedConnection &>(*this).do_execute_prepared(key, params);
+	}
+
 	boost::uint64_t Connection::get_insert_id() const {
 		return static_cast<const DelegatedConnection &>(*this).do_get_insert_id();
 	}
@@ -287,6 +564,42 @@ namespace MySql {
 	std::basic_string<unsigned char> Connection::get_blob(const char *name) const {
 		return static_cast<const DelegatedConnection &>(*this).do_get_blob(name);
 	}
+
+	boost::uint64_t Connection::get_result_serial() const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_result_serial();
+	}
+	std::size_t Connection::find_field_index(const char *name) const {
+		return static_cast<const DelegatedConnection &>(*this).do_find_field_index(name);
+	}
+
+	boost::int64_t Connection::get_signed_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_signed_at(index);
+	}
+	boost::uint64_t Connection::get_unsigned_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_unsigned_at(index);
+	}
+	double Connection::get_double_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_double_at(index);
+	}
+	std::string Connection::get_string_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_string_at(index);
+	}
+	boost::uint64_t Connection::get_datetime_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_datetime_at(index);
+	}
+	Uuid Connection::get_uuid_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_uuid_at(index);
+	}
+	std::basic_string<unsigned char> Connection::get_blob_at(std::size_t index) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_blob_at(index);
+	}
+
+	const char *Connection::get_raw(const char *name, std::size_t &size) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_raw(name, size);
+	}
+	const char *Connection::get_raw_at(std::size_t index, std::size_t &size) const {
+		return static_cast<const DelegatedConnection &>(*this).do_get_raw_at(index, size);
+	}
 }
 
 }
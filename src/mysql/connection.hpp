@@ -7,6 +7,7 @@
 #include "../cxx_ver.hpp"
 #include "../cxx_util.hpp"
 #include <string>
+#include <vector>
 #include <cstring>
 #include <boost/cstdint.hpp>
 #include <boost/shared_ptr.hpp>
@@ -17,6 +18,81 @@ class Uuid;
 
 namespace MySql {
 	class Connection : NONCOPYABLE {
+	public:
+		// 预处理语句的参数，按照 SQL 中 ? 出现的顺序添加。
+		class StatementParams {
+		public:
+			enum Type {
+				T_SIGNED,
+				T_UNSIGNED,
+				T_DOUBLE,
+				T_STRING,
+				T_DATETIME,
+				T_BLOB,
+			};
+
+			struct Element {
+				Type type;
+				union {
+					boost::int64_t i;
+					boost::uint64_t u;
+					double d;
+				} num;
+				std::string str;
+			};
+
+		private:
+			std::vector<Element> m_elements;
+
+		public:
+			const Element &at(std::size_t index) const {
+				return m_elements.at(index);
+			}
+			std::size_t size() const {
+				return m_elements.size();
+			}
+			void reserve(std::size_t size){
+				m_elements.reserve(size);
+			}
+			void clear(){
+				m_elements.clear();
+			}
+
+			void add_signed(boost::int64_t val){
+				Element &elem = push(T_SIGNED);
+				elem.num.i = val;
+			}
+			void add_unsigned(boost::uint64_t val){
+				Element &elem = push(T_UNSIGNED);
+				elem.num.u = val;
+			}
+			void add_double(double val){
+				Element &elem = push(T_DOUBLE);
+				elem.num.d = val;
+			}
+			void add_string(const std::string &val){
+				Element &elem = push(T_STRING);
+				elem.str = val;
+			}
+			void add_datetime(boost::uint64_t val){
+				Element &elem = push(T_DATETIME);
+				elem.num.u = val;
+			}
+			void add_uuid(const Uuid &val);
+			void add_blob(const std::basic_string<unsigned char> &val){
+				Element &elem = push(T_BLOB);
+				elem.str.assign(reinterpret_cast<const char *>(val.data()), val.size());
+			}
+
+		private:
+			Element &push(Type type){
+				m_elements.push_back(Element());
+				Element &elem = m_elements.back();
+				elem.type = type;
+				return elem;
+			}
+		};
+
 	public:
 		static boost::shared_ptr<Connection> create(const char *server_addr, unsigned server_port,
 			const char *user_name, const char *password, const char *schema, bool use_ssl, const char *charset);
@@ -41,6 +117,11 @@ namespace MySql {
 		}
 		void discard_result() NOEXCEPT;
 
+		// 服务端预处理语句，以 key 为索引缓存在这个连接中，参数以二进制形式传递。
+		bool has_prepared_statement(const std::string &key) const;
+		void prepare_statement(const std::string &key, const std::string &sql);
+		void execute_prepared(const std::string &key, const StatementParams &params);
+
 		boost::uint64_t get_insert_id() const;
 		bool fetch_row();
 
@@ -51,6 +132,24 @@ namespace MySql {
 		boost::uint64_t get_datetime(const char *name) const;
 		Uuid get_uuid(const char *name) const;
 		std::basic_string<unsigned char> get_blob(const char *name) const;
+
+		// 每次执行查询都会得到一个不同的非零序号，可以用来缓存 find_field_index() 的结果。
+		boost::uint64_t get_result_serial() const;
+		// 找不到时返回 (std::size_t)-1，按这个索引取值得到默认值。
+		std::size_t find_field_index(const char *name) const;
+
+		boost::int64_t get_signed_at(std::size_t index) const;
+		boost::uint64_t get_unsigned_at(std::size_t index) const;
+		double get_double_at(std::size_t index) const;
+		std::string get_string_at(std::size_t index) const;
+		boost::uint64_t get_datetime_at(std::size_t index) const;
+		Uuid get_uuid_at(std::size_t index) const;
+		std::basic_string<unsigned char> get_blob_at(std::size_t index) const;
+
+		// 返回当前行中的原始数据，不复制。在下一次 fetch_row() 或 discard_result() 之前有效。
+		// 值为 NULL 或者没有这一列时返回空指针。
+		const char *get_raw(const char *name, std::size_t &size) const;
+		const char *get_raw_at(std::size_t index, std::size_t &size) const;
 	};
 }
 
@@ -60,6 +60,12 @@ namespace MySql {
 		virtual const char *get_table() const = 0;
 
 		virtual void generate_sql(std::ostream &os) const = 0;
+		// 用于多行的 INSERT/REPLACE 语句，分别输出形如 (`a`, `b`) 的列名和 (1, 'x') 的值。
+		virtual void generate_sql_columns(std::ostream &os) const = 0;
+		virtual void generate_sql_values(std::ostream &os) const = 0;
+		// 用于预处理语句，输出形如 (?, ?) 的占位符，并按相同的顺序添加参数。
+		virtual void generate_sql_placeholders(std::ostream &os) const = 0;
+		virtual void bind_sql_params(Connection::StatementParams &params) const = 0;
 		virtual void fetch(const boost::shared_ptr<const Connection> &conn) = 0;
 		void async_save(bool to_replace, bool urgent = false) const;
 	};
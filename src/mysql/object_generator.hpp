@@ -142,6 +142,107 @@ public:
 
 		MYSQL_OBJECT_FIELDS
 	}
+	void generate_sql_columns(::std::ostream &os_) const OVERRIDE {
+		static CONSTEXPR const char delims_[2][4] = { "", ", " };
+		bool flag_ = false;
+
+#undef FIELD_BOOLEAN
+#undef FIELD_SIGNED
+#undef FIELD_UNSIGNED
+#undef FIELD_DOUBLE
+#undef FIELD_STRING
+#undef FIELD_DATETIME
+#undef FIELD_UUID
+#undef FIELD_BLOB
+
+#define FIELD_BOOLEAN(id_)                os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_SIGNED(id_)                 os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_UNSIGNED(id_)               os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_DOUBLE(id_)                 os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_STRING(id_)                 os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_DATETIME(id_)               os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_UUID(id_)                   os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+#define FIELD_BLOB(id_)                   os_ <<delims_[flag_++] <<"`" TOKEN_TO_STR(id_) "`";
+
+		os_ <<"(";
+		MYSQL_OBJECT_FIELDS
+		os_ <<")";
+	}
+	void generate_sql_values(::std::ostream &os_) const OVERRIDE {
+		static CONSTEXPR const char delims_[2][4] = { "", ", " };
+		bool flag_ = false;
+
+#undef FIELD_BOOLEAN
+#undef FIELD_SIGNED
+#undef FIELD_UNSIGNED
+#undef FIELD_DOUBLE
+#undef FIELD_STRING
+#undef FIELD_DATETIME
+#undef FIELD_UUID
+#undef FIELD_BLOB
+
+#define FIELD_BOOLEAN(id_)                os_ <<delims_[flag_++] <<id_;
+#define FIELD_SIGNED(id_)                 os_ <<delims_[flag_++] <<id_;
+#define FIELD_UNSIGNED(id_)               os_ <<delims_[flag_++] <<id_;
+#define FIELD_DOUBLE(id_)                 os_ <<delims_[flag_++] <<id_;
+#define FIELD_STRING(id_)                 os_ <<delims_[flag_++] << ::Poseidon::MySql::StringEscaper(id_);
+#define FIELD_DATETIME(id_)               os_ <<delims_[flag_++] << ::Poseidon::MySql::DateTimeFormatter(id_);
+#define FIELD_UUID(id_)                   os_ <<delims_[flag_++] << ::Poseidon::MySql::UuidFormatter(id_);
+#define FIELD_BLOB(id_)                   os_ <<delims_[flag_++] << ::Poseidon::MySql::StringEscaper(id_);
+
+		os_ <<"(";
+		MYSQL_OBJECT_FIELDS
+		os_ <<")";
+	}
+	void generate_sql_placeholders(::std::ostream &os_) const OVERRIDE {
+		static CONSTEXPR const char delims_[2][4] = { "", ", " };
+		bool flag_ = false;
+
+#undef FIELD_BOOLEAN
+#undef FIELD_SIGNED
+#undef FIELD_UNSIGNED
+#undef FIELD_DOUBLE
+#undef FIELD_STRING
+#undef FIELD_DATETIME
+#undef FIELD_UUID
+#undef FIELD_BLOB
+
+#define FIELD_BOOLEAN(id_)                os_ <<delims_[flag_++] <<"?";
+#define FIELD_SIGNED(id_)                 os_ <<delims_[flag_++] <<"?";
+#define FIELD_UNSIGNED(id_)               os_ <<delims_[flag_++] <<"?";
+#define FIELD_DOUBLE(id_)                 os_ <<delims_[flag_++] <<"?";
+#define FIELD_STRING(id_)                 os_ <<delims_[flag_++] <<"?";
+#define FIELD_DATETIME(id_)               os_ <<delims_[flag_++] <<"?";
+#define FIELD_UUID(id_)                   os_ <<delims_[flag_++] <<"?";
+#define FIELD_BLOB(id_)                   os_ <<delims_[flag_++] <<"?";
+
+		os_ <<"(";
+		MYSQL_OBJECT_FIELDS
+		os_ <<")";
+	}
+	void bind_sql_params(::Poseidon::MySql::Connection::StatementParams &params_) const OVERRIDE {
+		const ::Poseidon::RecursiveMutex::UniqueLock lock_(m_mutex);
+
+#undef FIELD_BOOLEAN
+#undef FIELD_SIGNED
+#undef FIELD_UNSIGNED
+#undef FIELD_DOUBLE
+#undef FIELD_STRING
+#undef FIELD_DATETIME
+#undef FIELD_UUID
+#undef FIELD_BLOB
+
+#define FIELD_BOOLEAN(id_)                params_.add_signed   (id_.unlocked_get());
+#define FIELD_SIGNED(id_)                 params_.add_signed   (id_.unlocked_get());
+#define FIELD_UNSIGNED(id_)               params_.add_unsigned (id_.unlocked_get());
+#define FIELD_DOUBLE(id_)                 params_.add_double   (id_.unlocked_get());
+#define FIELD_STRING(id_)                 params_.add_string   (id_.unlocked_get());
+#define FIELD_DATETIME(id_)               params_.add_datetime (id_.unlocked_get());
+#define FIELD_UUID(id_)                   params_.add_uuid     (id_.unlocked_get());
+#define FIELD_BLOB(id_)                   params_.add_blob     (id_.unlocked_get());
+
+		MYSQL_OBJECT_FIELDS
+	}
 	void fetch(const ::boost::shared_ptr<const ::Poseidon::MySql::Connection> &conn_) OVERRIDE {
 
 #undef FIELD_BOOLEAN
@@ -153,14 +254,63 @@ public:
 #undef FIELD_UUID
 #undef FIELD_BLOB
 
-#define FIELD_BOOLEAN(id_)                id_.set(conn_->get_signed   ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_SIGNED(id_)                 id_.set(conn_->get_signed   ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_UNSIGNED(id_)               id_.set(conn_->get_unsigned ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_DOUBLE(id_)                 id_.set(conn_->get_double   ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_STRING(id_)                 id_.set(conn_->get_string   ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_DATETIME(id_)               id_.set(conn_->get_datetime ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_UUID(id_)                   id_.set(conn_->get_uuid     ( TOKEN_TO_STR(id_) ), false);
-#define FIELD_BLOB(id_)                   id_.set(conn_->get_blob     ( TOKEN_TO_STR(id_) ), false);
+#define FIELD_BOOLEAN(id_)                + 1
+#define FIELD_SIGNED(id_)                 + 1
+#define FIELD_UNSIGNED(id_)               + 1
+#define FIELD_DOUBLE(id_)                 + 1
+#define FIELD_STRING(id_)                 + 1
+#define FIELD_DATETIME(id_)               + 1
+#define FIELD_UUID(id_)                   + 1
+#define FIELD_BLOB(id_)                   + 1
+
+		// 每个结果集只按名字查找一次列索引，之后的每一行按索引读取。
+		static __thread ::boost::uint64_t serial_;
+		static __thread ::std::size_t indices_[1 MYSQL_OBJECT_FIELDS];
+		::std::size_t index_ = 0;
+
+		const ::boost::uint64_t result_serial_ = conn_->get_result_serial();
+		if(serial_ != result_serial_){
+
+#undef FIELD_BOOLEAN
+#undef FIELD_SIGNED
+#undef FIELD_UNSIGNED
+#undef FIELD_DOUBLE
+#undef FIELD_STRING
+#undef FIELD_DATETIME
+#undef FIELD_UUID
+#undef FIELD_BLOB
+
+#define FIELD_BOOLEAN(id_)                indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_SIGNED(id_)                 indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_UNSIGNED(id_)               indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_DOUBLE(id_)                 indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_STRING(id_)                 indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_DATETIME(id_)               indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_UUID(id_)                   indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+#define FIELD_BLOB(id_)                   indices_[index_++] = conn_->find_field_index( TOKEN_TO_STR(id_) );
+
+			MYSQL_OBJECT_FIELDS
+			serial_ = result_serial_;
+			index_ = 0;
+		}
+
+#undef FIELD_BOOLEAN
+#undef FIELD_SIGNED
+#undef FIELD_UNSIGNED
+#undef FIELD_DOUBLE
+#undef FIELD_STRING
+#undef FIELD_DATETIME
+#undef FIELD_UUID
+#undef FIELD_BLOB
+
+#define FIELD_BOOLEAN(id_)                id_.set(conn_->get_signed_at   ( indices_[index_++] ), false);
+#define FIELD_SIGNED(id_)                 id_.set(conn_->get_signed_at   ( indices_[index_++] ), false);
+#define FIELD_UNSIGNED(id_)               id_.set(conn_->get_unsigned_at ( indices_[index_++] ), false);
+#define FIELD_DOUBLE(id_)                 id_.set(conn_->get_double_at   ( indices_[index_++] ), false);
+#define FIELD_STRING(id_)                 id_.set(conn_->get_string_at   ( indices_[index_++] ), false);
+#define FIELD_DATETIME(id_)               id_.set(conn_->get_datetime_at ( indices_[index_++] ), false);
+#define FIELD_UUID(id_)                   id_.set(conn_->get_uuid_at     ( indices_[index_++] ), false);
+#define FIELD_BLOB(id_)                   id_.set(conn_->get_blob_at     ( indices_[index_++] ), false);
 
 		MYSQL_OBJECT_FIELDS
 	}
@@ -5,12 +5,29 @@
 #include "profiler.hpp"
 #include "singletons/profile_depository.hpp"
 #include "time.hpp"
+#include "random.hpp"
 #include "log.hpp"
 
 namespace Poseidon {
 
 namespace {
 	__thread Profiler *t_top_profiler = 0; // XXX: NULLPTR
+
+	// 返回 0 表示不采样，否则返回这个样本代表的调用次数。
+	unsigned get_sample_weight() NOEXCEPT {
+		if(!ProfileDepository::is_enabled()){
+			return 0;
+		}
+		const AUTO(sample_rate, ProfileDepository::get_sample_rate());
+		if(sample_rate <= 1){
+			return 1;
+		}
+		// 使用随机数而不是计数器，避免与调用模式同步。
+		if(random_uint32() % sample_rate != 0){
+			return 0;
+		}
+		return sample_rate;
+	}
 }
 
 void Profiler::accumulate_all_in_thread() NOEXCEPT {
@@ -51,25 +68,27 @@ void Profiler::end_stack_switch(void *opaque) NOEXCEPT {
 	t_top_profiler = top;
 }
 
-Profiler::Profiler(const char *file, unsigned long line, const char *func) NOEXCEPT
-	: m_prev(t_top_profiler), m_file(file), m_line(line), m_func(func)
-	, m_start(0), m_excluded(0), m_yielded_since(0)
+Profiler::Profiler(const ProfileCallSite *site) NOEXCEPT
+	: m_prev(t_top_profiler), m_site(site), m_weight(get_sample_weight()), m_timed((m_weight != 0) || m_prev)
+	, m_start(0), m_excluded(0), m_yielded_since(0), m_latency(0)
 {
-	if(ProfileDepository::is_enabled()){
+	// 栈中只有计时的 profiler。被采样的 profiler 内层的所有 profiler 都要计时，即使没有被采样，
+	// 否则其时间会被算作外层的 exclusive。没有被采样并且外层也不计时的，什么都不做。
+	if(m_timed){
 		const AUTO(now, get_hi_res_mono_clock());
 		m_start = now;
 		t_top_profiler = this;
 	}
 }
 Profiler::~Profiler() NOEXCEPT {
-	if(ProfileDepository::is_enabled()){
+	if(m_timed){
 		const AUTO(now, get_hi_res_mono_clock());
 		t_top_profiler = m_prev;
 		accumulate(now, true);
 	}
 	if(std::uncaught_exception()){
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-			"Exception backtrace: file = ", m_file, ", line = ", m_line, ", func = ", m_func);
+			"Exception backtrace: file = ", m_site->file, ", line = ", m_site->line, ", func = ", m_site->func);
 	}
 }
 
@@ -78,12 +97,15 @@ void Profiler::accumulate(double now, bool new_sample) NOEXCEPT {
 	const AUTO(exclusive, total - m_excluded);
 	m_start = now;
 	m_excluded = 0;
+	m_latency += total;
 
 	if(m_prev){
 		m_prev->m_excluded += total;
 	}
 
-	ProfileDepository::accumulate(m_file, m_line, m_func, total, exclusive, new_sample);
+	if(m_weight != 0){
+		ProfileDepository::accumulate(m_site, total, exclusive, new_sample, m_latency, m_weight);
+	}
 }
 
 }
@@ -9,6 +9,13 @@
 
 namespace Poseidon {
 
+// 每个 PROFILE_ME 对应一个静态的 ProfileCallSite，统计数据以它的地址为键。
+struct ProfileCallSite {
+	const char *file;
+	unsigned long line;
+	const char *func;
+};
+
 class Profiler : NONCOPYABLE {
 public:
 	static void accumulate_all_in_thread() NOEXCEPT;
@@ -18,16 +25,17 @@ public:
 
 private:
 	Profiler *const m_prev;
-	const char *const m_file;
-	const unsigned long m_line;
-	const char *const m_func;
+	const ProfileCallSite *const m_site;
+	const unsigned m_weight; // 采样时的采样率，为 0 表示没有被采样。
+	const bool m_timed;
 
 	double m_start;
 	double m_excluded;
 	double m_yielded_since;
+	double m_latency; // 从进入到现在的总毫秒数。
 
 public:
-	Profiler(const char *file, unsigned long line, const char *func) NOEXCEPT;
+	explicit Profiler(const ProfileCallSite *site) NOEXCEPT;
 	~Profiler() NOEXCEPT;
 
 private:
@@ -36,6 +44,9 @@ private:
 
 }
 
-#define PROFILE_ME  const ::Poseidon::Profiler UNIQUE_ID(__FILE__, __LINE__, __PRETTY_FUNCTION__)
+#define PROFILE_ME_(id_)    static const ::Poseidon::ProfileCallSite TOKEN_CAT2(id_, site_) = { __FILE__, __LINE__, __PRETTY_FUNCTION__ };	\
+	const ::Poseidon::Profiler TOKEN_CAT2(id_, profiler_)(&TOKEN_CAT2(id_, site_))
+
+#define PROFILE_ME          PROFILE_ME_(UNIQUE_ID)
 
 #endif
@@ -3,6 +3,7 @@
 
 #include "../precompiled.hpp"
 #include "epoll_daemon.hpp"
+#include "main_config.hpp"
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
@@ -15,16 +16,17 @@
 #include "../profiler.hpp"
 #include "../recursive_mutex.hpp"
 #include "../raii.hpp"
-#include "../multi_index_map.hpp"
 #include "../checked_arithmetic.hpp"
 #include "../system_exception.hpp"
 #include "../errno.hpp"
+#include "../exception.hpp"
 
 namespace Poseidon {
 
 namespace {
-	volatile bool g_running = false;
-	Thread g_thread;
+	std::size_t g_epoll_thread_count = 1;
+	std::size_t g_epoll_pump_batch_size = 256;
+	boost::uint64_t g_epoll_throttle_retry_interval = 1000;
 
 	class WeakableSocket {
 	private:
@@ -49,274 +51,600 @@ namespace {
 		}
 	};
 
-	struct SocketElement {
+	const std::size_t NIL_SLOT = (std::size_t)-1;
+
+	class SlotList;
+
+	struct SlotLink {
+		SlotList *owner;
+		std::size_t prev;
+		std::size_t next;
+
+		SlotLink()
+			: owner(NULLPTR), prev(NIL_SLOT), next(NIL_SLOT)
+		{ }
+	};
+
+	// 套接字表中的一项。下标由 fd 计算得出，epoll_event.data 中保存下标和版本号。
+	struct SocketSlot {
 		boost::shared_ptr<const WeakableSocket> weakable;
+		const SocketBase *ptr; // 为空表示该项空闲。
+		boost::uint32_t generation;
 
-		const SocketBase *ptr;
-		boost::uint64_t read_time;
-		boost::uint64_t write_time;
+		bool readable;
+		bool writeable;
 		int err_code;
+		boost::uint64_t throttle_time;
+		bool resume_requested; // 在处理期间调用了 mark_socket_readable()。
 
-		mutable bool readable;
-		mutable bool writeable;
+		SlotLink read_link; // 可读队列或限流队列。
+		SlotLink write_link;
+		SlotLink close_link;
 
-		SocketElement(bool owning, const boost::shared_ptr<SocketBase> &socket, boost::uint64_t now)
-			: weakable(boost::make_shared<WeakableSocket>(owning, socket))
-			, ptr(socket.get()), read_time(now), write_time(now), err_code(-1)
-			, readable(false), writeable(false)
+		SocketSlot()
+			: weakable(), ptr(NULLPTR), generation(0)
+			, readable(false), writeable(false), err_code(-1), throttle_time(0), resume_requested(false)
 		{ }
 	};
-	MULTI_INDEX_MAP(SocketMap, SocketElement,
-		UNIQUE_MEMBER_INDEX(ptr)
-		MULTI_MEMBER_INDEX(read_time)
-		MULTI_MEMBER_INDEX(write_time)
-		MULTI_MEMBER_INDEX(err_code)
-	)
-
-	RecursiveMutex g_mutex;
-	UniqueFile g_epoll;
-	SocketMap g_socket_map;
-
-	bool wait_for_sockets(unsigned timeout) NOEXCEPT {
-		PROFILE_ME;
-
-		::epoll_event events[256];
-		const int result = ::epoll_wait(g_epoll.get(), events, COUNT_OF(events), (int)timeout);
-		if(result < 0){
-			const int err_code = errno;
-			if(err_code != EINTR){
-				LOG_POSEIDON_ERROR("::epoll_wait() failed! errno was ", err_code);
-			}
-			return false;
+	typedef std::vector<SocketSlot> SocketSlotVector;
+
+	// 以下标串联的侵入式双向链表，插入和删除都是 O(1) 的。
+	class SlotList : NONCOPYABLE {
+	private:
+		SlotLink SocketSlot::*const m_link;
+		std::size_t m_head;
+		std::size_t m_tail;
+
+	public:
+		explicit SlotList(SlotLink SocketSlot::*link)
+			: m_link(link), m_head(NIL_SLOT), m_tail(NIL_SLOT)
+		{ }
+
+	public:
+		bool empty() const NOEXCEPT {
+			return m_head == NIL_SLOT;
 		}
-		if(result == 0){
-			return false;
+		std::size_t front() const NOEXCEPT {
+			return m_head;
 		}
-		const AUTO(now, get_fast_mono_clock());
-		const RecursiveMutex::UniqueLock lock(g_mutex);
-		for(unsigned i = 0; i < (unsigned)result; ++i){
-			const AUTO(ptr, static_cast<SocketBase *>(events[i].data.ptr));
-			const AUTO(it, g_socket_map.find<0>(ptr));
-			if(it == g_socket_map.end()){
-				LOG_POSEIDON_TRACE("Socket reported by epoll is not registered: ptr = ", static_cast<void *>(ptr));
-				continue;
-			}
-			const AUTO(socket, it->weakable->lock());
-			if(!socket){
-				g_socket_map.erase<0>(it);
-				continue;
-			}
-			if(events[i].events & EPOLLIN){
-				it->readable = true;
-				g_socket_map.set_key<0, 1>(it, now);
-			}
-			if(events[i].events & EPOLLOUT){
-				it->writeable = true;
-				g_socket_map.set_key<0, 2>(it, now);
-			}
-			if(events[i].events & (EPOLLHUP | EPOLLERR)){
-				int err_code;
-				if(socket->did_time_out()){
-					err_code = ETIMEDOUT;
-				} else if(events[i].events & EPOLLERR){
-					::socklen_t err_len = sizeof(err_code);
-					if(::getsockopt(socket->get_fd(), SOL_SOCKET, SO_ERROR, &err_code, &err_len) != 0){
-						err_code = errno;
-						LOG_POSEIDON_WARNING("::getsockopt() failed, errno was ", err_code, ": fd = ", socket->get_fd());
-					}
-				} else {
-					err_code = 0;
-				}
-				g_socket_map.set_key<0, 3>(it, err_code);
-			}
+		bool contains(const SocketSlotVector &slots, std::size_t index) const NOEXCEPT {
+			return (slots[index].*m_link).owner == this;
 		}
-		return true;
-	}
 
-	bool pump_one_readable_socket() NOEXCEPT {
-		PROFILE_ME;
+		void push_back(SocketSlotVector &slots, std::size_t index) NOEXCEPT {
+			AUTO_REF(link, slots[index].*m_link);
+			if(link.owner == this){
+				return;
+			}
+			if(link.owner){
+				link.owner->erase(slots, index);
+			}
+			link.owner = this;
+			link.prev = m_tail;
+			link.next = NIL_SLOT;
+			if(m_tail == NIL_SLOT){
+				m_head = index;
+			} else {
+				(slots[m_tail].*m_link).next = index;
+			}
+			m_tail = index;
+		}
+		void erase(SocketSlotVector &slots, std::size_t index) NOEXCEPT {
+			AUTO_REF(link, slots[index].*m_link);
+			if(link.owner != this){
+				return;
+			}
+			if(link.prev == NIL_SLOT){
+				m_head = link.next;
+			} else {
+				(slots[link.prev].*m_link).next = link.next;
+			}
+			if(link.next == NIL_SLOT){
+				m_tail = link.prev;
+			} else {
+				(slots[link.next].*m_link).prev = link.prev;
+			}
+			link = SlotLink();
+		}
+		void clear() NOEXCEPT {
+			m_head = NIL_SLOT;
+			m_tail = NIL_SLOT;
+		}
+	};
 
-		const AUTO(now, get_fast_mono_clock());
+	struct PumpElement {
 		boost::shared_ptr<SocketBase> socket;
-		bool readable;
-		{
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.begin<1>());
-			if(it == g_socket_map.end<1>()){
+		std::size_t index;
+		bool ready;
+
+		bool throttled;
+		int err_code;
+
+		PumpElement(boost::shared_ptr<SocketBase> socket_, std::size_t index_, bool ready_)
+			: socket(STD_MOVE(socket_)), index(index_), ready(ready_)
+			, throttled(false), err_code(0)
+		{ }
+	};
+
+	volatile bool g_running = false;
+
+	// 每个 epoll 线程拥有独立的 epoll 实例、套接字表和锁，相互之间不共享任何状态。
+	class EpollThread : NONCOPYABLE {
+	private:
+		const std::size_t m_index;
+		const std::size_t m_stride;
+
+		Thread m_thread;
+		mutable RecursiveMutex m_mutex;
+		UniqueFile m_epoll;
+		SocketSlotVector m_slots;
+		SlotList m_read_list;
+		SlotList m_throttled_list; // 按照 throttle_time 升序排列。
+		SlotList m_write_list;
+		SlotList m_close_list;
+
+		// 仅在 epoll 线程中使用。
+		std::vector<PumpElement> m_pump_batch;
+
+	public:
+		EpollThread(std::size_t index, std::size_t stride)
+			: m_index(index), m_stride(stride)
+			, m_read_list(&SocketSlot::read_link), m_throttled_list(&SocketSlot::read_link)
+			, m_write_list(&SocketSlot::write_link), m_close_list(&SocketSlot::close_link)
+		{ }
+
+	private:
+		static boost::uint64_t make_cookie(std::size_t index, boost::uint32_t generation) NOEXCEPT {
+			return ((boost::uint64_t)generation << 32) | index;
+		}
+
+		// 调用者需要持有 m_mutex。
+		std::size_t find_slot(const SocketBase *ptr) const NOEXCEPT {
+			const AUTO(index, static_cast<std::size_t>(static_cast<unsigned>(ptr->get_fd())) / m_stride);
+			if(index >= m_slots.size()){
+				return NIL_SLOT;
+			}
+			if(m_slots[index].ptr != ptr){
+				return NIL_SLOT;
+			}
+			return index;
+		}
+		std::size_t find_slot(boost::uint64_t cookie) const NOEXCEPT {
+			const AUTO(index, static_cast<std::size_t>(cookie & 0xFFFFFFFFu));
+			if(index >= m_slots.size()){
+				return NIL_SLOT;
+			}
+			const AUTO_REF(slot, m_slots[index]);
+			if(!slot.ptr || (slot.generation != (boost::uint32_t)(cookie >> 32))){
+				return NIL_SLOT;
+			}
+			return index;
+		}
+		void release_slot(std::size_t index) NOEXCEPT {
+			m_read_list.erase(m_slots, index);
+			m_throttled_list.erase(m_slots, index);
+			m_write_list.erase(m_slots, index);
+			m_close_list.erase(m_slots, index);
+
+			AUTO_REF(slot, m_slots[index]);
+			slot.weakable.reset();
+			slot.ptr = NULLPTR;
+		}
+
+		bool wait_for_sockets(unsigned timeout) NOEXCEPT {
+			PROFILE_ME;
+
+			::epoll_event events[256];
+			const int result = ::epoll_wait(m_epoll.get(), events, COUNT_OF(events), (int)timeout);
+			if(result < 0){
+				const int err_code = errno;
+				if(err_code != EINTR){
+					LOG_POSEIDON_ERROR("::epoll_wait() failed! errno was ", err_code);
+				}
 				return false;
 			}
-			if(now < it->read_time){
+			if(result == 0){
 				return false;
 			}
-			socket = it->weakable->lock();
-			if(!socket){
-				g_socket_map.erase<1>(it);
-				return true;
+			const RecursiveMutex::UniqueLock lock(m_mutex);
+			for(unsigned i = 0; i < (unsigned)result; ++i){
+				const AUTO(index, find_slot(events[i].data.u64));
+				if(index == NIL_SLOT){
+					LOG_POSEIDON_TRACE("Socket reported by epoll is not registered: cookie = ", events[i].data.u64);
+					continue;
+				}
+				AUTO_REF(slot, m_slots[index]);
+				const AUTO(socket, slot.weakable->lock());
+				if(!socket){
+					release_slot(index);
+					continue;
+				}
+				if(events[i].events & EPOLLIN){
+					slot.readable = true;
+					m_read_list.push_back(m_slots, index);
+				}
+				if(events[i].events & EPOLLOUT){
+					slot.writeable = true;
+					m_write_list.push_back(m_slots, index);
+				}
+				if(events[i].events & (EPOLLHUP | EPOLLERR)){
+					int err_code;
+					if(socket->did_time_out()){
+						err_code = ETIMEDOUT;
+					} else if(events[i].events & EPOLLERR){
+						::socklen_t err_len = sizeof(err_code);
+						if(::getsockopt(socket->get_fd(), SOL_SOCKET, SO_ERROR, &err_code, &err_len) != 0){
+							err_code = errno;
+							LOG_POSEIDON_WARNING("::getsockopt() failed, errno was ", err_code, ": fd = ", socket->get_fd());
+						}
+					} else {
+						err_code = 0;
+					}
+					slot.err_code = err_code;
+					m_close_list.push_back(m_slots, index);
+				}
 			}
-			readable = it->readable;
+			return true;
 		}
 
-		if(socket->is_throttled()){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
-				"Session is throttled: typeid = ", typeid(*socket).name());
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.find<0>(socket.get()));
-			if(it != g_socket_map.end<0>()){
-				g_socket_map.set_key<0, 1>(it, now + 5000);
+		// 在一次加锁中取出所有就绪的套接字，解锁后逐个处理，最后再一次性加锁更新状态。
+		bool pump_readable_sockets() NOEXCEPT {
+			PROFILE_ME;
+
+			const AUTO(now, get_fast_mono_clock());
+			bool busy = false;
+			{
+				const RecursiveMutex::UniqueLock lock(m_mutex);
+				while(!m_throttled_list.empty()){
+					const AUTO(index, m_throttled_list.front());
+					if(now < m_slots[index].throttle_time){
+						break;
+					}
+					m_read_list.push_back(m_slots, index);
+				}
+				while(!m_read_list.empty() && (m_pump_batch.size() < g_epoll_pump_batch_size)){
+					const AUTO(index, m_read_list.front());
+					m_read_list.erase(m_slots, index);
+					busy = true;
+					AUTO(socket, m_slots[index].weakable->lock());
+					if(!socket){
+						release_slot(index);
+						continue;
+					}
+					m_slots[index].resume_requested = false;
+					m_pump_batch.push_back(PumpElement(STD_MOVE(socket), index, m_slots[index].readable));
+				}
+			}
+			if(m_pump_batch.empty()){
+				return busy;
+			}
+
+			for(AUTO(it, m_pump_batch.begin()); it != m_pump_batch.end(); ++it){
+				const AUTO_REF(socket, it->socket);
+				if(socket->is_throttled()){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+						"Session is throttled: typeid = ", typeid(*socket).name());
+					it->throttled = true;
+					continue;
+				}
+				try {
+					it->err_code = socket->poll_read_and_process(it->ready);
+				} catch(std::exception &e){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+						"std::exception thrown: what = ", e.what(), ", typeid = ", typeid(*socket).name());
+					socket->SocketBase::force_shutdown();
+					it->err_code = EPIPE;
+				} catch(...){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+						"Unknown exception thrown: typeid = ", typeid(*socket).name());
+					socket->SocketBase::force_shutdown();
+					it->err_code = EPIPE;
+				}
+				if((it->err_code != 0) && (it->err_code != EINTR) && (it->err_code != EWOULDBLOCK) && (it->err_code != EAGAIN)){
+					LOG_POSEIDON_DEBUG("Socket read error: typeid = ", typeid(*socket).name(), ", err_code = ", it->err_code);
+				}
+			}
+
+			{
+				const RecursiveMutex::UniqueLock lock(m_mutex);
+				for(AUTO(it, m_pump_batch.begin()); it != m_pump_batch.end(); ++it){
+					const AUTO(index, it->index);
+					if(m_slots[index].ptr != it->socket.get()){
+						continue;
+					}
+					if(it->throttled && m_slots[index].resume_requested){
+						// 在检查之后已经解除了限流。
+						m_read_list.push_back(m_slots, index);
+					} else if(it->throttled){
+						// 如果在处理期间收到了新的事件，这里会把它从可读队列中移出。
+						// 通常会由 mark_socket_readable() 提前唤醒，这里的超时只是一个保险。
+						m_slots[index].throttle_time = saturated_add(now, g_epoll_throttle_retry_interval);
+						m_throttled_list.push_back(m_slots, index);
+					} else if((it->err_code == EWOULDBLOCK) || (it->err_code == EAGAIN)){
+						// 等待下一个 EPOLLIN。
+					} else if((it->err_code != 0) && (it->err_code != EINTR)){
+						release_slot(index);
+					} else {
+						m_read_list.push_back(m_slots, index);
+					}
+				}
 			}
+			// 在锁外释放套接字。
+			m_pump_batch.clear();
 			return true;
 		}
 
-		int err_code;
-		try {
-			err_code = socket->poll_read_and_process(readable);
-		} catch(std::exception &e){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-				"std::exception thrown: what = ", e.what(), ", typeid = ", typeid(*socket).name());
-			socket->SocketBase::force_shutdown();
-			err_code = EPIPE;
-		} catch(...){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-				"Unknown exception thrown: typeid = ", typeid(*socket).name());
-			socket->SocketBase::force_shutdown();
-			err_code = EPIPE;
-		}
-		if((err_code == EWOULDBLOCK) || (err_code == EAGAIN)){
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.find<0>(socket.get()));
-			if(it != g_socket_map.end<0>()){
-				g_socket_map.set_key<0, 1>(it, (boost::uint64_t)-1);
-			}
-		} else if((err_code != 0) && (err_code != EINTR)){
-			LOG_POSEIDON_DEBUG("Socket read error: typeid = ", typeid(*socket).name(), ", err_code = ", err_code);
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.find<0>(socket.get()));
-			if(it != g_socket_map.end<0>()){
-				g_socket_map.erase<0>(it);
+		bool pump_writeable_sockets() NOEXCEPT {
+			PROFILE_ME;
+
+			bool busy = false;
+			{
+				const RecursiveMutex::UniqueLock lock(m_mutex);
+				while(!m_write_list.empty() && (m_pump_batch.size() < g_epoll_pump_batch_size)){
+					const AUTO(index, m_write_list.front());
+					m_write_list.erase(m_slots, index);
+					busy = true;
+					AUTO(socket, m_slots[index].weakable->lock());
+					if(!socket){
+						release_slot(index);
+						continue;
+					}
+					m_pump_batch.push_back(PumpElement(STD_MOVE(socket), index, m_slots[index].writeable));
+				}
+			}
+			if(m_pump_batch.empty()){
+				return busy;
 			}
+
+			for(AUTO(it, m_pump_batch.begin()); it != m_pump_batch.end(); ++it){
+				const AUTO_REF(socket, it->socket);
+				Mutex::UniqueLock write_lock;
+				try {
+					it->err_code = socket->poll_write(write_lock, it->ready);
+				} catch(std::exception &e){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+						"std::exception thrown: what = ", e.what(), ", typeid = ", typeid(*socket).name());
+					socket->SocketBase::force_shutdown();
+					it->err_code = EPIPE;
+				} catch(...){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+						"Unknown exception thrown: typeid = ", typeid(*socket).name());
+					socket->SocketBase::force_shutdown();
+					it->err_code = EPIPE;
+				}
+				if((it->err_code != 0) && (it->err_code != EINTR) && (it->err_code != EWOULDBLOCK) && (it->err_code != EAGAIN)){
+					LOG_POSEIDON_DEBUG("Socket write error: typeid = ", typeid(*socket).name(), ", err_code = ", it->err_code);
+				}
+			}
+
+			{
+				const RecursiveMutex::UniqueLock lock(m_mutex);
+				for(AUTO(it, m_pump_batch.begin()); it != m_pump_batch.end(); ++it){
+					const AUTO(index, it->index);
+					if(m_slots[index].ptr != it->socket.get()){
+						continue;
+					}
+					if((it->err_code == EWOULDBLOCK) || (it->err_code == EAGAIN)){
+						// 等待下一个 EPOLLOUT 或者 mark_socket_writeable()。
+					} else if((it->err_code != 0) && (it->err_code != EINTR)){
+						release_slot(index);
+					} else {
+						m_write_list.push_back(m_slots, index);
+					}
+				}
+			}
+			m_pump_batch.clear();
+			return true;
 		}
-		return true;
-	}
 
-	bool pump_one_writeable_socket() NOEXCEPT {
-		PROFILE_ME;
+		bool pump_one_closed_socket() NOEXCEPT {
+			PROFILE_ME;
 
-		const AUTO(now, get_fast_mono_clock());
-		boost::shared_ptr<SocketBase> socket;
-		bool writeable;
-		{
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.begin<2>());
-			if(it == g_socket_map.end<2>()){
-				return false;
+			boost::shared_ptr<SocketBase> socket;
+			int err_code;
+			{
+				const RecursiveMutex::UniqueLock lock(m_mutex);
+				if(m_close_list.empty()){
+					return false;
+				}
+				const AUTO(index, m_close_list.front());
+				m_close_list.erase(m_slots, index);
+				socket = m_slots[index].weakable->lock();
+				if(!socket){
+					release_slot(index);
+					return true;
+				}
+				err_code = m_slots[index].err_code;
 			}
-			if(now < it->write_time){
-				return false;
+
+			try {
+				socket->on_close(err_code);
+			} catch(std::exception &e){
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+					"std::exception thrown: what = ", e.what(), ", typeid = ", typeid(*socket).name());
+				socket->SocketBase::force_shutdown();
+			} catch(...){
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+					"Unknown exception thrown: typeid = ", typeid(*socket).name());
+				socket->SocketBase::force_shutdown();
 			}
-			socket = it->weakable->lock();
-			if(!socket){
-				g_socket_map.erase<2>(it);
-				return true;
+			{
+				LOG_POSEIDON_DEBUG("Socket closed: typeid = ", typeid(*socket).name(), ", err_code = ", err_code);
+				const RecursiveMutex::UniqueLock lock(m_mutex);
+				const AUTO(index, find_slot(socket.get()));
+				if(index != NIL_SLOT){
+					release_slot(index);
+				}
 			}
-			writeable = it->writeable;
+			return true;
 		}
 
-		Mutex::UniqueLock write_lock;
-		int err_code;
-		try {
-			err_code = socket->poll_write(write_lock, writeable);
-		} catch(std::exception &e){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-				"std::exception thrown: what = ", e.what(), ", typeid = ", typeid(*socket).name());
-			socket->SocketBase::force_shutdown();
-			err_code = EPIPE;
-		} catch(...){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-				"Unknown exception thrown: typeid = ", typeid(*socket).name());
-			socket->SocketBase::force_shutdown();
-			err_code = EPIPE;
+		void thread_proc(){
+			PROFILE_ME;
+			LOG_POSEIDON_INFO("Epoll thread ", m_index, " started.");
+
+			unsigned timeout = 0;
+			for(;;){
+				bool busy;
+				do {
+					busy = wait_for_sockets(0);
+					busy += pump_readable_sockets();
+					busy += pump_writeable_sockets();
+					busy += pump_one_closed_socket();
+					timeout = std::min(timeout * 2u + 1u, !busy * 100u);
+				} while(busy);
+
+				if(!atomic_load(g_running, ATOMIC_CONSUME)){
+					break;
+				}
+				wait_for_sockets(timeout);
+			}
+
+			LOG_POSEIDON_INFO("Epoll thread ", m_index, " stopped.");
 		}
-		if((err_code == EWOULDBLOCK) || (err_code == EAGAIN)){
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.find<0>(socket.get()));
-			if(it != g_socket_map.end<0>()){
-				g_socket_map.set_key<0, 2>(it, (boost::uint64_t)-1);
-			}
-		} else if((err_code != 0) && (err_code != EINTR)){
-			LOG_POSEIDON_DEBUG("Socket write error: typeid = ", typeid(*socket).name(), ", err_code = ", err_code);
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.find<0>(socket.get()));
-			if(it != g_socket_map.end<0>()){
-				g_socket_map.erase<0>(it);
+
+	public:
+		void start(){
+			if(!m_epoll.reset(::epoll_create(4096))){
+				const int err_code = errno;
+				LOG_POSEIDON_FATAL("Failed to create epoll! errno was ", err_code);
+				std::abort();
 			}
+			Thread(boost::bind(&EpollThread::thread_proc, this), "   N").swap(m_thread);
+		}
+		void safe_join(){
+			if(m_thread.joinable()){
+				m_thread.join();
+			}
+			const RecursiveMutex::UniqueLock lock(m_mutex);
+			m_read_list.clear();
+			m_throttled_list.clear();
+			m_write_list.clear();
+			m_close_list.clear();
+			m_slots.clear();
+			m_epoll.reset();
 		}
-		return true;
-	}
 
-	bool pump_one_closed_socket() NOEXCEPT {
-		PROFILE_ME;
+		void make_snapshot(std::vector<EpollDaemon::SnapshotElement> &snapshot, boost::uint64_t now) const {
+			const RecursiveMutex::UniqueLock lock(m_mutex);
+			for(AUTO(it, m_slots.begin()); it != m_slots.end(); ++it){
+				if(!it->ptr){
+					continue;
+				}
+				const AUTO(socket, it->weakable->lock());
+				if(!socket){
+					continue;
+				}
+				EpollDaemon::SnapshotElement elem = { };
+				elem.remote = socket->get_remote_info();
+				elem.local = socket->get_local_info();
+				elem.ms_online = saturated_sub(now, socket->get_creation_time());
+				elem.established = it->writeable;
+				snapshot.push_back(STD_MOVE(elem));
+			}
+		}
+		void add_socket(const boost::shared_ptr<SocketBase> &socket, bool take_ownership){
+			const AUTO(index, static_cast<std::size_t>(static_cast<unsigned>(socket->get_fd())) / m_stride);
 
-		// const AUTO(now, get_fast_mono_clock());
-		boost::shared_ptr<SocketBase> socket;
-		int err_code;
-		{
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.lower_bound<3>(0));
-			if(it == g_socket_map.end<3>()){
+			const RecursiveMutex::UniqueLock lock(m_mutex);
+			if(index >= m_slots.size()){
+				m_slots.resize(index + 1);
+			}
+			AUTO_REF(slot, m_slots[index]);
+			if(slot.ptr){
+				// 不持有所有权的套接字在析构之后 fd 可能被复用，此时原来的项一定已经失效了。
+				if(slot.weakable->lock()){
+					LOG_POSEIDON_ERROR("Socket is already in epoll: socket = ", socket,
+						", typeid = ", typeid(*socket).name(), ", fd = ", socket->get_fd());
+					DEBUG_THROW(Exception, sslit("Socket is already in epoll"));
+				}
+				LOG_POSEIDON_TRACE("Reclaiming expired socket slot: index = ", index);
+				release_slot(index);
+			}
+			slot.weakable = boost::make_shared<WeakableSocket>(take_ownership, socket);
+			slot.ptr = socket.get();
+			slot.generation += 1;
+			slot.readable = false;
+			slot.writeable = false;
+			slot.err_code = -1;
+			try {
+				::epoll_event event = { };
+				event.events = static_cast< ::uint32_t>(EPOLLIN | EPOLLOUT | EPOLLET);
+				event.data.u64 = make_cookie(index, slot.generation);
+				if(::epoll_ctl(m_epoll.get(), EPOLL_CTL_ADD, socket->get_fd(), &event) != 0){
+					const int err_code = errno;
+					LOG_POSEIDON_ERROR("::epoll_ctl() failed, errno was ", err_code, ": socket = ", socket,
+						", typeid = ", typeid(*socket).name(), ", fd = ", socket->get_fd());
+					DEBUG_THROW(SystemException, err_code);
+				}
+			} catch(...){
+				release_slot(index);
+				throw;
+			}
+			m_read_list.push_back(m_slots, index);
+			m_write_list.push_back(m_slots, index);
+			LOG_POSEIDON_TRACE("Socket added to epoll thread ", m_index, ": fd = ", socket->get_fd());
+		}
+		bool mark_socket_writeable(const SocketBase *ptr) NOEXCEPT {
+			const RecursiveMutex::UniqueLock lock(m_mutex);
+			const AUTO(index, find_slot(ptr));
+			if(index == NIL_SLOT){
+				LOG_POSEIDON_TRACE("Socket not found in epoll: ptr = ", ptr);
 				return false;
 			}
-			socket = it->weakable->lock();
-			if(!socket){
-				g_socket_map.erase<3>(it);
-				return true;
+			m_write_list.push_back(m_slots, index);
+			return true;
+		}
+		bool mark_socket_readable(const SocketBase *ptr) NOEXCEPT {
+			const RecursiveMutex::UniqueLock lock(m_mutex);
+			const AUTO(index, find_slot(ptr));
+			if(index == NIL_SLOT){
+				LOG_POSEIDON_TRACE("Socket not found in epoll: ptr = ", ptr);
+				return false;
+			}
+			if(m_throttled_list.contains(m_slots, index)){
+				m_read_list.push_back(m_slots, index);
+			} else {
+				m_slots[index].resume_requested = true;
 			}
-			err_code = it->err_code;
+			return true;
 		}
+	};
 
-		try {
-			socket->on_close(err_code);
-		} catch(std::exception &e){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-				"std::exception thrown: what = ", e.what(), ", typeid = ", typeid(*socket).name());
-			socket->SocketBase::force_shutdown();
-		} catch(...){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
-				"Unknown exception thrown: typeid = ", typeid(*socket).name());
-			socket->SocketBase::force_shutdown();
+	std::vector<boost::shared_ptr<EpollThread> > g_threads;
+
+	// g_threads 不加锁访问。stop() 关闭入口并等待所有访问者离开之后才释放线程。
+	volatile bool g_accepting = false;
+	volatile std::size_t g_accessors = 0;
+
+	class ThreadAccessGuard : NONCOPYABLE {
+	private:
+		bool m_accepted;
+
+	public:
+		ThreadAccessGuard() NOEXCEPT {
+			// 先登记再检查入口，与 stop() 中的顺序相反。
+			atomic_add(g_accessors, 1, ATOMIC_SEQ_CST);
+			m_accepted = atomic_load(g_accepting, ATOMIC_SEQ_CST);
 		}
-		{
-			LOG_POSEIDON_DEBUG("Socket closed: typeid = ", typeid(*socket).name(), ", err_code = ", err_code);
-			const RecursiveMutex::UniqueLock lock(g_mutex);
-			const AUTO(it, g_socket_map.find<0>(socket.get()));
-			if(it != g_socket_map.end<0>()){
-				g_socket_map.erase<0>(it);
-			}
+		~ThreadAccessGuard() NOEXCEPT {
+			atomic_sub(g_accessors, 1, ATOMIC_SEQ_CST);
 		}
-		return true;
-	}
 
-	void thread_proc(){
-		PROFILE_ME;
-		LOG_POSEIDON_INFO("Epoll daemon started.");
-
-		unsigned timeout = 0;
-		for(;;){
-			bool busy;
-			do {
-				busy = wait_for_sockets(0);
-				busy += pump_one_readable_socket();
-				busy += pump_one_writeable_socket();
-				busy += pump_one_closed_socket();
-				timeout = std::min(timeout * 2u + 1u, !busy * 100u);
-			} while(busy);
-
-			if(!atomic_load(g_running, ATOMIC_CONSUME)){
-				break;
-			}
-			wait_for_sockets(timeout);
+	public:
+		bool is_accepted() const NOEXCEPT {
+			return m_accepted;
 		}
+	};
 
-		LOG_POSEIDON_INFO("Epoll daemon stopped.");
+	// 套接字按照 fd 分配到线程，这样不需要额外的表就可以由指针找到其所在的线程。
+	// 返回的指针只在 ThreadAccessGuard 的生存期内有效。
+	EpollThread *get_thread_for_socket(const ThreadAccessGuard &guard, const SocketBase *ptr) NOEXCEPT {
+		if(!guard.is_accepted() || g_threads.empty()){
+			return NULLPTR;
+		}
+		const AUTO(index, static_cast<std::size_t>(static_cast<unsigned>(ptr->get_fd())) % g_threads.size());
+		return g_threads[index].get();
 	}
 }
 
@@ -327,12 +655,27 @@ void EpollDaemon::start(){
 	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Starting epoll daemon...");
 
-	if(!g_epoll.reset(::epoll_create(4096))){
-		const int err_code = errno;
-		LOG_POSEIDON_FATAL("Failed to create epoll! errno was ", err_code);
-		std::abort();
+	MainConfig::get(g_epoll_thread_count, "epoll_thread_count");
+	LOG_POSEIDON_DEBUG("epoll_thread_count = ", g_epoll_thread_count);
+
+	MainConfig::get(g_epoll_pump_batch_size, "epoll_pump_batch_size");
+	LOG_POSEIDON_DEBUG("epoll_pump_batch_size = ", g_epoll_pump_batch_size);
+
+	MainConfig::get(g_epoll_throttle_retry_interval, "epoll_throttle_retry_interval");
+	LOG_POSEIDON_DEBUG("epoll_throttle_retry_interval = ", g_epoll_throttle_retry_interval);
+
+	if(g_epoll_pump_batch_size == 0){
+		g_epoll_pump_batch_size = 1;
+	}
+
+	g_threads.resize(std::max<std::size_t>(g_epoll_thread_count, 1));
+	for(std::size_t i = 0; i < g_threads.size(); ++i){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Creating epoll thread ", i);
+		AUTO_REF(thread, g_threads.at(i));
+		thread = boost::make_shared<EpollThread>(i, g_threads.size());
+		thread->start();
 	}
-	Thread(&thread_proc, "   N").swap(g_thread);
+	atomic_store(g_accepting, true, ATOMIC_SEQ_CST);
 }
 void EpollDaemon::stop(){
 	if(atomic_exchange(g_running, false, ATOMIC_ACQ_REL) == false){
@@ -340,70 +683,60 @@ void EpollDaemon::stop(){
 	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping epoll daemon...");
 
-	if(g_thread.joinable()){
-		g_thread.join();
+	atomic_store(g_accepting, false, ATOMIC_SEQ_CST);
+	while(atomic_load(g_accessors, ATOMIC_SEQ_CST) != 0){
+		atomic_pause();
+	}
+
+	for(std::size_t i = 0; i < g_threads.size(); ++i){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Waiting for epoll thread ", i, " to terminate...");
+		g_threads.at(i)->safe_join();
 	}
-	g_socket_map.clear();
-	g_epoll.reset();
+	g_threads.clear();
 }
 
 void EpollDaemon::make_snapshot(std::vector<EpollDaemon::SnapshotElement> &snapshot){
 	PROFILE_ME;
 
+	const ThreadAccessGuard guard;
+	if(!guard.is_accepted()){
+		return;
+	}
 	const AUTO(now, get_fast_mono_clock());
-	const RecursiveMutex::UniqueLock lock(g_mutex);
-	snapshot.reserve(snapshot.size() + g_socket_map.size());
-	for(AUTO(it, g_socket_map.begin()); it != g_socket_map.end(); ++it){
-		const AUTO(socket, it->weakable->lock());
-		if(!socket){
-			continue;
-		}
-		SnapshotElement elem = { };
-		elem.remote = socket->get_remote_info();
-		elem.local = socket->get_local_info();
-		elem.ms_online = saturated_sub(now, socket->get_creation_time());
-		elem.established = it->writeable;
-		snapshot.push_back(STD_MOVE(elem));
+	for(AUTO(it, g_threads.begin()); it != g_threads.end(); ++it){
+		(*it)->make_snapshot(snapshot, now);
 	}
 }
 void EpollDaemon::add_socket(const boost::shared_ptr<SocketBase> &socket, bool take_ownership){
 	PROFILE_ME;
 
-	const AUTO(now, get_fast_mono_clock());
-	const RecursiveMutex::UniqueLock lock(g_mutex);
-	const AUTO(result, g_socket_map.insert(SocketElement(take_ownership, socket, now)));
-	if(!result.second){
-		LOG_POSEIDON_ERROR("Socket is already in epoll: socket = ", socket,
-			", typeid = ", typeid(*socket).name(), ", fd = ", socket->get_fd());
-		DEBUG_THROW(Exception, sslit("Socket is already in epoll"));
-	}
-	try {
-		::epoll_event event = { };
-		event.events = static_cast< ::uint32_t>(EPOLLIN | EPOLLOUT | EPOLLET);
-		event.data.ptr = socket.get();
-		if(::epoll_ctl(g_epoll.get(), EPOLL_CTL_ADD, socket->get_fd(), &event) != 0){
-			const int err_code = errno;
-			LOG_POSEIDON_ERROR("::epoll_ctl() failed, errno was ", err_code, ": socket = ", socket,
-				", typeid = ", typeid(*socket).name(), ", fd = ", socket->get_fd());
-			DEBUG_THROW(SystemException, err_code);
-		}
-	} catch(...){
-		g_socket_map.erase(result.first);
-		throw;
+	const ThreadAccessGuard guard;
+	const AUTO(thread, get_thread_for_socket(guard, socket.get()));
+	if(!thread){
+		LOG_POSEIDON_ERROR("Epoll daemon is not running.");
+		DEBUG_THROW(Exception, sslit("Epoll daemon is not running"));
 	}
+	thread->add_socket(socket, take_ownership);
 }
 bool EpollDaemon::mark_socket_writeable(const SocketBase *ptr) NOEXCEPT {
 	PROFILE_ME;
 
-	const RecursiveMutex::UniqueLock lock(g_mutex);
-	const AUTO(it, g_socket_map.find<0>(ptr));
-	if(it == g_socket_map.end()){
-		LOG_POSEIDON_TRACE("Socket not found in epoll: ptr = ", ptr);
+	const ThreadAccessGuard guard;
+	const AUTO(thread, get_thread_for_socket(guard, ptr));
+	if(!thread){
 		return false;
 	}
-	const AUTO(now, get_fast_mono_clock());
-	g_socket_map.set_key<0, 2>(it, now);
-	return true;
+	return thread->mark_socket_writeable(ptr);
+}
+bool EpollDaemon::mark_socket_readable(const SocketBase *ptr) NOEXCEPT {
+	PROFILE_ME;
+
+	const ThreadAccessGuard guard;
+	const AUTO(thread, get_thread_for_socket(guard, ptr));
+	if(!thread){
+		return false;
+	}
+	return thread->mark_socket_readable(ptr);
 }
 
 }
@@ -31,6 +31,8 @@ public:
 	static void make_snapshot(std::vector<SnapshotElement> &snapshot);
 	static void add_socket(const boost::shared_ptr<SocketBase> &socket, bool take_ownership = false);
 	static bool mark_socket_writeable(const SocketBase *ptr) NOEXCEPT;
+	// 解除限流之后立即恢复读取，而不是等待重试。
+	static bool mark_socket_readable(const SocketBase *ptr) NOEXCEPT;
 };
 
 }
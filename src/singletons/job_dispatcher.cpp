@@ -4,8 +4,8 @@
 #include "../precompiled.hpp"
 #include "job_dispatcher.hpp"
 #include "main_config.hpp"
-#include <ucontext.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include "../job_base.hpp"
 #include "../job_promise.hpp"
 #include "../atomic.hpp"
@@ -17,6 +17,8 @@
 #include "../condition_variable.hpp"
 #include "../time.hpp"
 #include "../checked_arithmetic.hpp"
+#include "../thread.hpp"
+#include "../fiber_context.hpp"
 
 namespace Poseidon {
 
@@ -37,139 +39,224 @@ namespace {
 		boost::uint64_t expiry_time;
 		bool insignificant;
 
+		JobElement()
+			: job(), withdrawn()
+			, promise(), expiry_time((boost::uint64_t)-1), insignificant(false)
+		{ }
 		JobElement(boost::shared_ptr<JobBase> job_, boost::shared_ptr<const bool> withdrawn_)
 			: job(STD_MOVE(job_)), withdrawn(STD_MOVE(withdrawn_))
 			, promise(), expiry_time((boost::uint64_t)-1), insignificant(false)
 		{ }
 	};
 
-	class FiberStackAllocator : NONCOPYABLE {
+	std::size_t g_fiber_stack_size = 256 * 1024;
+	std::size_t g_fiber_stack_pool_size = 256;
+
+	std::size_t get_page_size() NOEXCEPT {
+		static const long s_page_size = ::sysconf(_SC_PAGESIZE);
+		return static_cast<std::size_t>(s_page_size);
+	}
+
+	// 栈的最低一页是保护页，栈溢出时会触发 SIGSEGV 而不是破坏其他数据。
+	// 物理页在第一次访问时才会被提交。
+	class FiberStack : NONCOPYABLE {
+	private:
+		void *m_map;
+		std::size_t m_map_size;
+
 	public:
-		struct Storage FINAL {
-			static void *operator new(std::size_t cb){
-				assert(cb == sizeof(Storage));
-				(void)cb;
-
-				void *const ptr = mmap(NULLPTR, sizeof(Storage), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-				if(ptr == MAP_FAILED){
-					const int err_code = errno;
-					LOG_POSEIDON_ERROR("Failed to allocate stack: err_code = ", err_code);
-					throw std::bad_alloc();
-				}
-				return ptr;
+		explicit FiberStack(std::size_t size){
+			const AUTO(page_size, get_page_size());
+			m_map_size = (size + page_size - 1) / page_size * page_size + page_size;
+			m_map = ::mmap(NULLPTR, m_map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+			if(m_map == MAP_FAILED){
+				const int err_code = errno;
+				LOG_POSEIDON_ERROR("Failed to allocate stack: err_code = ", err_code);
+				throw std::bad_alloc();
 			}
-			static void operator delete(void *ptr) NOEXCEPT {
-				if(::munmap(ptr, sizeof(Storage)) != 0){
-					const int err_code = errno;
-					LOG_POSEIDON_ERROR("Failed to deallocate stack: err_code = ", err_code);
-					std::abort();
-				}
+			if(::mprotect(m_map, page_size, PROT_NONE) != 0){
+				const int err_code = errno;
+				LOG_POSEIDON_ERROR("Failed to protect stack guard page: err_code = ", err_code);
+				::munmap(m_map, m_map_size);
+				throw std::bad_alloc();
+			}
+		}
+		~FiberStack(){
+			if(::munmap(m_map, m_map_size) != 0){
+				const int err_code = errno;
+				LOG_POSEIDON_ERROR("Failed to deallocate stack: err_code = ", err_code);
+				std::abort();
 			}
+		}
 
-			char bytes[256 * 1024];
-		};
+	public:
+		void *get_base() const NOEXCEPT {
+			return static_cast<char *>(m_map) + get_page_size();
+		}
+		std::size_t get_size() const NOEXCEPT {
+			return m_map_size - get_page_size();
+		}
 
+		// 返回曾经被使用过的字节数（以页为单位），失败返回 0。
+		std::size_t get_high_water_mark() const {
+			const AUTO(page_size, get_page_size());
+			const AUTO(page_count, get_size() / page_size);
+			boost::container::vector<unsigned char> residency(page_count);
+			if(::mincore(get_base(), get_size(), residency.data()) != 0){
+				return 0;
+			}
+			// 栈是向下增长的，因此最低的驻留页就是最深的位置。
+			for(std::size_t i = 0; i < page_count; ++i){
+				if(residency[i] & 1){
+					return (page_count - i) * page_size;
+				}
+			}
+			return 0;
+		}
+		// 物理页在内存紧张时才会被回收，再次使用之前不需要重新映射。
+		void release_pages() NOEXCEPT {
+			int err = -1;
+#ifdef MADV_FREE
+			err = ::madvise(get_base(), get_size(), MADV_FREE);
+#endif
+			if(err != 0){
+				::madvise(get_base(), get_size(), MADV_DONTNEED);
+			}
+		}
+	};
+
+	class FiberStackAllocator : NONCOPYABLE {
 	private:
 		mutable Mutex m_mutex;
-		boost::array<boost::scoped_ptr<Storage>, 64> m_pool;
-		std::size_t m_size;
+		boost::container::vector<boost::shared_ptr<FiberStack> > m_pool;
+		std::size_t m_total_count;
+		std::size_t m_high_water_mark;
 
 	public:
 		FiberStackAllocator()
-			: m_mutex(), m_pool(), m_size(0)
+			: m_mutex(), m_pool(), m_total_count(0), m_high_water_mark(0)
 		{ }
 
 	public:
-		void allocate(boost::scoped_ptr<Storage> &ptr){
-			const Mutex::UniqueLock lock(m_mutex);
-			if(m_size == 0){
-				ptr.reset(new Storage);
-			} else {
-				ptr.swap(m_pool.at(--m_size));
+		boost::shared_ptr<FiberStack> allocate(){
+			const AUTO(size, g_fiber_stack_size);
+			{
+				const Mutex::UniqueLock lock(m_mutex);
+				while(!m_pool.empty()){
+					AUTO(stack, STD_MOVE_IDN(m_pool.back()));
+					m_pool.pop_back();
+					if(stack->get_size() >= size){
+						return stack;
+					}
+					--m_total_count;
+				}
 			}
+			AUTO(stack, boost::make_shared<FiberStack>(size));
+			const Mutex::UniqueLock lock(m_mutex);
+			++m_total_count;
+			return stack;
 		}
-		void deallocate(boost::scoped_ptr<Storage> &ptr) NOEXCEPT {
+		void deallocate(boost::shared_ptr<FiberStack> &stack) NOEXCEPT {
+			std::size_t high_water_mark = 0;
+			try {
+				high_water_mark = stack->get_high_water_mark();
+			} catch(std::exception &e){
+				LOG_POSEIDON_WARNING("std::exception thrown: what = ", e.what());
+			}
+			stack->release_pages();
+
 			const Mutex::UniqueLock lock(m_mutex);
-			if(m_size == m_pool.size()){
-				ptr.reset();
-			} else {
-				ptr.swap(m_pool.at(m_size++));
+			m_high_water_mark = std::max(m_high_water_mark, high_water_mark);
+			if(m_pool.size() < g_fiber_stack_pool_size){
+				try {
+					m_pool.push_back(STD_MOVE(stack));
+					return;
+				} catch(std::exception &e){
+					LOG_POSEIDON_WARNING("std::exception thrown: what = ", e.what());
+				}
 			}
+			--m_total_count;
+			stack.reset();
+		}
+
+		void get_stats(JobDispatcher::FiberStackStats &stats) const {
+			const Mutex::UniqueLock lock(m_mutex);
+			stats.stack_size = g_fiber_stack_size;
+			stats.total_count = m_total_count;
+			stats.pooled_count = m_pool.size();
+			stats.high_water_mark = m_high_water_mark;
 		}
 	} g_stack_allocator;
 
-	struct FiberControl : NONCOPYABLE {
-		struct Initializer { };
+	class JobWorker;
+
+	struct FiberControl : NONCOPYABLE, public boost::enable_shared_from_this<FiberControl> {
+		const boost::weak_ptr<const void> category;
+
+		// 以下三个成员由 worker 的互斥锁保护。
+		JobWorker *volatile worker; // 当前负责执行该分类的线程，可能被窃取。
+		bool pumping;               // 为 true 时不可被窃取。
+		bool queued;                // 是否在 worker 的就绪队列中。
 
 		RecursiveMutex queue_mutex;
 		boost::container::deque<JobElement> queue;
 
 		FiberState state;
-		boost::scoped_ptr<FiberStackAllocator::Storage> stack;
-		::ucontext_t inner;
-		::ucontext_t outer;
+		boost::shared_ptr<FiberStack> stack;
+		FiberContext inner;
+		FiberContext outer;
 
-		explicit FiberControl(Initializer){
+		explicit FiberControl(boost::weak_ptr<const void> category_)
+			: category(STD_MOVE(category_)), worker(NULLPTR), pumping(false), queued(false)
+		{
 			state = FS_READY;
-			g_stack_allocator.allocate(stack);
-#ifndef NDEBUG
-			std::memset(&inner, 0xCC, sizeof(outer));
-			std::memset(&outer, 0xCC, sizeof(outer));
-#endif
 		}
 		~FiberControl(){
 			assert(state == FS_READY);
-			g_stack_allocator.deallocate(stack);
-#ifndef NDEBUG
-			std::memset(&inner, 0xCC, sizeof(outer));
-			std::memset(&outer, 0xCC, sizeof(outer));
-#endif
+			if(stack){
+				g_stack_allocator.deallocate(stack);
+			}
 		}
 	};
 
 	__thread FiberControl *volatile t_current_fiber = 0; // XXX: NULLPTR
 
-	Mutex g_fiber_map_mutex;
-	ConditionVariable g_new_job;
-	boost::container::map<boost::weak_ptr<const void>, FiberControl> g_fiber_map;
-
-	void fiber_proc(int low, int high) NOEXCEPT {
-		PROFILE_ME;
+	volatile bool g_running = false;
 
-		FiberControl *fiber;
-		const int params[2] = { low, high };
-		std::memcpy(&fiber, params, sizeof(fiber));
+	// 同一分类的任务总是在同一个线程中串行执行。
+	Mutex g_fiber_map_mutex;
+	boost::container::map<boost::weak_ptr<const void>, boost::shared_ptr<FiberControl> > g_fiber_map;
 
-		LOG_POSEIDON_TRACE("Entering fiber ", static_cast<void *>(fiber));
+	void perform_job(JobBase &job) NOEXCEPT {
 		try {
-			fiber->queue.front().job->perform();
+			job.perform();
 		} catch(std::exception &e){
 			LOG_POSEIDON_WARNING("std::exception thrown: what = ", e.what());
 		} catch(...){
 			LOG_POSEIDON_WARNING("Unknown exception thrown");
 		}
-		LOG_POSEIDON_TRACE("Exited from fiber ", static_cast<void *>(fiber));
+	}
+
+	void fiber_proc(void *param) NOEXCEPT {
+		const AUTO(fiber, static_cast<FiberControl *>(param));
+		{
+			PROFILE_ME;
 
+			LOG_POSEIDON_TRACE("Entering fiber ", static_cast<void *>(fiber));
+			perform_job(*(fiber->queue.front().job));
+			LOG_POSEIDON_TRACE("Exited from fiber ", static_cast<void *>(fiber));
+		}
 		fiber->state = FS_READY;
+		// 这个函数不能返回。下次调度时会重新准备上下文。
+		fiber->inner.switch_to(fiber->outer);
+		std::abort();
 	}
 
 	void schedule_fiber(FiberControl *fiber) NOEXCEPT {
 		PROFILE_ME;
 
 		if(fiber->state == FS_READY){
-			if(::getcontext(&(fiber->inner)) != 0){
-				const int err_code = errno;
-				LOG_POSEIDON_FATAL("::getcontext() failed: err_code = ", err_code);
-				std::abort();
-			}
-			fiber->inner.uc_stack.ss_sp = fiber->stack.get();
-			fiber->inner.uc_stack.ss_size = sizeof(*(fiber->stack));
-			fiber->inner.uc_link = &(fiber->outer);
-
-			int params[2] = { };
-			BOOST_STATIC_ASSERT(sizeof(fiber) <= sizeof(params));
-			std::memcpy(params, &fiber, sizeof(fiber));
-			::makecontext(&(fiber->inner), reinterpret_cast<void (*)()>(&fiber_proc), 2, params[0], params[1]);
+			fiber->inner.prepare(fiber->stack->get_base(), fiber->stack->get_size(), &fiber_proc, fiber);
 		}
 
 		t_current_fiber = fiber;
@@ -180,11 +267,7 @@ namespace {
 				std::abort();
 			}
 			fiber->state = FS_RUNNING;
-			if(::swapcontext(&(fiber->outer), &(fiber->inner)) != 0){
-				const int err_code = errno;
-				LOG_POSEIDON_FATAL("::swapcontext() failed: err_code = ", err_code);
-				std::abort();
-			}
+			fiber->outer.switch_to(fiber->inner);
 		}
 		Profiler::end_stack_switch(profiler_hook);
 		t_current_fiber = NULLPTR;
@@ -212,8 +295,20 @@ namespace {
 		}
 		if((fiber->state == FS_READY) && elem->withdrawn && *(elem->withdrawn)){
 			LOG_POSEIDON_DEBUG("Job is withdrawn");
+		} else if((fiber->state == FS_READY) && !elem->job->may_yield()){
+			// 不会让出的任务直接在当前栈上执行，不需要切换上下文。
+			perform_job(*(elem->job));
 		} else {
-			schedule_fiber(fiber);
+			if(!fiber->stack){
+				try {
+					fiber->stack = g_stack_allocator.allocate();
+				} catch(std::exception &e){
+					LOG_POSEIDON_ERROR("Failed to allocate fiber stack, the job will be dropped: what = ", e.what());
+				}
+			}
+			if(fiber->stack){
+				schedule_fiber(fiber);
+			}
 		}
 		if(fiber->state == FS_READY){
 			const RecursiveMutex::UniqueLock queue_lock(fiber->queue_mutex);
@@ -221,77 +316,531 @@ namespace {
 		}
 		return true;
 	}
-	bool pump_one_round(bool force_expiry) NOEXCEPT {
+	struct DeadlineElement {
+		boost::uint64_t due_time;
+		boost::weak_ptr<FiberControl> fiber;
+
+		DeadlineElement(boost::uint64_t due_time_, boost::weak_ptr<FiberControl> fiber_)
+			: due_time(due_time_), fiber(STD_MOVE(fiber_))
+		{ }
+	};
+	// 用于 std::push_heap() 等，使最早到期的元素位于堆顶。
+	bool operator<(const DeadlineElement &lhs, const DeadlineElement &rhs) NOEXCEPT {
+		return lhs.due_time > rhs.due_time;
+	}
+
+	struct InboxNode : NONCOPYABLE {
+		InboxNode *next;
+		boost::weak_ptr<const void> category;
+		JobElement elem;
+
+		InboxNode(boost::weak_ptr<const void> category_, boost::shared_ptr<JobBase> job_, boost::shared_ptr<const bool> withdrawn_)
+			: next(NULLPTR), category(STD_MOVE(category_)), elem(STD_MOVE(job_), STD_MOVE(withdrawn_))
+		{ }
+	};
+
+	// 多生产者单消费者的无锁队列，生产者不需要持有任何锁。
+	class JobInbox : NONCOPYABLE {
+	private:
+		InboxNode *volatile m_head;
+
+	public:
+		JobInbox()
+			: m_head(NULLPTR)
+		{ }
+		~JobInbox(){
+			AUTO(node, take_all());
+			while(node){
+				const AUTO(next, node->next);
+				delete node;
+				node = next;
+			}
+		}
+
+	public:
+		bool empty() const NOEXCEPT {
+			return !atomic_load(m_head, ATOMIC_SEQ_CST);
+		}
+		// 如果队列原来为空则返回 true。
+		bool push(InboxNode *node) NOEXCEPT {
+			AUTO(head, atomic_load(m_head, ATOMIC_RELAXED));
+			do {
+				node->next = head;
+			} while(!atomic_compare_exchange(m_head, head, node, ATOMIC_SEQ_CST, ATOMIC_RELAXED));
+			return !head;
+		}
+		// 按照加入的顺序返回所有节点。
+		InboxNode *take_all() NOEXCEPT {
+			AUTO(node, atomic_exchange(m_head, static_cast<InboxNode *>(NULLPTR), ATOMIC_SEQ_CST));
+			InboxNode *list = NULLPTR;
+			while(node){
+				const AUTO(next, node->next);
+				node->next = list;
+				list = node;
+				node = next;
+			}
+			return list;
+		}
+	};
+
+	// 0 号线程就是主线程，其余的线程由 start() 创建。
+	// 每个线程只处理就绪队列中的纤程，等待 JobPromise 的纤程在被满足或超时之前不会被访问。
+	class JobWorker : NONCOPYABLE {
+	private:
+		const std::size_t m_index;
+
+		Thread m_thread;
+		volatile bool m_closed; // 由 g_fiber_map_mutex 保护写入。
+
+		JobInbox m_inbox; // 新的任务，由本线程分发到各个分类。
+
+		mutable Mutex m_mutex;
+		mutable ConditionVariable m_new_job;
+		std::size_t m_fiber_count;
+		boost::container::deque<boost::shared_ptr<FiberControl> > m_ready_queue;
+		std::vector<DeadlineElement> m_deadline_heap;
+
+	public:
+		explicit JobWorker(std::size_t index)
+			: m_index(index)
+			, m_closed(false)
+			, m_fiber_count(0)
+		{ }
+
+	private:
+		void thread_proc(){
+			PROFILE_ME;
+			LOG_POSEIDON_INFO("Job worker ", m_index, " started.");
+
+			do_modal(g_running);
+
+			LOG_POSEIDON_INFO("Job worker ", m_index, " stopped.");
+		}
+
+		// 调用者需要持有 m_mutex。
+		void push_ready_unlocked(const boost::shared_ptr<FiberControl> &fiber){
+			if(fiber->queued){
+				return;
+			}
+			m_ready_queue.push_back(fiber);
+			fiber->queued = true;
+			m_new_job.signal();
+		}
+
+		bool pump_fiber(const boost::shared_ptr<FiberControl> &fiber, bool force_expiry) NOEXCEPT {
+			{
+				const Mutex::UniqueLock lock(m_mutex);
+				if(fiber->worker != this){
+					// 已经被其他线程窃取。
+					return false;
+				}
+				fiber->queued = false;
+				fiber->pumping = true;
+			}
+			const bool busy = pump_one_fiber(fiber.get(), force_expiry);
+
+			bool requeue = false;
+			bool erase = false;
+			boost::uint64_t due_time = 0;
+			{
+				const RecursiveMutex::UniqueLock queue_lock(fiber->queue_mutex);
+				if(fiber->queue.empty()){
+					erase = true;
+				} else if(fiber->state != FS_YIELDED){
+					requeue = true;
+				} else {
+					const AUTO_REF(elem, fiber->queue.front());
+					if(!elem.promise || elem.promise->is_satisfied()){
+						requeue = true;
+					} else {
+						due_time = elem.expiry_time;
+					}
+				}
+			}
+			try {
+				const Mutex::UniqueLock lock(m_mutex);
+				fiber->pumping = false;
+				if(requeue){
+					push_ready_unlocked(fiber);
+				} else if(due_time != 0){
+					m_deadline_heap.push_back(DeadlineElement(due_time, fiber));
+					std::push_heap(m_deadline_heap.begin(), m_deadline_heap.end());
+				}
+			} catch(std::exception &e){
+				LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
+			}
+			if(erase){
+				// 新的任务只会在持有 g_fiber_map_mutex 的情况下被加入队列。
+				const Mutex::UniqueLock map_lock(g_fiber_map_mutex);
+				{
+					const RecursiveMutex::UniqueLock queue_lock(fiber->queue_mutex);
+					erase = fiber->queue.empty();
+				}
+				const Mutex::UniqueLock lock(m_mutex);
+				if(erase && (fiber->worker == this)){
+					const AUTO(it, g_fiber_map.find(fiber->category));
+					if((it != g_fiber_map.end()) && (it->second == fiber)){
+						g_fiber_map.erase(it);
+						--m_fiber_count;
+					}
+				}
+			}
+			return busy;
+		}
+
+		// 把收到的任务放入各自分类的队列。
+		bool drain_inbox() NOEXCEPT;
+		// 从其他线程中窃取一个没有在执行且有任务等待的分类。
+		bool steal_one_category() NOEXCEPT;
+
+	public:
+		std::size_t get_index() const NOEXCEPT {
+			return m_index;
+		}
+		bool is_closed() const NOEXCEPT {
+			return atomic_load(m_closed, ATOMIC_CONSUME);
+		}
+
+		void start(){
+			Thread(boost::bind(&JobWorker::thread_proc, this), "  J ").swap(m_thread);
+		}
+		void join(){
+			if(m_thread.joinable()){
+				m_thread.join();
+			}
+		}
+
+		// 调用者需要持有 g_fiber_map_mutex。
+		void attach_fiber(const boost::shared_ptr<FiberControl> &fiber, bool ready){
+			const Mutex::UniqueLock lock(m_mutex);
+			++m_fiber_count;
+			atomic_store(fiber->worker, this, ATOMIC_RELEASE);
+			if(ready){
+				push_ready_unlocked(fiber);
+			}
+		}
+		boost::shared_ptr<FiberControl> detach_idle_fiber() NOEXCEPT {
+			const Mutex::UniqueLock lock(m_mutex);
+			for(AUTO(it, m_ready_queue.begin()); it != m_ready_queue.end(); ++it){
+				const AUTO(fiber, *it);
+				if(fiber->pumping || (fiber->state != FS_READY)){
+					continue;
+				}
+				m_ready_queue.erase(it);
+				fiber->queued = false;
+				--m_fiber_count;
+				atomic_store(fiber->worker, static_cast<JobWorker *>(NULLPTR), ATOMIC_RELEASE);
+				return fiber;
+			}
+			return VAL_INIT;
+		}
+		// 如果 fiber 不属于这个线程则返回 false。
+		bool mark_ready(const boost::shared_ptr<FiberControl> &fiber){
+			const Mutex::UniqueLock lock(m_mutex);
+			if(fiber->worker != this){
+				return false;
+			}
+			push_ready_unlocked(fiber);
+			return true;
+		}
+		void notify() NOEXCEPT {
+			const Mutex::UniqueLock lock(m_mutex);
+			m_new_job.signal();
+		}
+
+		bool has_pending_jobs() const NOEXCEPT {
+			return !m_inbox.empty();
+		}
+		void post(InboxNode *node) NOEXCEPT {
+			if(m_inbox.push(node)){
+				notify();
+			}
+		}
+		// 调用者需要持有 g_fiber_map_mutex。
+		InboxNode *take_inbox() NOEXCEPT {
+			return m_inbox.take_all();
+		}
+
+		bool pump_one_round(bool force_expiry) NOEXCEPT {
+			PROFILE_ME;
+
+			const AUTO(now, get_fast_mono_clock());
+			boost::container::deque<boost::shared_ptr<FiberControl> > ready_queue;
+			try {
+				const Mutex::UniqueLock lock(m_mutex);
+				while(!m_deadline_heap.empty()){
+					if(!force_expiry && (now < m_deadline_heap.front().due_time)){
+						break;
+					}
+					const AUTO(fiber, m_deadline_heap.front().fiber.lock());
+					std::pop_heap(m_deadline_heap.begin(), m_deadline_heap.end());
+					m_deadline_heap.pop_back();
+					if(fiber && (fiber->worker == this)){
+						push_ready_unlocked(fiber);
+					}
+				}
+				ready_queue.swap(m_ready_queue);
+			} catch(std::exception &e){
+				LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
+			}
+			bool busy = drain_inbox();
+			for(AUTO(it, ready_queue.begin()); it != ready_queue.end(); ++it){
+				busy += pump_fiber(*it, force_expiry);
+			}
+			if(!busy){
+				busy = steal_one_category();
+			}
+			return busy;
+		}
+
+		void do_modal(const volatile bool &running);
+	};
+
+	std::size_t g_job_worker_count = 1;
+	std::vector<boost::shared_ptr<JobWorker> > g_workers;
+
+	// enqueue() 不加锁访问 g_workers。其他守护线程在 JobDispatcher 停止之后仍可能调用 enqueue()，
+	// 因此 stop() 先关闭入口，等待正在访问 g_workers 的调用者离开之后才释放 worker。
+	volatile bool g_accepting = false;
+	volatile std::size_t g_enqueuers = 0;
+
+	bool JobWorker::steal_one_category() NOEXCEPT {
 		PROFILE_ME;
 
-		bool busy = false;
-		Mutex::UniqueLock lock(g_fiber_map_mutex);
-		AUTO(it, g_fiber_map.begin());
+		if(g_workers.size() <= 1){
+			return false;
+		}
+		for(std::size_t i = 1; i < g_workers.size(); ++i){
+			const AUTO_REF(victim, g_workers.at((m_index + i) % g_workers.size()));
+			const AUTO(fiber, victim->detach_idle_fiber());
+			if(!fiber){
+				continue;
+			}
+			LOG_POSEIDON_TRACE("Job worker ", m_index, " stole a category from job worker ", victim->get_index());
+			const Mutex::UniqueLock map_lock(g_fiber_map_mutex);
+			attach_fiber(fiber, true);
+			return true;
+		}
+		return false;
+	}
+
+	// 调用者需要持有 g_fiber_map_mutex。
+	void forward_to_primary_worker_unlocked(InboxNode *node) NOEXCEPT {
+		while(node){
+			const AUTO(next, node->next);
+			g_workers.front()->post(node);
+			node = next;
+		}
+	}
+
+	JobWorker *get_home_worker(const boost::weak_ptr<const void> &category) NOEXCEPT {
+		if(g_workers.empty()){
+			return NULLPTR;
+		}
+		const AUTO(key, reinterpret_cast<std::size_t>(category.lock().get()));
+		const AUTO(worker, g_workers.at((key >> 4) % g_workers.size()).get());
+		if(worker->is_closed()){
+			return g_workers.front().get();
+		}
+		return worker;
+	}
+
+	// 在主线程中执行所有剩余的任务和纤程。
+	void drain_all_workers(){
+		boost::uint64_t last_info_time = 0;
 		for(;;){
-			if(it == g_fiber_map.end()){
+			std::size_t pending_fibers;
+			{
+				const Mutex::UniqueLock lock(g_fiber_map_mutex);
+				pending_fibers = g_fiber_map.size();
+			}
+			bool pending_jobs = false;
+			for(std::size_t i = 0; i < g_workers.size(); ++i){
+				pending_jobs |= g_workers.at(i)->has_pending_jobs();
+			}
+			if((pending_fibers == 0) && !pending_jobs){
 				break;
 			}
-			AUTO(fiber, &(it->second));
-			lock.unlock();
-			{
-				busy += pump_one_fiber(fiber, force_expiry);
+
+			const AUTO(now, get_fast_mono_clock());
+			if(last_info_time + 500 < now){
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "There are ", pending_fibers, " fiber(s) remaining.");
+				last_info_time = now;
 			}
-			lock.lock();
-			if(fiber->queue.empty()){
-				it = g_fiber_map.erase(it);
-			} else {
-				++it;
+
+			g_workers.front()->pump_one_round(true);
+		}
+	}
+
+	// 把纤程放入其所属线程的就绪队列。如果纤程正在被窃取，窃取者会负责将其放入自己的就绪队列。
+	void wake_fiber(const boost::weak_ptr<FiberControl> &weak) NOEXCEPT
+	try {
+		const AUTO(fiber, weak.lock());
+		if(!fiber){
+			return;
+		}
+		for(;;){
+			const AUTO(worker, atomic_load(fiber->worker, ATOMIC_CONSUME));
+			if(!worker){
+				break;
+			}
+			if(worker->mark_ready(fiber)){
+				break;
+			}
+		}
+	} catch(std::exception &e){
+		LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
+	}
+
+	bool JobWorker::drain_inbox() NOEXCEPT {
+		PROFILE_ME;
+
+		AUTO(node, m_inbox.take_all());
+		if(!node){
+			return false;
+		}
+		boost::container::vector<boost::shared_ptr<FiberControl> > fibers_to_wake;
+		{
+			const Mutex::UniqueLock map_lock(g_fiber_map_mutex);
+			while(node){
+				const AUTO(next, node->next);
+				try {
+					AUTO(it, g_fiber_map.find(node->category));
+					if(it == g_fiber_map.end()){
+						AUTO(fiber, boost::make_shared<FiberControl>(node->category));
+						it = g_fiber_map.emplace(node->category, fiber).first;
+						attach_fiber(fiber, false);
+					}
+					const AUTO_REF(fiber, it->second);
+					{
+						const RecursiveMutex::UniqueLock queue_lock(fiber->queue_mutex);
+						fiber->queue.push_back(STD_MOVE_IDN(node->elem));
+					}
+					if(fibers_to_wake.empty() || (fibers_to_wake.back() != fiber)){
+						fibers_to_wake.push_back(fiber);
+					}
+				} catch(std::exception &e){
+					LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
+				}
+				delete node;
+				node = next;
+			}
+		}
+		for(AUTO(it, fibers_to_wake.begin()); it != fibers_to_wake.end(); ++it){
+			wake_fiber(*it);
+		}
+		return true;
+	}
+
+	void JobWorker::do_modal(const volatile bool &running){
+		unsigned timeout = 0;
+		for(;;){
+			bool busy;
+			do {
+				busy = pump_one_round(!atomic_load(running, ATOMIC_CONSUME));
+				timeout = std::min(timeout * 2u + 1u, !busy * 100u);
+			} while(busy);
+
+			if(!atomic_load(running, ATOMIC_CONSUME)){
+				if(m_index == 0){
+					break;
+				}
+				// 在没有任务的时候退出，之后新的分类都会被分配给主线程。
+				bool closed = false;
+				{
+					const Mutex::UniqueLock map_lock(g_fiber_map_mutex);
+					{
+						const Mutex::UniqueLock lock(m_mutex);
+						if((m_fiber_count == 0) && m_inbox.empty()){
+							atomic_store(m_closed, true, ATOMIC_SEQ_CST);
+							closed = true;
+						}
+					}
+					if(closed){
+						// 在此之前没有看到 m_closed 的生产者投递的任务由我们转交给主线程。
+						forward_to_primary_worker_unlocked(m_inbox.take_all());
+					}
+				}
+				if(closed){
+					break;
+				}
 			}
+			Mutex::UniqueLock lock(m_mutex);
+			if(!m_ready_queue.empty() || !m_inbox.empty()){
+				continue;
+			}
+			m_new_job.timed_wait(lock, timeout);
 		}
-		return busy;
 	}
 }
 
 void JobDispatcher::start(){
+	if(atomic_exchange(g_running, true, ATOMIC_ACQ_REL) != false){
+		LOG_POSEIDON_FATAL("Only one daemon is allowed at the same time.");
+		std::abort();
+	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Starting job dispatcher...");
 
 	MainConfig::get(g_job_timeout, "job_timeout");
 	LOG_POSEIDON_DEBUG("job_timeout = ", g_job_timeout);
+
+	MainConfig::get(g_job_worker_count, "job_worker_count");
+	LOG_POSEIDON_DEBUG("job_worker_count = ", g_job_worker_count);
+
+	MainConfig::get(g_fiber_stack_size, "job_fiber_stack_size");
+	LOG_POSEIDON_DEBUG("job_fiber_stack_size = ", g_fiber_stack_size);
+
+	MainConfig::get(g_fiber_stack_pool_size, "job_fiber_stack_pool_size");
+	LOG_POSEIDON_DEBUG("job_fiber_stack_pool_size = ", g_fiber_stack_pool_size);
+
+	if(g_fiber_stack_size < 16384){
+		LOG_POSEIDON_WARNING("job_fiber_stack_size is too small, using 16384 instead.");
+		g_fiber_stack_size = 16384;
+	}
+
+	g_workers.resize(std::max<std::size_t>(g_job_worker_count, 1));
+	for(std::size_t i = 0; i < g_workers.size(); ++i){
+		g_workers.at(i) = boost::make_shared<JobWorker>(i);
+	}
+	// 线程启动之后就可能访问其他 worker，因此必须在所有 worker 都创建之后再启动。
+	for(std::size_t i = 1; i < g_workers.size(); ++i){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Creating job worker ", i);
+		g_workers.at(i)->start();
+	}
+	atomic_store(g_accepting, true, ATOMIC_SEQ_CST);
 }
 void JobDispatcher::stop(){
+	if(atomic_exchange(g_running, false, ATOMIC_ACQ_REL) == false){
+		return;
+	}
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping job dispatcher...");
 
-	boost::uint64_t last_info_time = 0;
-	for(;;){
-		std::size_t pending_fibers;
-		{
-			const Mutex::UniqueLock lock(g_fiber_map_mutex);
-			pending_fibers = g_fiber_map.size();
-		}
-		if(pending_fibers == 0){
-			break;
-		}
+	for(std::size_t i = 1; i < g_workers.size(); ++i){
+		g_workers.at(i)->notify();
+	}
 
-		const AUTO(now, get_fast_mono_clock());
-		if(last_info_time + 500 < now){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "There are ", pending_fibers, " fiber(s) remaining.");
-			last_info_time = now;
-		}
+	drain_all_workers();
 
-		pump_one_round(true);
+	// 不再接受新的任务。在此之后 enqueue() 会抛出异常，而不是把任务留在没有人处理的队列中。
+	atomic_store(g_accepting, false, ATOMIC_SEQ_CST);
+	while(atomic_load(g_enqueuers, ATOMIC_SEQ_CST) != 0){
+		atomic_pause();
 	}
+	drain_all_workers();
+
+	for(std::size_t i = 1; i < g_workers.size(); ++i){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Waiting for job worker ", i, " to terminate...");
+		g_workers.at(i)->join();
+	}
+	g_workers.clear();
+}
+
+void JobDispatcher::get_fiber_stack_stats(JobDispatcher::FiberStackStats &stats){
+	g_stack_allocator.get_stats(stats);
 }
 
 void JobDispatcher::do_modal(const volatile bool &running){
-	unsigned timeout = 0;
-	for(;;){
-		bool busy;
-		do {
-			busy = pump_one_round(!atomic_load(running, ATOMIC_CONSUME));
-			timeout = std::min(timeout * 2u + 1u, !busy * 100u);
-		} while(busy);
-
-		Mutex::UniqueLock lock(g_fiber_map_mutex);
-		if(!atomic_load(running, ATOMIC_CONSUME)){
-			break;
-		}
-		g_new_job.timed_wait(lock, timeout);
-	}
+	g_workers.front()->do_modal(running);
 }
 
 void JobDispatcher::enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<const bool> withdrawn){
@@ -303,23 +852,37 @@ void JobDispatcher::enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<co
 		category = job;
 	}
 
-	const Mutex::UniqueLock lock(g_fiber_map_mutex);
-	AUTO(it, g_fiber_map.find(category));
-	if(it == g_fiber_map.end()){
-		it = g_fiber_map.emplace(category, FiberControl::Initializer()).first;
-	}
-	const AUTO(fiber, &(it->second));
-	{
-		const RecursiveMutex::UniqueLock queue_lock(fiber->queue_mutex);
-		fiber->queue.push_back(JobElement(STD_MOVE(job), STD_MOVE(withdrawn)));
+	// 先登记再检查入口，与 stop() 中的顺序相反，两者必有一方看到另一方。
+	atomic_add(g_enqueuers, 1, ATOMIC_SEQ_CST);
+	try {
+		if(!atomic_load(g_accepting, ATOMIC_SEQ_CST)){
+			LOG_POSEIDON_ERROR("Job dispatcher is not running.");
+			DEBUG_THROW(Exception, sslit("Job dispatcher is not running"));
+		}
+		const AUTO(worker, get_home_worker(category));
+		// 同一分类的任务总是投递到同一个线程，由该线程按照顺序分发。
+		worker->post(new InboxNode(STD_MOVE(category), STD_MOVE(job), STD_MOVE(withdrawn)));
+		if(worker->is_closed()){
+			// 这个线程可能已经不再处理新的任务了。
+			const Mutex::UniqueLock lock(g_fiber_map_mutex);
+			forward_to_primary_worker_unlocked(worker->take_inbox());
+		}
+	} catch(...){
+		atomic_sub(g_enqueuers, 1, ATOMIC_SEQ_CST);
+		throw;
 	}
-	g_new_job.signal();
+	atomic_sub(g_enqueuers, 1, ATOMIC_SEQ_CST);
 }
 void JobDispatcher::yield(const boost::shared_ptr<const JobPromise> &promise, bool insignificant){
 	PROFILE_ME;
 
 	const AUTO(fiber, t_current_fiber);
 	if(!fiber){
+		// 不在纤程中执行的任务不能让出，但是如果不需要等待，就没有必要让出。
+		if(promise && promise->is_satisfied()){
+			promise->check_and_rethrow();
+			return;
+		}
 		DEBUG_THROW(Exception, sslit("No current fiber"));
 	}
 
@@ -327,22 +890,26 @@ void JobDispatcher::yield(const boost::shared_ptr<const JobPromise> &promise, bo
 		LOG_POSEIDON_FATAL("Not in current fiber?!");
 		std::abort();
 	}
-	if(promise && promise->is_satisfied()){
+	bool skip = false;
+	if(promise){
+		// 被满足时把当前纤程放入就绪队列。
+		skip = !promise->add_waiter(boost::bind(&wake_fiber, boost::weak_ptr<FiberControl>(fiber->shared_from_this())));
+	}
+	if(skip){
 		LOG_POSEIDON_TRACE("Skipped yielding from fiber ", static_cast<void *>(fiber));
 	} else {
 		LOG_POSEIDON_TRACE("Yielding from fiber ", static_cast<void *>(fiber));
 		AUTO_REF(elem, fiber->queue.front());
-		elem.promise = promise;
-		elem.expiry_time = saturated_add(get_fast_mono_clock(), g_job_timeout);
-		elem.insignificant = insignificant;
+		{
+			const RecursiveMutex::UniqueLock queue_lock(fiber->queue_mutex);
+			elem.promise = promise;
+			elem.expiry_time = saturated_add(get_fast_mono_clock(), g_job_timeout);
+			elem.insignificant = insignificant;
+		}
 		const AUTO(profiler_hook, Profiler::begin_stack_switch());
 		{
 			fiber->state = FS_YIELDED;
-			if(::swapcontext(&(fiber->inner), &(fiber->outer)) != 0){
-				const int err_code = errno;
-				LOG_POSEIDON_FATAL("::swapcontext() failed: err_code = ", err_code);
-				std::abort();
-			}
+			fiber->inner.switch_to(fiber->outer);
 		}
 		Profiler::end_stack_switch(profiler_hook);
 		LOG_POSEIDON_TRACE("Resumed to fiber ", static_cast<void *>(fiber));
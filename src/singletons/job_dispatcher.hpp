@@ -6,6 +6,7 @@
 
 #include "../cxx_ver.hpp"
 #include <boost/shared_ptr.hpp>
+#include <cstddef>
 
 namespace Poseidon {
 
@@ -17,9 +18,18 @@ private:
 	JobDispatcher();
 
 public:
+	struct FiberStackStats {
+		std::size_t stack_size;
+		std::size_t total_count;     // 已映射的栈的数量，包含池中的。
+		std::size_t pooled_count;
+		std::size_t high_water_mark; // 所有栈曾经使用过的最大字节数。
+	};
+
 	static void start();
 	static void stop();
 
+	static void get_fiber_stack_stats(FiberStackStats &stats);
+
 	static void do_modal(const volatile bool &running);
 
 	static void enqueue(boost::shared_ptr<JobBase> job, boost::shared_ptr<const bool> withdrawn);
@@ -4,7 +4,9 @@
 #include "../precompiled.hpp"
 #include "mysql_daemon.hpp"
 #include "main_config.hpp"
+#include "job_dispatcher.hpp"
 #include <boost/container/flat_map.hpp>
+#include <typeinfo>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -23,6 +25,7 @@
 #include "../log.hpp"
 #include "../raii.hpp"
 #include "../job_promise.hpp"
+#include "../job_base.hpp"
 #include "../profiler.hpp"
 #include "../time.hpp"
 #include "../errno.hpp"
@@ -31,16 +34,19 @@
 namespace Poseidon {
 
 typedef MySqlDaemon::QueryCallback QueryCallback;
+typedef MySqlDaemon::ObjectFactory ObjectFactory;
+typedef MySqlDaemon::PageCallback PageCallback;
 
 namespace {
 	std::string     g_server_addr       = "localhost";
 	unsigned        g_server_port       = 3306;
-	std::string     g_slave_addr        = VAL_INIT;
+	std::vector<std::string> g_slave_addrs;
 	unsigned        g_slave_port        = 0;
 	std::string     g_username          = "root";
 	std::string     g_password          = "root";
 	std::string     g_schema            = "poseidon";
 	bool            g_use_ssl           = false;
+	bool            g_use_prepared_stmt = true;
 	std::string     g_charset           = "utf8";
 
 	std::string     g_dump_dir          = VAL_INIT;
@@ -49,20 +55,36 @@ namespace {
 	std::size_t     g_max_retry_count   = 3;
 	boost::uint64_t g_retry_init_delay  = 1000;
 	std::size_t     g_max_thread_count  = 8;
+	std::size_t     g_save_batch_size   = 100;
+	std::size_t     g_max_stream_pages  = 4;
+	unsigned        g_stream_write_timeout = 3600;
+	std::size_t     g_max_read_thread_count = 0;
 
+	volatile std::size_t g_slave_cursor = 0;
 
+	// 多个从库按轮转的顺序使用。没有配置从库时使用主库。
+	inline const std::string &pick_slave_addr(){
+		if(g_slave_addrs.empty()){
+			return g_server_addr;
+		}
+		const AUTO(index, atomic_add(g_slave_cursor, 1, ATOMIC_RELAXED));
+		return g_slave_addrs.at(index % g_slave_addrs.size());
+	}
+	inline unsigned get_slave_port(){
+		if(g_slave_port == 0){
+			return g_server_port;
+		}
+		return g_slave_port;
+	}
+
+	inline boost::shared_ptr<MySql::Connection> real_create_connection(const std::string &addr, unsigned port){
+		return MySql::Connection::create(addr, port, g_username, g_password, g_schema, g_use_ssl, g_charset);
+	}
 	inline boost::shared_ptr<MySql::Connection> real_create_connection(bool from_slave){
-		AUTO(addr, &g_server_addr);
-		AUTO(port, &g_server_port);
 		if(from_slave){
-			if(!g_slave_addr.empty()){
-				addr = &g_slave_addr;
-			}
-			if(g_slave_port != 0){
-				port = &g_slave_port;
-			}
+			return real_create_connection(pick_slave_addr(), get_slave_port());
 		}
-		return MySql::Connection::create(*addr, *port, g_username, g_password, g_schema, g_use_ssl, g_charset);
+		return real_create_connection(g_server_addr, g_server_port);
 	}
 
 	// 对于日志文件的写操作应当互斥。
@@ -144,6 +166,36 @@ namespace {
 		virtual void generate_sql(std::string &query) const = 0;
 		virtual void execute(const boost::shared_ptr<MySql::Connection> &conn, const std::string &query) const = 0;
 
+		// 相邻的可以合并的操作生成一条语句，只执行一次。
+		virtual bool can_batch_with(const OperationBase & /* rhs */) const {
+			return false;
+		}
+		// batch 中的操作都满足 batch.front()->can_batch_with()，并且 batch.front() == this。
+		virtual void generate_batch_sql(std::string &query, const std::vector<const OperationBase *> & /* batch */) const {
+			generate_sql(query);
+		}
+		// 使用服务端预处理语句执行，batch 的含义同上。不支持时返回 false，调用者应当生成 SQL 执行。
+		virtual bool execute_prepared(const boost::shared_ptr<MySql::Connection> & /* conn */, const std::vector<const OperationBase *> & /* batch */) const {
+			return false;
+		}
+
+		// 分段执行的操作每次执行一段，完成之前返回 false，此时重新排到队尾。
+		virtual bool is_finished() const {
+			return true;
+		}
+		// 返回 true 时暂不执行，让出数据库线程。
+		virtual bool is_throttled() const {
+			return false;
+		}
+		// 已经产生了外部可见的结果的操作不能重试。
+		virtual bool can_retry() const {
+			return true;
+		}
+		// 返回 false 时第一次执行不等待写入延迟。
+		virtual bool is_delayable() const {
+			return true;
+		}
+
 		virtual bool is_isolated() const {
 			if(!m_promise){
 				return false;
@@ -215,6 +267,74 @@ namespace {
 
 			conn->execute_sql(query);
 		}
+
+		bool can_batch_with(const OperationBase &rhs) const OVERRIDE {
+			const AUTO(other, dynamic_cast<const SaveOperation *>(&rhs));
+			if(!other){
+				return false;
+			}
+			// 同一个类生成的对象才有相同的列。
+			return (m_to_replace == other->m_to_replace) && (typeid(*m_object) == typeid(*(other->m_object)));
+		}
+		void generate_batch_sql(std::string &query, const std::vector<const OperationBase *> &batch) const OVERRIDE {
+			Buffer_ostream os;
+			if(m_to_replace){
+				os <<"REPLACE";
+			} else {
+				os <<"INSERT";
+			}
+			os <<" INTO `" <<get_table() <<"` ";
+			m_object->generate_sql_columns(os);
+			os <<" VALUES ";
+			for(AUTO(it, batch.begin()); it != batch.end(); ++it){
+				if(it != batch.begin()){
+					os <<", ";
+				}
+				static_cast<const SaveOperation *>(*it)->m_object->generate_sql_values(os);
+			}
+			query = os.get_buffer().dump_string();
+		}
+		bool execute_prepared(const boost::shared_ptr<MySql::Connection> &conn, const std::vector<const OperationBase *> &batch) const OVERRIDE {
+			PROFILE_ME;
+
+			// 只为单行和满批次准备语句，使每个连接上缓存的语句数量有界。
+			// 其他行数的批次使用普通的多行语句，仍然在一条语句中完成。
+			if((batch.size() != 1) && (batch.size() != g_save_batch_size)){
+				return false;
+			}
+			// 按表名、语句类型和行数缓存。
+			char str[32];
+			unsigned len = (unsigned)std::sprintf(str, " %lu", (unsigned long)batch.size());
+			std::string key;
+			key.reserve(64);
+			key.append(m_to_replace ? "REPLACE " : "INSERT ");
+			key.append(get_table());
+			key.append(str, len);
+			if(!conn->has_prepared_statement(key)){
+				Buffer_ostream os;
+				if(m_to_replace){
+					os <<"REPLACE";
+				} else {
+					os <<"INSERT";
+				}
+				os <<" INTO `" <<get_table() <<"` ";
+				m_object->generate_sql_columns(os);
+				os <<" VALUES ";
+				for(std::size_t i = 0; i < batch.size(); ++i){
+					if(i != 0){
+						os <<", ";
+					}
+					m_object->generate_sql_placeholders(os);
+				}
+				conn->prepare_statement(key, os.get_buffer().dump_string());
+			}
+			MySql::Connection::StatementParams params;
+			for(AUTO(it, batch.begin()); it != batch.end(); ++it){
+				static_cast<const SaveOperation *>(*it)->m_object->bind_sql_params(params);
+			}
+			conn->execute_prepared(key, params);
+			return true;
+		}
 	};
 
 	class LoadOperation : public OperationBase {
@@ -335,6 +455,163 @@ namespace {
 		}
 	};
 
+	// 流式加载的状态，由数据库线程和处理每一页的任务共享。
+	struct StreamState : NONCOPYABLE {
+		const boost::shared_ptr<JobPromise> promise;
+		const PageCallback callback;
+
+		volatile std::size_t pending_pages;
+		volatile bool cancelled;
+
+		StreamState(boost::shared_ptr<JobPromise> promise_, PageCallback callback_)
+			: promise(STD_MOVE(promise_)), callback(STD_MOVE_IDN(callback_))
+			, pending_pages(0), cancelled(false)
+		{ }
+	};
+
+	class StreamPageJob : public JobBase {
+	private:
+		const boost::shared_ptr<StreamState> m_state;
+		const std::vector<boost::shared_ptr<MySql::ObjectBase> > m_page;
+		const bool m_last;
+
+	public:
+		StreamPageJob(boost::shared_ptr<StreamState> state, std::vector<boost::shared_ptr<MySql::ObjectBase> > page, bool last)
+			: m_state(STD_MOVE(state)), m_page(STD_MOVE(page)), m_last(last)
+		{
+			atomic_add(m_state->pending_pages, 1, ATOMIC_RELAXED);
+		}
+		~StreamPageJob(){
+			// 任务被丢弃时也要减少计数，否则数据库线程会一直等待。
+			atomic_sub(m_state->pending_pages, 1, ATOMIC_RELAXED);
+		}
+
+	public:
+		boost::weak_ptr<const void> get_category() const OVERRIDE {
+			return m_state;
+		}
+		void perform() OVERRIDE {
+			PROFILE_ME;
+
+			if(atomic_load(m_state->cancelled, ATOMIC_CONSUME)){
+				return;
+			}
+			try {
+				if(!m_page.empty()){
+					m_state->callback(m_page);
+				}
+				if(m_last){
+					m_state->promise->set_success();
+				}
+			} catch(std::exception &e){
+				LOG_POSEIDON_WARNING("std::exception thrown: what = ", e.what());
+				atomic_store(m_state->cancelled, true, ATOMIC_RELEASE);
+				if(!m_state->promise->is_satisfied()){
+#ifdef POSEIDON_CXX11
+					m_state->promise->set_exception(std::current_exception());
+#else
+					m_state->promise->set_exception(boost::copy_exception(std::runtime_error(e.what())));
+#endif
+				}
+			}
+		}
+	};
+
+	class StreamingLoadOperation : public OperationBase {
+	private:
+		const boost::shared_ptr<StreamState> m_state;
+		const ObjectFactory m_factory;
+		const char *const m_table_hint;
+		const std::string m_query;
+		const std::size_t m_page_size;
+
+		// 结果集在独立的连接上读取，不影响这个线程中的其他操作。
+		mutable boost::shared_ptr<MySql::Connection> m_conn;
+		mutable bool m_started;
+		mutable bool m_finished;
+
+	public:
+		StreamingLoadOperation(boost::shared_ptr<JobPromise> promise,
+			ObjectFactory factory, PageCallback callback, const char *table_hint, std::string query, std::size_t page_size)
+			: OperationBase(promise)
+			, m_state(boost::make_shared<StreamState>(STD_MOVE(promise), STD_MOVE_IDN(callback)))
+			, m_factory(STD_MOVE_IDN(factory)), m_table_hint(table_hint), m_query(STD_MOVE(query)), m_page_size(std::max<std::size_t>(page_size, 1))
+			, m_started(false), m_finished(false)
+		{ }
+
+	protected:
+		bool should_use_slave() const {
+			return true;
+		}
+		boost::shared_ptr<const MySql::ObjectBase> get_combinable_object() const OVERRIDE {
+			return VAL_INIT; // 不能合并。
+		}
+		const char *get_table() const OVERRIDE {
+			return m_table_hint;
+		}
+		void generate_sql(std::string &query) const OVERRIDE {
+			query = m_query;
+		}
+		void execute(const boost::shared_ptr<MySql::Connection> & /* conn */, const std::string &query) const OVERRIDE {
+			PROFILE_ME;
+
+			if(atomic_load(m_state->cancelled, ATOMIC_CONSUME)){
+				LOG_POSEIDON_DEBUG("Streaming MySQL query cancelled: table = ", get_table());
+				m_conn.reset();
+				m_finished = true;
+				return;
+			}
+			if(!m_conn){
+				AUTO(conn, real_create_connection(true));
+				// 暂停读取时服务端的写操作会阻塞，超过 net_write_timeout 就会断开连接。
+				char str[64];
+				std::sprintf(str, "SET SESSION net_write_timeout = %u", g_stream_write_timeout);
+				conn->execute_sql(str);
+				conn->execute_sql(query);
+				m_conn = STD_MOVE(conn);
+				m_started = true;
+			}
+
+			std::vector<boost::shared_ptr<MySql::ObjectBase> > page;
+			page.reserve(m_page_size);
+			bool last = false;
+			while(page.size() < m_page_size){
+				if(!m_conn->fetch_row()){
+					last = true;
+					break;
+				}
+				AUTO(object, m_factory());
+				object->fetch(m_conn);
+				page.push_back(STD_MOVE_IDN(object));
+			}
+			LOG_POSEIDON_DEBUG("Dispatching MySQL result page: table = ", get_table(), ", rows = ", page.size(), ", last = ", last);
+			JobDispatcher::enqueue(boost::make_shared<StreamPageJob>(m_state, STD_MOVE(page), last), VAL_INIT);
+			if(last){
+				m_conn.reset();
+				m_finished = true;
+			}
+		}
+
+		bool is_finished() const OVERRIDE {
+			return m_finished;
+		}
+		bool is_throttled() const OVERRIDE {
+			return atomic_load(m_state->pending_pages, ATOMIC_CONSUME) >= g_max_stream_pages;
+		}
+		bool can_retry() const OVERRIDE {
+			return !m_started;
+		}
+		bool is_delayable() const OVERRIDE {
+			return false;
+		}
+		bool is_isolated() const OVERRIDE {
+			return false;
+		}
+		void set_success() OVERRIDE {
+			// 由最后一页的任务负责。
+		}
+	};
+
 	class LowLevelAccessOperation : public OperationBase {
 	private:
 		const QueryCallback m_callback;
@@ -425,13 +702,16 @@ namespace {
 			boost::shared_ptr<OperationBase> operation;
 			boost::uint64_t due_time;
 			std::size_t retry_count;
+			bool batch_failed; // 合并执行失败之后逐个执行。
 
 			OperationQueueElement(boost::shared_ptr<OperationBase> operation_, boost::uint64_t due_time_)
-				: operation(STD_MOVE(operation_)), due_time(due_time_), retry_count(0)
+				: operation(STD_MOVE(operation_)), due_time(due_time_), retry_count(0), batch_failed(false)
 			{ }
 		};
 
 	private:
+		const bool m_read_only; // 只执行读操作，不连接主库。
+
 		Thread m_thread;
 		volatile bool m_running;
 
@@ -441,8 +721,9 @@ namespace {
 		boost::container::deque<OperationQueueElement> m_queue;
 
 	public:
-		MySqlThread()
-			: m_running(false)
+		explicit MySqlThread(bool read_only)
+			: m_read_only(read_only)
+			, m_running(false)
 			, m_urgent(false)
 		{ }
 
@@ -454,19 +735,49 @@ namespace {
 
 			const AUTO(now, get_fast_mono_clock());
 			OperationQueueElement *elem;
+			// 队首以及紧随其后的可以合并的操作。
+			std::vector<OperationQueueElement *> batch;
 			{
 				const Mutex::UniqueLock lock(m_mutex);
 				if(m_queue.empty()){
 					atomic_store(m_urgent, false, ATOMIC_RELAXED);
 					return false;
 				}
-				if(!atomic_load(m_urgent, ATOMIC_CONSUME) && (now < m_queue.front().due_time)){
+				const bool urgent = atomic_load(m_urgent, ATOMIC_CONSUME);
+				if(!urgent && (now < m_queue.front().due_time)){
 					return false;
 				}
 				elem = &m_queue.front();
+				batch.push_back(elem);
+				if(!elem->batch_failed){
+					for(std::size_t i = 1; (i < m_queue.size()) && (i < g_save_batch_size); ++i){
+						OperationQueueElement *const next = &m_queue[i];
+						if(next->batch_failed){
+							break;
+						}
+						if(!urgent && (now < next->due_time)){
+							break;
+						}
+						if(!elem->operation->can_batch_with(*(next->operation))){
+							break;
+						}
+						batch.push_back(next);
+					}
+				}
+			}
+			// 停止时任务线程已经不再处理页面，不再暂停，让流式读取尽快结束。
+			if(atomic_load(m_running, ATOMIC_CONSUME) && elem->operation->is_throttled()){
+				// 让出数据库线程，稍后再试。
+				const Mutex::UniqueLock lock(m_mutex);
+				if(m_queue.size() > 1){
+					OperationQueueElement temp = m_queue.front();
+					m_queue.pop_front();
+					m_queue.push_back(temp);
+				}
+				return false;
 			}
 			const AUTO_REF(operation, elem->operation);
-			AUTO_REF(conn, elem->operation->should_use_slave() ? slave_conn : master_conn);
+			AUTO_REF(conn, (m_read_only || elem->operation->should_use_slave()) ? slave_conn : master_conn);
 
 			std::string query;
 #ifdef POSEIDON_CXX11
@@ -484,24 +795,46 @@ namespace {
 				err_msg[len_] = 0;	\
 			} while(false)
 
-			bool execute_it = false;
-			const AUTO(combinable_object, elem->operation->get_combinable_object());
-			if(!combinable_object){
-				execute_it = true;
-			} else {
-				const AUTO(old_write_stamp, combinable_object->get_combined_write_stamp());
-				if(!old_write_stamp){
-					execute_it = true;
-				} else if(old_write_stamp == elem){
-					combinable_object->set_combined_write_stamp(NULLPTR);
+			// 需要写入的操作。同一个对象在一条语句中只能出现一次，遇到重复的对象时截断。
+			std::vector<const OperationBase *> to_execute;
+			std::vector<const MySql::ObjectBase *> objects_executed;
+			for(std::size_t i = 0; i < batch.size(); ++i){
+				OperationQueueElement *const member = batch.at(i);
+				const AUTO(combinable_object, member->operation->get_combinable_object());
+				bool execute_it = false;
+				if(!combinable_object){
 					execute_it = true;
+				} else {
+					const AUTO(old_write_stamp, combinable_object->get_combined_write_stamp());
+					if(!old_write_stamp || (old_write_stamp == member)){
+						if(std::find(objects_executed.begin(), objects_executed.end(), combinable_object.get()) != objects_executed.end()){
+							batch.resize(i);
+							break;
+						}
+						if(old_write_stamp){
+							combinable_object->set_combined_write_stamp(NULLPTR);
+						}
+						execute_it = true;
+					}
+				}
+				if(execute_it){
+					to_execute.push_back(member->operation.get());
+					objects_executed.push_back(combinable_object.get());
 				}
 			}
-			if(execute_it){
+			if(!to_execute.empty()){
 				try {
-					operation->generate_sql(query);
-					LOG_POSEIDON_DEBUG("Executing SQL: table = ", operation->get_table(), ", query = ", query);
-					operation->execute(conn, query);
+					if(g_use_prepared_stmt && to_execute.front()->execute_prepared(conn, to_execute)){
+						LOG_POSEIDON_DEBUG("Executed prepared statement: table = ", operation->get_table(), ", rows = ", to_execute.size());
+					} else {
+						if(to_execute.size() == 1){
+							to_execute.front()->generate_sql(query);
+						} else {
+							to_execute.front()->generate_batch_sql(query, to_execute);
+						}
+						LOG_POSEIDON_DEBUG("Executing SQL: table = ", operation->get_table(), ", rows = ", to_execute.size(), ", query = ", query);
+						to_execute.front()->execute(conn, query);
+					}
 				} catch(MySql::Exception &e){
 					LOG_POSEIDON_WARNING("MySql::Exception thrown: code = ", e.get_code(), ", what = ", e.what());
 #ifdef POSEIDON_CXX11
@@ -529,7 +862,28 @@ namespace {
 				}
 				conn->discard_result();
 			}
-			if(except){
+			if(except && (batch.size() > 1)){
+				// 不能确定是哪一行出错，逐个重新执行，每个操作按原来的规则重试。
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
+					"Batched MySQL operation failed, falling back to individual execution: rows = ", batch.size());
+				for(AUTO(it, batch.begin()); it != batch.end(); ++it){
+					(*it)->batch_failed = true;
+				}
+				// 行级错误（例如主键冲突）不影响连接本身，只有连接断开时才需要重连。
+				if((err_code == CR_SERVER_GONE_ERROR) || (err_code == CR_SERVER_LOST)){
+					conn.reset();
+				}
+				return true;
+			}
+			if(!except && !elem->operation->is_finished()){
+				// 执行了一段，排到队尾等待下次执行。
+				const Mutex::UniqueLock lock(m_mutex);
+				OperationQueueElement temp = m_queue.front();
+				m_queue.pop_front();
+				m_queue.push_back(temp);
+				return true;
+			}
+			if(except && elem->operation->can_retry()){
 				const AUTO(retry_count, ++elem->retry_count);
 				if(retry_count < g_max_retry_count){
 					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
@@ -539,21 +893,35 @@ namespace {
 					return true;
 				}
 				LOG_POSEIDON_ERROR("Max retry count exceeded.");
+				if(query.empty()){
+					// 预处理语句没有生成 SQL，转储时补上。
+					try {
+						operation->generate_sql(query);
+					} catch(std::exception &e){
+						LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
+					}
+				}
 				dump_sql_to_file(query, err_code, err_msg);
 			}
-			if(!elem->operation->is_satisfied()){
+			for(AUTO(it, batch.begin()); it != batch.end(); ++it){
+				const AUTO_REF(member_operation, (*it)->operation);
+				if(member_operation->is_satisfied()){
+					continue;
+				}
 				try {
 					if(!except){
-						elem->operation->set_success();
+						member_operation->set_success();
 					} else {
-						elem->operation->set_exception(except);
+						member_operation->set_exception(except);
 					}
 				} catch(std::exception &e){
 					LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
 				}
 			}
 			const Mutex::UniqueLock lock(m_mutex);
-			m_queue.pop_front();
+			for(std::size_t i = 0; i < batch.size(); ++i){
+				m_queue.pop_front();
+			}
 			return true;
 		}
 
@@ -568,7 +936,7 @@ namespace {
 			for(;;){
 				bool busy;
 				do {
-					while(!master_conn){
+					while(!m_read_only && !master_conn){
 						LOG_POSEIDON_INFO("Connecting to MySQL master server...");
 						try {
 							master_conn = real_create_connection(false);
@@ -581,14 +949,18 @@ namespace {
 							::nanosleep(&req, NULLPTR);
 						}
 					}
-					if((g_server_addr == g_slave_addr) && (g_server_port == g_slave_port) && !slave_conn){
-						LOG_POSEIDON_DEBUG("Reusing the master connection as the slave connection.");
-						slave_conn = master_conn;
-					}
 					while(!slave_conn){
-						LOG_POSEIDON_INFO("Connecting to MySQL slave server...");
+						// 重连时换用下一个从库。
+						const AUTO_REF(slave_addr, pick_slave_addr());
+						const AUTO(slave_port, get_slave_port());
+						if(master_conn && (slave_addr == g_server_addr) && (slave_port == g_server_port)){
+							LOG_POSEIDON_DEBUG("Reusing the master connection as the slave connection.");
+							slave_conn = master_conn;
+							break;
+						}
+						LOG_POSEIDON_INFO("Connecting to MySQL slave server: addr = ", slave_addr, ", port = ", slave_port);
 						try {
-							slave_conn = real_create_connection(true);
+							slave_conn = real_create_connection(slave_addr, slave_port);
 							LOG_POSEIDON_INFO("Successfully connected to MySQL slave server.");
 						} catch(std::exception &e){
 							LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
@@ -631,15 +1003,25 @@ namespace {
 
 		void wait_till_idle(){
 			for(;;){
-				std::size_t pending_objects;
+				std::size_t pending_objects = 0;
 				std::string current_sql;
 				{
 					const Mutex::UniqueLock lock(m_mutex);
-					pending_objects = m_queue.size();
+					// 暂停中的流式读取要等任务线程处理完已读取的页才能继续，这里不等待。
+					const OperationBase *current = NULLPTR;
+					for(AUTO(it, m_queue.begin()); it != m_queue.end(); ++it){
+						if(it->operation->is_throttled()){
+							continue;
+						}
+						if(!current){
+							current = it->operation.get();
+						}
+						++pending_objects;
+					}
 					if(pending_objects == 0){
 						break;
 					}
-					m_queue.front().operation->generate_sql(current_sql);
+					current->generate_sql(current_sql);
 					atomic_store(m_urgent, true, ATOMIC_RELEASE);
 					m_new_operation.signal();
 				}
@@ -664,7 +1046,9 @@ namespace {
 
 			AUTO(due_time, get_fast_mono_clock());
 			// 有紧急操作时无视写入延迟，这个逻辑不在这里处理。
-			due_time += g_save_delay;
+			if(operation->is_delayable()){
+				due_time += g_save_delay;
+			}
 
 			const Mutex::UniqueLock lock(m_mutex);
 			if(!atomic_load(m_running, ATOMIC_CONSUME)){
@@ -696,6 +1080,11 @@ namespace {
 	boost::container::flat_map<SharedNts, Route> g_router;
 	boost::container::flat_multimap<std::size_t, std::size_t> g_routing_map;
 	std::vector<boost::shared_ptr<MySqlThread> > g_threads;
+	// 读操作可以分散到这些线程中，每个线程有自己的从库连接。
+	std::vector<boost::shared_ptr<MySqlThread> > g_read_threads;
+	std::size_t g_read_cursor = 0;
+	// 流式读取分段执行，每段之后排到队尾。使用单独的线程，不会排在尚未到期的写入操作后面。
+	boost::shared_ptr<MySqlThread> g_stream_thread;
 
 	void submit_operation_by_table(const char *table, boost::shared_ptr<OperationBase> operation, bool urgent){
 		PROFILE_ME;
@@ -723,7 +1112,7 @@ namespace {
 				if(!test_thread){
 					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
 						"Creating new MySQL thread ", i, " for table ", table);
-					thread = boost::make_shared<MySqlThread>();
+					thread = boost::make_shared<MySqlThread>(false);
 					thread->start();
 					test_thread = thread;
 					route.thread = thread;
@@ -749,6 +1138,68 @@ namespace {
 		operation->set_probe(STD_MOVE(probe));
 		thread->add_operation(STD_MOVE(operation), urgent);
 	}
+	// 读操作不按表固定线程，选择队列最短的读线程，长度相同时轮流使用。
+	// 表上还有尚未执行的操作时交给这个表的线程，保证读到之前写入的数据。
+	void submit_read_operation(const char *table, boost::shared_ptr<OperationBase> operation, bool urgent){
+		PROFILE_ME;
+
+		boost::shared_ptr<MySqlThread> thread;
+		{
+			const Mutex::UniqueLock lock(g_router_mutex);
+			if(g_read_threads.empty()){
+				goto _use_table_thread;
+			}
+			const AUTO(route_it, g_router.find(SharedNts::view(table)));
+			if((route_it != g_router.end()) && (route_it->second.probe.use_count() > 1)){
+				goto _use_table_thread;
+			}
+			const std::size_t count = g_read_threads.size();
+			const std::size_t start = g_read_cursor++ % count;
+			std::size_t min_queue_size = static_cast<std::size_t>(-1);
+			for(std::size_t i = 0; i < count; ++i){
+				const std::size_t index = (start + i) % count;
+				AUTO_REF(test_thread, g_read_threads.at(index));
+				if(!test_thread){
+					LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+						"Creating new MySQL read thread ", index, " for table ", table);
+					test_thread = boost::make_shared<MySqlThread>(true);
+					test_thread->start();
+					thread = test_thread;
+					break;
+				}
+				const AUTO(queue_size, test_thread->get_queue_size());
+				if(queue_size < min_queue_size){
+					min_queue_size = queue_size;
+					thread = test_thread;
+				}
+			}
+		}
+		assert(thread);
+		thread->add_operation(STD_MOVE(operation), urgent);
+		return;
+
+	_use_table_thread:
+		submit_operation_by_table(table, STD_MOVE(operation), urgent);
+	}
+
+	void submit_stream_operation(const char *table, boost::shared_ptr<OperationBase> operation){
+		PROFILE_ME;
+
+		boost::shared_ptr<MySqlThread> thread;
+		{
+			const Mutex::UniqueLock lock(g_router_mutex);
+			if(!g_stream_thread){
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+					"Creating new MySQL stream thread for table ", table);
+				g_stream_thread = boost::make_shared<MySqlThread>(true);
+				g_stream_thread->start();
+			}
+			thread = g_stream_thread;
+		}
+		// 流式读取会持续很长时间，不能让整个队列进入紧急状态。
+		thread->add_operation(STD_MOVE(operation), false);
+	}
+
 	void submit_operation_all(boost::shared_ptr<OperationBase> operation, bool urgent){
 		PROFILE_ME;
 
@@ -760,6 +1211,16 @@ namespace {
 			}
 			thread->add_operation(operation, urgent);
 		}
+		for(AUTO(it, g_read_threads.begin()); it != g_read_threads.end(); ++it){
+			const AUTO_REF(thread, *it);
+			if(!thread){
+				continue;
+			}
+			thread->add_operation(operation, urgent);
+		}
+		if(g_stream_thread){
+			g_stream_thread->add_operation(operation, urgent);
+		}
 	}
 }
 
@@ -776,8 +1237,10 @@ void MySqlDaemon::start(){
 	MainConfig::get(g_server_port, "mysql_server_port");
 	LOG_POSEIDON_DEBUG("mysql_server_port = ", g_server_port);
 
-	MainConfig::get(g_slave_addr, "mysql_slave_addr");
-	LOG_POSEIDON_DEBUG("mysql_slave_addr = ", g_slave_addr);
+	MainConfig::get_all(g_slave_addrs, "mysql_slave_addr");
+	for(AUTO(it, g_slave_addrs.begin()); it != g_slave_addrs.end(); ++it){
+		LOG_POSEIDON_DEBUG("mysql_slave_addr = ", *it);
+	}
 
 	MainConfig::get(g_slave_port, "mysql_slave_port");
 	LOG_POSEIDON_DEBUG("mysql_slave_port = ", g_slave_port);
@@ -797,6 +1260,9 @@ void MySqlDaemon::start(){
 	MainConfig::get(g_charset, "mysql_charset");
 	LOG_POSEIDON_DEBUG("mysql_charset = ", g_charset);
 
+	MainConfig::get(g_use_prepared_stmt, "mysql_use_prepared_stmt");
+	LOG_POSEIDON_DEBUG("mysql_use_prepared_stmt = ", g_use_prepared_stmt);
+
 	MainConfig::get(g_dump_dir, "mysql_dump_dir");
 	LOG_POSEIDON_DEBUG("mysql_dump_dir = ", g_dump_dir);
 
@@ -815,6 +1281,18 @@ void MySqlDaemon::start(){
 	MainConfig::get(g_max_thread_count, "mysql_max_thread_count");
 	LOG_POSEIDON_DEBUG("mysql_max_thread_count = ", g_max_thread_count);
 
+	MainConfig::get(g_save_batch_size, "mysql_save_batch_size");
+	LOG_POSEIDON_DEBUG("mysql_save_batch_size = ", g_save_batch_size);
+
+	MainConfig::get(g_max_stream_pages, "mysql_max_stream_pages");
+	LOG_POSEIDON_DEBUG("mysql_max_stream_pages = ", g_max_stream_pages);
+
+	MainConfig::get(g_stream_write_timeout, "mysql_stream_write_timeout");
+	LOG_POSEIDON_DEBUG("mysql_stream_write_timeout = ", g_stream_write_timeout);
+
+	MainConfig::get(g_max_read_thread_count, "mysql_max_read_thread_count");
+	LOG_POSEIDON_DEBUG("mysql_max_read_thread_count = ", g_max_read_thread_count);
+
 	if(!g_dump_dir.empty()){
 		const AUTO(placeholder_path, g_dump_dir + "/placeholder");
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO,
@@ -828,6 +1306,7 @@ void MySqlDaemon::start(){
 	}
 
 	g_threads.resize(std::max<std::size_t>(g_max_thread_count, 1));
+	g_read_threads.resize(g_max_read_thread_count);
 
 	LOG_POSEIDON_INFO("MySQL daemon started.");
 }
@@ -845,6 +1324,18 @@ void MySqlDaemon::stop(){
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping MySQL thread ", i);
 		thread->stop();
 	}
+	for(std::size_t i = 0; i < g_read_threads.size(); ++i){
+		const AUTO_REF(thread, g_read_threads.at(i));
+		if(!thread){
+			continue;
+		}
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping MySQL read thread ", i);
+		thread->stop();
+	}
+	if(g_stream_thread){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping MySQL stream thread");
+		g_stream_thread->stop();
+	}
 	for(std::size_t i = 0; i < g_threads.size(); ++i){
 		const AUTO_REF(thread, g_threads.at(i));
 		if(!thread){
@@ -853,7 +1344,21 @@ void MySqlDaemon::stop(){
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Waiting for MySQL thread ", i, " to terminate...");
 		thread->safe_join();
 	}
+	for(std::size_t i = 0; i < g_read_threads.size(); ++i){
+		const AUTO_REF(thread, g_read_threads.at(i));
+		if(!thread){
+			continue;
+		}
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Waiting for MySQL read thread ", i, " to terminate...");
+		thread->safe_join();
+	}
+	if(g_stream_thread){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Waiting for MySQL stream thread to terminate...");
+		g_stream_thread->safe_join();
+	}
 	g_threads.clear();
+	g_read_threads.clear();
+	g_stream_thread.reset();
 
 	LOG_POSEIDON_INFO("MySQL daemon stopped.");
 }
@@ -870,6 +1375,16 @@ void MySqlDaemon::wait_for_all_async_operations(){
 		}
 		thread->wait_till_idle();
 	}
+	for(std::size_t i = 0; i < g_read_threads.size(); ++i){
+		const AUTO_REF(thread, g_read_threads.at(i));
+		if(!thread){
+			continue;
+		}
+		thread->wait_till_idle();
+	}
+	if(g_stream_thread){
+		g_stream_thread->wait_till_idle();
+	}
 }
 
 boost::shared_ptr<const JobPromise> MySqlDaemon::enqueue_for_saving(
@@ -889,7 +1404,7 @@ boost::shared_ptr<const JobPromise> MySqlDaemon::enqueue_for_loading(
 	AUTO(promise, boost::make_shared<JobPromise>());
 	const char *const table = object->get_table();
 	AUTO(operation, boost::make_shared<LoadOperation>(promise, STD_MOVE(object), STD_MOVE(query)));
-	submit_operation_by_table(table, STD_MOVE_IDN(operation), true);
+	submit_read_operation(table, STD_MOVE_IDN(operation), true);
 	return STD_MOVE_IDN(promise);
 }
 boost::shared_ptr<const JobPromise> MySqlDaemon::enqueue_for_deleting(
@@ -911,7 +1426,21 @@ boost::shared_ptr<const JobPromise> MySqlDaemon::enqueue_for_batch_loading(
 	AUTO(promise, boost::make_shared<JobPromise>());
 	const char *const table = table_hint;
 	AUTO(operation, boost::make_shared<BatchLoadOperation>(promise, STD_MOVE(callback), table_hint, STD_MOVE(query)));
-	submit_operation_by_table(table, STD_MOVE_IDN(operation), true);
+	submit_read_operation(table, STD_MOVE_IDN(operation), true);
+	return STD_MOVE_IDN(promise);
+}
+boost::shared_ptr<const JobPromise> MySqlDaemon::enqueue_for_streaming_loading(
+	ObjectFactory factory, PageCallback callback, const char *table_hint, std::string query, std::size_t page_size)
+{
+	DEBUG_THROW_ASSERT(factory);
+	DEBUG_THROW_ASSERT(callback);
+	DEBUG_THROW_ASSERT(!query.empty());
+
+	AUTO(promise, boost::make_shared<JobPromise>());
+	const char *const table = table_hint;
+	AUTO(operation, boost::make_shared<StreamingLoadOperation>(promise,
+		STD_MOVE_IDN(factory), STD_MOVE_IDN(callback), table_hint, STD_MOVE(query), page_size));
+	submit_stream_operation(table, STD_MOVE_IDN(operation));
 	return STD_MOVE_IDN(promise);
 }
 
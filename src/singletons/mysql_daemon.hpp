@@ -8,6 +8,8 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
 #include <string>
+#include <vector>
+#include <cstddef>
 
 namespace Poseidon {
 
@@ -24,6 +26,8 @@ private:
 
 public:
 	typedef boost::function<void (const boost::shared_ptr<MySql::Connection> &)> QueryCallback;
+	typedef boost::function<boost::shared_ptr<MySql::ObjectBase> ()> ObjectFactory;
+	typedef boost::function<void (const std::vector<boost::shared_ptr<MySql::ObjectBase> > &)> PageCallback;
 
 	static void start();
 	static void stop();
@@ -42,6 +46,12 @@ public:
 		const char *table_hint, std::string query);
 	static boost::shared_ptr<const JobPromise> enqueue_for_batch_loading(
 		QueryCallback callback, const char *table_hint, std::string query);
+	// 结果集中的每一行由 factory 创建一个对象，每 page_size 个对象作为一页，按顺序在任务线程中传给 callback。
+	// 数据库线程每次只读取一页，等待处理的页数过多时暂停读取。所有页都处理完之后 promise 才被满足。
+	// 页面由任务线程处理，在 JobDispatcher::do_modal() 之前（例如初始化模块时）不能等待这个 promise。
+	// wait_for_all_async_operations() 不等待暂停中的流式读取。
+	static boost::shared_ptr<const JobPromise> enqueue_for_streaming_loading(
+		ObjectFactory factory, PageCallback callback, const char *table_hint, std::string query, std::size_t page_size);
 
 	static void enqueue_for_low_level_access(boost::shared_ptr<JobPromise> promise, QueryCallback callback,
 		const char *table_hint, bool from_slave = false);
@@ -4,15 +4,53 @@
 #include "../precompiled.hpp"
 #include "profile_depository.hpp"
 #include <boost/container/flat_map.hpp>
+#include <boost/array.hpp>
 #include <cstring>
+#include <cmath>
+#include <new>
+#include <pthread.h>
 #include "main_config.hpp"
 #include "../mutex.hpp"
 #include "../log.hpp"
 #include "../profiler.hpp"
+#include "../atomic.hpp"
 
 namespace Poseidon {
 
 namespace {
+	// 直方图以纳秒为单位。小于 1024 纳秒的都放在第一个桶中，之后每个 2 的幂分为四个桶。
+	CONSTEXPR const unsigned HISTOGRAM_MIN_EXPONENT = 10;
+	CONSTEXPR const unsigned HISTOGRAM_SUB_BITS = 2;
+	CONSTEXPR const std::size_t HISTOGRAM_BUCKETS = 128;
+
+	std::size_t get_histogram_index(boost::uint64_t ns) NOEXCEPT {
+		if(ns < (1ull << HISTOGRAM_MIN_EXPONENT)){
+			return 0;
+		}
+		const unsigned exponent = 63u - static_cast<unsigned>(__builtin_clzll(ns));
+		const std::size_t sub = static_cast<std::size_t>(ns >> (exponent - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+		const std::size_t index = 1 + ((exponent - HISTOGRAM_MIN_EXPONENT) << HISTOGRAM_SUB_BITS) + sub;
+		return std::min(index, HISTOGRAM_BUCKETS - 1);
+	}
+	boost::uint64_t get_histogram_upper_bound(std::size_t index) NOEXCEPT {
+		if(index == 0){
+			return 1ull << HISTOGRAM_MIN_EXPONENT;
+		}
+		if(index == HISTOGRAM_BUCKETS - 1){
+			return (boost::uint64_t)-1;
+		}
+		const unsigned exponent = HISTOGRAM_MIN_EXPONENT + static_cast<unsigned>((index - 1) >> HISTOGRAM_SUB_BITS);
+		const std::size_t sub = (index - 1) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+		return static_cast<boost::uint64_t>((1u << HISTOGRAM_SUB_BITS) + sub + 1) << (exponent - HISTOGRAM_SUB_BITS);
+	}
+
+	boost::uint64_t to_nanoseconds(double ms) NOEXCEPT {
+		return static_cast<boost::uint64_t>(ms * 1.0e6);
+	}
+	double to_milliseconds(boost::uint64_t ns) NOEXCEPT {
+		return static_cast<double>(ns) / 1.0e6;
+	}
+
 	struct ProfileKey {
 		const char *file;
 		unsigned long line;
@@ -26,10 +64,14 @@ namespace {
 		unsigned long long samples;
 		double total;
 		double exclusive;
+		boost::uint64_t max;
+		boost::array<boost::uint64_t, HISTOGRAM_BUCKETS> histogram;
 
 		ProfileCounters()
-			: samples(0), total(0), exclusive(0)
-		{ }
+			: samples(0), total(0), exclusive(0), max(0)
+		{
+			histogram.assign(0);
+		}
 	};
 	struct ProfileKeyComparator {
 		bool operator()(const ProfileKey &lhs, const ProfileKey &rhs) const NOEXCEPT {
@@ -43,10 +85,186 @@ namespace {
 	typedef boost::container::flat_map<ProfileKey,
 		ProfileCounters, ProfileKeyComparator> ProfileMap;
 
+	typedef boost::container::flat_map<const ProfileCallSite *, ProfileCounters> SiteMap;
+
+	void merge_counters(ProfileCounters &counters, const ProfileCounters &other) NOEXCEPT {
+		counters.samples += other.samples;
+		counters.total += other.total;
+		counters.exclusive += other.exclusive;
+		counters.max = std::max(counters.max, other.max);
+		for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i){
+			counters.histogram[i] += other.histogram[i];
+		}
+	}
+	void subtract_counters(ProfileCounters &counters, const ProfileCounters &other) NOEXCEPT {
+		counters.samples -= std::min(counters.samples, other.samples);
+		counters.total -= std::min(counters.total, other.total);
+		counters.exclusive -= std::min(counters.exclusive, other.exclusive);
+		// 最大值无法扣除，只能由直方图限定。
+		for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i){
+			counters.histogram[i] -= std::min(counters.histogram[i], other.histogram[i]);
+		}
+	}
+	// 返回第 q 分位数所在的桶的上界，不超过最大值。
+	double get_percentile(const ProfileCounters &counters, double q) NOEXCEPT {
+		boost::uint64_t count = 0;
+		for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i){
+			count += counters.histogram[i];
+		}
+		if(count == 0){
+			return 0;
+		}
+		const AUTO(rank, std::max<boost::uint64_t>(static_cast<boost::uint64_t>(std::ceil(static_cast<double>(count) * q)), 1));
+		boost::uint64_t seen = 0;
+		std::size_t index = 0;
+		for(;;){
+			seen += counters.histogram[index];
+			if((seen >= rank) || (index == HISTOGRAM_BUCKETS - 1)){
+				break;
+			}
+			++index;
+		}
+		return to_milliseconds(std::min(get_histogram_upper_bound(index), counters.max));
+	}
+
+	CONSTEXPR const std::size_t THREAD_TABLE_SIZE = 1024; // 必须是 2 的幂。
+	CONSTEXPR const std::size_t MAX_PROBES = 16;
+
+	// 线程统计表只由所属线程写入，其他线程只在 snapshot() 时读取，因此每个字段都是原子的。
+	// 时间以纳秒为单位保存为整数。
+	struct ThreadHistogram {
+		volatile boost::uint64_t counts[HISTOGRAM_BUCKETS];
+	};
+	struct ThreadEntry {
+		const ProfileCallSite *volatile site;
+		volatile boost::uint64_t samples;
+		volatile boost::uint64_t total;
+		volatile boost::uint64_t exclusive;
+		volatile boost::uint64_t max;
+		// 第一次采样时分配。
+		ThreadHistogram *volatile histogram;
+	};
+	struct ThreadTable {
+		ThreadTable *prev;
+		ThreadTable *next;
+		ThreadEntry entries[THREAD_TABLE_SIZE];
+	};
+
 	bool g_enabled = true;
+	volatile unsigned g_sample_rate = 1;
 
 	Mutex g_mutex;
-	ProfileMap g_profile;
+	// 所有存活线程的统计表。
+	ThreadTable *g_tables = NULLPTR;
+	// 已退出线程的数据，以及线程统计表放不下的数据。
+	SiteMap g_merged;
+	// clear() 时的数据，snapshot() 时从结果中减去。
+	SiteMap g_baseline;
+
+	__thread ThreadTable *t_table = 0; // XXX: NULLPTR
+
+	::pthread_once_t g_table_key_once = PTHREAD_ONCE_INIT;
+	::pthread_key_t g_table_key;
+
+	void add_counters(ProfileCounters &counters, const ThreadEntry &entry) NOEXCEPT {
+		counters.samples += atomic_load(entry.samples, ATOMIC_RELAXED);
+		counters.total += to_milliseconds(atomic_load(entry.total, ATOMIC_RELAXED));
+		counters.exclusive += to_milliseconds(atomic_load(entry.exclusive, ATOMIC_RELAXED));
+		counters.max = std::max(counters.max, atomic_load(entry.max, ATOMIC_RELAXED));
+		const AUTO(histogram, atomic_load(entry.histogram, ATOMIC_ACQUIRE));
+		if(histogram){
+			for(std::size_t i = 0; i < HISTOGRAM_BUCKETS; ++i){
+				counters.histogram[i] += atomic_load(histogram->counts[i], ATOMIC_RELAXED);
+			}
+		}
+	}
+	// 调用者必须持有 g_mutex。
+	void collect_unlocked(SiteMap &sites, const ThreadTable *table){
+		for(std::size_t i = 0; i < THREAD_TABLE_SIZE; ++i){
+			const AUTO_REF(entry, table->entries[i]);
+			const AUTO(site, atomic_load(entry.site, ATOMIC_ACQUIRE));
+			if(!site){
+				continue;
+			}
+			add_counters(sites[site], entry);
+		}
+	}
+	void collect_all_unlocked(SiteMap &sites){
+		sites = g_merged;
+		for(AUTO(table, g_tables); table; table = table->next){
+			collect_unlocked(sites, table);
+		}
+	}
+
+	void thread_table_destructor(void *p) NOEXCEPT {
+		const AUTO(table, static_cast<ThreadTable *>(p));
+		try {
+			const Mutex::UniqueLock lock(g_mutex);
+			if(table->prev){
+				table->prev->next = table->next;
+			} else {
+				g_tables = table->next;
+			}
+			if(table->next){
+				table->next->prev = table->prev;
+			}
+			collect_unlocked(g_merged, table);
+		} catch(...){
+			//
+		}
+		t_table = NULLPTR;
+		for(std::size_t i = 0; i < THREAD_TABLE_SIZE; ++i){
+			delete table->entries[i].histogram;
+		}
+		delete table;
+	}
+	void create_table_key() NOEXCEPT {
+		const int err_code = ::pthread_key_create(&g_table_key, &thread_table_destructor);
+		if(err_code != 0){
+			std::abort();
+		}
+	}
+	ThreadTable *get_thread_table() NOEXCEPT {
+		AUTO(table, t_table);
+		if(table){
+			return table;
+		}
+		::pthread_once(&g_table_key_once, &create_table_key);
+		table = new(std::nothrow) ThreadTable();
+		if(!table){
+			return NULLPTR;
+		}
+		if(::pthread_setspecific(g_table_key, table) != 0){
+			delete table;
+			return NULLPTR;
+		}
+		{
+			const Mutex::UniqueLock lock(g_mutex);
+			table->prev = NULLPTR;
+			table->next = g_tables;
+			if(g_tables){
+				g_tables->prev = table;
+			}
+			g_tables = table;
+		}
+		t_table = table;
+		return table;
+	}
+	ThreadEntry *find_or_insert_entry(ThreadTable *table, const ProfileCallSite *site) NOEXCEPT {
+		std::size_t index = (reinterpret_cast<std::size_t>(site) >> 3) * 0x9E3779B9u;
+		for(std::size_t i = 0; i < MAX_PROBES; ++i){
+			AUTO_REF(entry, table->entries[(index + i) % THREAD_TABLE_SIZE]);
+			const AUTO(cur, entry.site);
+			if(cur == site){
+				return &entry;
+			}
+			if(!cur){
+				atomic_store(entry.site, site, ATOMIC_RELEASE);
+				return &entry;
+			}
+		}
+		return NULLPTR;
+	}
 }
 
 void ProfileDepository::start(){
@@ -54,6 +272,9 @@ void ProfileDepository::start(){
 
 	MainConfig::get(g_enabled, "profiler_enabled");
 	LOG_POSEIDON_DEBUG("profiler_enabled = ", g_enabled);
+
+	set_sample_rate(MainConfig::get<unsigned>("profiler_sample_rate", 1));
+	LOG_POSEIDON_DEBUG("profiler_sample_rate = ", get_sample_rate());
 }
 void ProfileDepository::stop(){
 	LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_INFO, "Stopping profile depository...");
@@ -62,44 +283,97 @@ void ProfileDepository::stop(){
 bool ProfileDepository::is_enabled(){
 	return g_enabled;
 }
+unsigned ProfileDepository::get_sample_rate() NOEXCEPT {
+	return atomic_load(g_sample_rate, ATOMIC_RELAXED);
+}
+void ProfileDepository::set_sample_rate(unsigned sample_rate) NOEXCEPT {
+	atomic_store(g_sample_rate, std::max(sample_rate, 1u), ATOMIC_RELAXED);
+}
 
-void ProfileDepository::accumulate(const char *file, unsigned long line, const char *func,
-	double total, double exclusive, bool new_sample) NOEXCEPT
-try {
-	const Mutex::UniqueLock lock(g_mutex);
-	AUTO_REF(counters, g_profile[ProfileKey(file, line, func)]);
-	if(new_sample){
-		++counters.samples;
-	}
-	counters.total += total;
-	counters.exclusive += exclusive;
-} catch(...){
-	//
+void ProfileDepository::accumulate(const ProfileCallSite *site, double total, double exclusive, bool new_sample, double latency, unsigned weight) NOEXCEPT {
+	const AUTO(latency_ns, to_nanoseconds(latency));
+	total *= weight;
+	exclusive *= weight;
+
+	const AUTO(table, get_thread_table());
+	const AUTO(entry, table ? find_or_insert_entry(table, site) : NULLPTR);
+	if(entry){
+		// 只有当前线程写入，不需要原子的读-改-写操作。
+		if(new_sample){
+			atomic_store(entry->samples, entry->samples + weight, ATOMIC_RELAXED);
+			if(entry->max < latency_ns){
+				atomic_store(entry->max, latency_ns, ATOMIC_RELAXED);
+			}
+			AUTO(histogram, entry->histogram);
+			if(!histogram){
+				histogram = new(std::nothrow) ThreadHistogram();
+				atomic_store(entry->histogram, histogram, ATOMIC_RELEASE);
+			}
+			if(histogram){
+				AUTO_REF(count, histogram->counts[get_histogram_index(latency_ns)]);
+				atomic_store(count, count + weight, ATOMIC_RELAXED);
+			}
+		}
+		atomic_store(entry->total, entry->total + to_nanoseconds(total), ATOMIC_RELAXED);
+		atomic_store(entry->exclusive, entry->exclusive + to_nanoseconds(exclusive), ATOMIC_RELAXED);
+		return;
+	}
+
+	try {
+		const Mutex::UniqueLock lock(g_mutex);
+		AUTO_REF(counters, g_merged[site]);
+		if(new_sample){
+			counters.samples += weight;
+			counters.max = std::max(counters.max, latency_ns);
+			counters.histogram[get_histogram_index(latency_ns)] += weight;
+		}
+		counters.total += total;
+		counters.exclusive += exclusive;
+	} catch(...){
+		//
+	}
 }
 
 std::vector<ProfileDepository::SnapshotElement> ProfileDepository::snapshot(){
 	Profiler::accumulate_all_in_thread();
 
-	std::vector<SnapshotElement> ret;
+	SiteMap sites;
 	{
 		const Mutex::UniqueLock lock(g_mutex);
-		ret.reserve(g_profile.size());
-		for(AUTO(it, g_profile.begin()); it != g_profile.end(); ++it){
-			SnapshotElement elem;
-			elem.file = it->first.file;
-			elem.line = it->first.line;
-			elem.func = it->first.func;
-			elem.samples = it->second.samples;
-			elem.total = it->second.total;
-			elem.exclusive = it->second.exclusive;
-			ret.push_back(elem);
+		collect_all_unlocked(sites);
+		for(AUTO(it, g_baseline.begin()); it != g_baseline.end(); ++it){
+			subtract_counters(sites[it->first], it->second);
 		}
 	}
+	// 同一位置的不同模板实例合并在一起。
+	ProfileMap profile;
+	for(AUTO(it, sites.begin()); it != sites.end(); ++it){
+		merge_counters(profile[ProfileKey(it->first->file, it->first->line, it->first->func)], it->second);
+	}
+
+	std::vector<SnapshotElement> ret;
+	ret.reserve(profile.size());
+	for(AUTO(it, profile.begin()); it != profile.end(); ++it){
+		SnapshotElement elem;
+		elem.file = it->first.file;
+		elem.line = it->first.line;
+		elem.func = it->first.func;
+		elem.samples = it->second.samples;
+		elem.total = it->second.total;
+		elem.exclusive = it->second.exclusive;
+		elem.p50 = get_percentile(it->second, 0.5);
+		elem.p90 = get_percentile(it->second, 0.9);
+		elem.p99 = get_percentile(it->second, 0.99);
+		elem.p999 = get_percentile(it->second, 0.999);
+		elem.max = get_percentile(it->second, 1.0);
+		ret.push_back(elem);
+	}
 	return ret;
 }
 void ProfileDepository::clear(){
+	// 其他线程的统计表不能被修改，因此只记录当前的数据，在以后的 snapshot() 中减去。
 	const Mutex::UniqueLock lock(g_mutex);
-	g_profile.clear();
+	collect_all_unlocked(g_baseline);
 }
 
 }
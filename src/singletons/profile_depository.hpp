@@ -9,6 +9,8 @@
 
 namespace Poseidon {
 
+struct ProfileCallSite;
+
 class ProfileDepository {
 private:
 	ProfileDepository();
@@ -19,20 +21,33 @@ public:
 		unsigned long line;
 		const char *func;
 
-		// 采样数。
+		// 调用次数。以下各项都是采样值乘以采样率之后的估计值。
 		unsigned long long samples;
 		// 控制流进入函数，直到退出函数（正常返回或异常被抛出），经历的总毫秒数。
 		double total;
 		// ms_total 扣除执行点位于其他 profiler 之中的毫秒数。
 		double exclusive;
+
+		// 单次调用耗时（毫秒）的分位数，由对数直方图估计，相对误差不超过 25%。
+		double p50;
+		double p90;
+		double p99;
+		double p999;
+		double max;
 	};
 
 	static void start();
 	static void stop();
 
 	static bool is_enabled();
-	static void accumulate(const char *file, unsigned long line, const char *func,
-		double total, double exclusive, bool new_sample) NOEXCEPT;
+	// 平均每 get_sample_rate() 次调用计时一次。
+	static unsigned get_sample_rate() NOEXCEPT;
+	static void set_sample_rate(unsigned sample_rate) NOEXCEPT;
+
+	// 只写入当前线程的统计表，不加锁。各线程的数据在 snapshot() 时合并。
+	// 如果 new_sample 为 true，latency 是这次调用的总毫秒数，计入直方图。
+	// 这个样本代表 weight 次调用，即采样时的采样率，各项计数都乘以它。
+	static void accumulate(const ProfileCallSite *site, double total, double exclusive, bool new_sample, double latency, unsigned weight) NOEXCEPT;
 
 	static std::vector<SnapshotElement> snapshot();
 	static void clear();
@@ -7,6 +7,7 @@
 #include "epoll_daemon.hpp"
 #include "module_depository.hpp"
 #include "profile_depository.hpp"
+#include "job_dispatcher.hpp"
 #include <signal.h>
 #include "../log.hpp"
 #include "../exception.hpp"
@@ -95,6 +96,11 @@ namespace {
 						row[sslit("samples")] = boost::lexical_cast<std::string>(it->samples);
 						row[sslit("total")] = boost::lexical_cast<std::string>(it->total);
 						row[sslit("exclusive")] = boost::lexical_cast<std::string>(it->exclusive);
+						row[sslit("p50")] = boost::lexical_cast<std::string>(it->p50);
+						row[sslit("p90")] = boost::lexical_cast<std::string>(it->p90);
+						row[sslit("p99")] = boost::lexical_cast<std::string>(it->p99);
+						row[sslit("p999")] = boost::lexical_cast<std::string>(it->p999);
+						row[sslit("max")] = boost::lexical_cast<std::string>(it->max);
 						if(csv.empty()){
 							csv.reset_header(row);
 						}
@@ -104,7 +110,13 @@ namespace {
 					OptionalMap header;
 					header.set(sslit("Content-Type"), "text/csv");
 					header.set(sslit("Content-Disposition"), "attachment; name=\"profile.csv\"");
+					header.set(sslit("X-Profiler-Sample-Rate"), boost::lexical_cast<std::string>(ProfileDepository::get_sample_rate()));
 					send(Http::ST_OK, STD_MOVE(header), StreamBuffer(csv.dump()));
+				} else if(uri == "set_profiler_sample_rate"){
+					const Http::UrlParam sample_rate(STD_MOVE(request_header.get_params), "sample_rate");
+					LOG_POSEIDON_WARNING("Setting profiler sample rate: ", sample_rate.str());
+					ProfileDepository::set_sample_rate(static_cast<unsigned>(sample_rate.as_unsigned()));
+					send_default(Http::ST_OK);
 				} else if(uri == "clear_profile"){
 					LOG_POSEIDON_WARNING("Cleaning up profile data...");
 					ProfileDepository::clear();
@@ -148,6 +160,22 @@ namespace {
 					header.set(sslit("Content-Type"), "text/csv");
 					header.set(sslit("Content-Disposition"), "attachment; name=\"modules.csv\"");
 					send(Http::ST_OK, STD_MOVE(header), StreamBuffer(csv.dump()));
+				} else if(uri == "show_fiber_stacks"){
+					CsvDocument csv;
+					boost::container::map<SharedNts, std::string> row;
+					JobDispatcher::FiberStackStats stats;
+					JobDispatcher::get_fiber_stack_stats(stats);
+					row[sslit("stack_size")] = boost::lexical_cast<std::string>(stats.stack_size);
+					row[sslit("total_count")] = boost::lexical_cast<std::string>(stats.total_count);
+					row[sslit("pooled_count")] = boost::lexical_cast<std::string>(stats.pooled_count);
+					row[sslit("high_water_mark")] = boost::lexical_cast<std::string>(stats.high_water_mark);
+					csv.reset_header(row);
+					csv.append(row);
+
+					OptionalMap header;
+					header.set(sslit("Content-Type"), "text/csv");
+					header.set(sslit("Content-Disposition"), "attachment; name=\"fiber_stacks.csv\"");
+					send(Http::ST_OK, STD_MOVE(header), StreamBuffer(csv.dump()));
 				} else if(uri == "set_log_mask"){
 					const Http::UrlParam to_disable(STD_MOVE(request_header.get_params), "to_disable");
 					const Http::UrlParam to_enable(STD_MOVE(request_header.get_params), "to_enable");
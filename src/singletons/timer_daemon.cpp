@@ -23,15 +23,21 @@ struct TimerItem : NONCOPYABLE {
 	bool low_level;
 	unsigned long stamp;
 
+	// 低级计时器放在时间轮中，以下成员由 g_mutex 保护。
+	boost::weak_ptr<TimerItem> weak_self;
+	boost::uint64_t wheel_time;
+	TimerItem **wheel_bucket; // 为空表示不在时间轮中。
+	TimerItem *wheel_prev;
+	TimerItem *wheel_next;
+
 	TimerItem(boost::uint64_t period_, boost::shared_ptr<const TimerCallback> callback_, bool low_level_)
 		: period(period_), callback(STD_MOVE(callback_)), low_level(low_level_)
 		, stamp(0)
+		, weak_self(), wheel_time(0), wheel_bucket(NULLPTR), wheel_prev(NULLPTR), wheel_next(NULLPTR)
 	{
 		LOG_POSEIDON_DEBUG("Created timer: period = ", period, ", low_level = ", low_level);
 	}
-	~TimerItem(){
-		LOG_POSEIDON_DEBUG("Destroyed timer: period = ", period, ", low_level = ", low_level);
-	}
+	~TimerItem();
 };
 
 namespace {
@@ -86,12 +92,207 @@ namespace {
 		swap(lhs.stamp, rhs.stamp);
 	}
 
+	// 分层时间轮。第一层有 256 个槽，每槽一个刻度；之后每层 64 个槽，每槽是上一层的一圈。
+	// 插入和删除都是 O(1) 的，每个刻度只处理一个槽，第一层转完一圈时把上一层的一个槽重新分配到下层。
+	CONSTEXPR const boost::uint64_t WHEEL_TICK_MS = 10;
+	CONSTEXPR const unsigned WHEEL_ROOT_BITS = 8;
+	CONSTEXPR const unsigned WHEEL_LEVEL_BITS = 6;
+	CONSTEXPR const unsigned WHEEL_LEVEL_COUNT = 4;
+	CONSTEXPR const std::size_t WHEEL_ROOT_SIZE = 1u << WHEEL_ROOT_BITS;
+	CONSTEXPR const std::size_t WHEEL_LEVEL_SIZE = 1u << WHEEL_LEVEL_BITS;
+	CONSTEXPR const unsigned WHEEL_TOTAL_BITS = WHEEL_ROOT_BITS + WHEEL_LEVEL_BITS * (WHEEL_LEVEL_COUNT - 1);
+
+	class TimingWheel : NONCOPYABLE {
+	private:
+		static boost::uint64_t get_tick_ceil(boost::uint64_t time) NOEXCEPT {
+			// 向上取整，保证计时器不会提前触发。
+			return time / WHEEL_TICK_MS + (time % WHEEL_TICK_MS != 0);
+		}
+		static unsigned get_shift(unsigned level) NOEXCEPT {
+			return WHEEL_ROOT_BITS + WHEEL_LEVEL_BITS * (level - 1);
+		}
+
+	private:
+		boost::uint64_t m_tick; // 下一个要处理的刻度。
+		std::size_t m_count;
+		TimerItem *m_buckets[WHEEL_ROOT_SIZE + WHEEL_LEVEL_SIZE * (WHEEL_LEVEL_COUNT - 1)];
+
+	public:
+		TimingWheel()
+			: m_tick(0), m_count(0)
+		{
+			std::fill(m_buckets, m_buckets + COUNT_OF(m_buckets), static_cast<TimerItem *>(NULLPTR));
+		}
+
+	private:
+		TimerItem **find_bucket(boost::uint64_t tick) NOEXCEPT {
+			if(tick < m_tick){
+				tick = m_tick;
+			}
+			AUTO(delta, tick - m_tick);
+			if(delta < WHEEL_ROOT_SIZE){
+				return m_buckets + (tick & (WHEEL_ROOT_SIZE - 1));
+			}
+			if(delta >> WHEEL_TOTAL_BITS != 0){
+				// 超出时间轮的范围，先放在最外层，重新分配时再计算。
+				tick = m_tick + (static_cast<boost::uint64_t>(1) << WHEEL_TOTAL_BITS) - 1;
+				delta = tick - m_tick;
+			}
+			unsigned level = 1;
+			while(delta >> get_shift(level + 1) != 0){
+				++level;
+			}
+			return m_buckets + WHEEL_ROOT_SIZE + WHEEL_LEVEL_SIZE * (level - 1) + ((tick >> get_shift(level)) & (WHEEL_LEVEL_SIZE - 1));
+		}
+		void link(TimerItem **bucket, TimerItem *item) NOEXCEPT {
+			item->wheel_bucket = bucket;
+			item->wheel_prev = NULLPTR;
+			item->wheel_next = *bucket;
+			if(*bucket){
+				(*bucket)->wheel_prev = item;
+			}
+			*bucket = item;
+			++m_count;
+		}
+		// 把上一层的一个槽重新分配到下层。返回该槽的下标，为零表示还需要继续处理更上一层。
+		std::size_t cascade(unsigned level) NOEXCEPT {
+			const AUTO(index, static_cast<std::size_t>((m_tick >> get_shift(level)) & (WHEEL_LEVEL_SIZE - 1)));
+			AUTO_REF(bucket, m_buckets[WHEEL_ROOT_SIZE + WHEEL_LEVEL_SIZE * (level - 1) + index]);
+			AUTO(item, bucket);
+			bucket = NULLPTR;
+			while(item){
+				const AUTO(next, item->wheel_next);
+				--m_count;
+				link(find_bucket(get_tick_ceil(item->wheel_time)), item);
+				item = next;
+			}
+			return index;
+		}
+
+	public:
+		bool empty() const NOEXCEPT {
+			return m_count == 0;
+		}
+		// 距离下一个可能非空的槽的毫秒数。
+		boost::uint64_t get_idle_time(boost::uint64_t now) const NOEXCEPT {
+			const AUTO(now_tick, now / WHEEL_TICK_MS);
+			if(now_tick >= m_tick){
+				return 0;
+			}
+			boost::uint64_t tick = m_tick;
+			do {
+				if(m_buckets[tick & (WHEEL_ROOT_SIZE - 1)]){
+					break;
+				}
+				++tick;
+			} while((tick & (WHEEL_ROOT_SIZE - 1)) != 0);
+			return (tick - now_tick) * WHEEL_TICK_MS;
+		}
+
+		void insert(TimerItem *item, boost::uint64_t now) NOEXCEPT {
+			assert(!item->wheel_bucket);
+
+			if(m_count == 0){
+				m_tick = now / WHEEL_TICK_MS;
+			}
+			link(find_bucket(get_tick_ceil(item->wheel_time)), item);
+		}
+		void remove(TimerItem *item) NOEXCEPT {
+			if(!item->wheel_bucket){
+				return;
+			}
+			if(item->wheel_prev){
+				item->wheel_prev->wheel_next = item->wheel_next;
+			} else {
+				*(item->wheel_bucket) = item->wheel_next;
+			}
+			if(item->wheel_next){
+				item->wheel_next->wheel_prev = item->wheel_prev;
+			}
+			item->wheel_bucket = NULLPTR;
+			item->wheel_prev = NULLPTR;
+			item->wheel_next = NULLPTR;
+			--m_count;
+		}
+		void clear() NOEXCEPT {
+			for(std::size_t i = 0; i < COUNT_OF(m_buckets); ++i){
+				while(m_buckets[i]){
+					remove(m_buckets[i]);
+				}
+			}
+		}
+
+		// 处理到 now 为止的所有刻度，把到期的计时器追加到 expired 中。周期性的计时器会被重新插入。
+		void advance(boost::uint64_t now, std::vector<boost::shared_ptr<TimerItem> > &expired){
+			const AUTO(now_tick, now / WHEEL_TICK_MS);
+			while(m_tick <= now_tick){
+				if(m_count == 0){
+					m_tick = now_tick + 1;
+					break;
+				}
+				const AUTO(index, static_cast<std::size_t>(m_tick & (WHEEL_ROOT_SIZE - 1)));
+				if(index == 0){
+					unsigned level = 1;
+					while((cascade(level) == 0) && (level < WHEEL_LEVEL_COUNT - 1)){
+						++level;
+					}
+				}
+				AUTO(item, m_buckets[index]);
+				m_buckets[index] = NULLPTR;
+				while(item){
+					const AUTO(next, item->wheel_next);
+					item->wheel_bucket = NULLPTR;
+					item->wheel_prev = NULLPTR;
+					item->wheel_next = NULLPTR;
+					--m_count;
+					if(get_tick_ceil(item->wheel_time) > m_tick){
+						// 超出范围的计时器，重新分配。
+						link(find_bucket(get_tick_ceil(item->wheel_time)), item);
+					} else {
+						AUTO(strong, item->weak_self.lock());
+						// 如果为空，该计时器正在析构，不再放回时间轮即可。
+						if(strong){
+							if(item->period != 0){
+								item->wheel_time = saturated_add(item->wheel_time, item->period);
+								// 当前刻度的槽已经取出，落在这里的计时器要等时间轮转一圈才会被处理，因此至少放到下一个刻度。
+								link(find_bucket(std::max(get_tick_ceil(item->wheel_time), m_tick + 1)), item);
+							}
+							expired.push_back(STD_MOVE(strong));
+						}
+					}
+					item = next;
+				}
+				++m_tick;
+			}
+		}
+	};
+
 	volatile bool g_running = false;
 	Thread g_thread;
 
 	Mutex g_mutex;
 	ConditionVariable g_new_timer;
 	std::vector<TimerQueueElement> g_timers;
+	TimingWheel g_wheel;
+
+	// 仅在 timer 线程中使用。
+	std::vector<boost::shared_ptr<TimerItem> > g_wheel_expired;
+
+	void dispatch_timer(const boost::shared_ptr<TimerItem> &item, boost::uint64_t now) NOEXCEPT {
+		try {
+			if(item->low_level){
+				LOG_POSEIDON_TRACE("Dispatching low level timer: item = ", item);
+				(*item->callback)(item, now, item->period);
+			} else {
+				LOG_POSEIDON_TRACE("Preparing a timer job for dispatching: item = ", item);
+				JobDispatcher::enqueue(boost::make_shared<TimerJob>(item, now), VAL_INIT);
+			}
+		} catch(std::exception &e){
+			LOG_POSEIDON_WARNING("std::exception thrown while dispatching timer job, what = ", e.what());
+		} catch(...){
+			LOG_POSEIDON_WARNING("Unknown exception thrown while dispatching timer job.");
+		}
+	}
 
 	bool pump_one_element() NOEXCEPT {
 		PROFILE_ME;
@@ -121,19 +322,28 @@ namespace {
 				std::push_heap(g_timers.begin(), g_timers.end());
 			}
 		}
+		dispatch_timer(item, now);
+		return true;
+	}
+	bool pump_wheel() NOEXCEPT {
+		PROFILE_ME;
+
+		const AUTO(now, get_fast_mono_clock());
+
 		try {
-			if(item->low_level){
-				LOG_POSEIDON_TRACE("Dispatching low level timer: item = ", item);
-				(*item->callback)(item, now, item->period);
-			} else {
-				LOG_POSEIDON_TRACE("Preparing a timer job for dispatching: item = ", item);
-				JobDispatcher::enqueue(boost::make_shared<TimerJob>(item, now), VAL_INIT);
-			}
+			const Mutex::UniqueLock lock(g_mutex);
+			g_wheel.advance(now, g_wheel_expired);
 		} catch(std::exception &e){
-			LOG_POSEIDON_WARNING("std::exception thrown while dispatching timer job, what = ", e.what());
-		} catch(...){
-			LOG_POSEIDON_WARNING("Unknown exception thrown while dispatching timer job.");
+			LOG_POSEIDON_ERROR("std::exception thrown while advancing timing wheel, what = ", e.what());
 		}
+		if(g_wheel_expired.empty()){
+			return false;
+		}
+		for(AUTO(it, g_wheel_expired.begin()); it != g_wheel_expired.end(); ++it){
+			dispatch_timer(*it, now);
+		}
+		// 在锁外释放计时器。
+		g_wheel_expired.clear();
 		return true;
 	}
 
@@ -145,7 +355,8 @@ namespace {
 		for(;;){
 			bool busy;
 			do {
-				busy = pump_one_element();
+				busy = pump_wheel();
+				busy += pump_one_element();
 				timeout = std::min(timeout * 2u + 1u, !busy * 100u);
 			} while(busy);
 
@@ -153,6 +364,9 @@ namespace {
 			if(!atomic_load(g_running, ATOMIC_CONSUME)){
 				break;
 			}
+			if(!g_wheel.empty()){
+				timeout = static_cast<unsigned>(std::min<boost::uint64_t>(timeout, g_wheel.get_idle_time(get_fast_mono_clock())));
+			}
 			g_new_timer.timed_wait(lock, timeout);
 		}
 
@@ -178,7 +392,18 @@ void TimerDaemon::stop(){
 	if(g_thread.joinable()){
 		g_thread.join();
 	}
+	const Mutex::UniqueLock lock(g_mutex);
 	g_timers.clear();
+	g_wheel.clear();
+}
+
+TimerItem::~TimerItem(){
+	LOG_POSEIDON_DEBUG("Destroyed timer: period = ", period, ", low_level = ", low_level);
+
+	if(low_level){
+		const Mutex::UniqueLock lock(g_mutex);
+		g_wheel.remove(this);
+	}
 }
 
 boost::shared_ptr<TimerItem> TimerDaemon::register_absolute_timer(
@@ -233,10 +458,11 @@ boost::shared_ptr<TimerItem> TimerDaemon::register_low_level_absolute_timer(
 	PROFILE_ME;
 
 	AUTO(item, boost::make_shared<TimerItem>(period, boost::make_shared<TimerCallback>(STD_MOVE_IDN(callback)), true));
+	item->weak_self = item;
+	item->wheel_time = first;
 	{
 		const Mutex::UniqueLock lock(g_mutex);
-		g_timers.push_back(TimerQueueElement(first, item));
-		std::push_heap(g_timers.begin(), g_timers.end());
+		g_wheel.insert(item.get(), get_fast_mono_clock());
 		g_new_timer.signal();
 	}
 	LOG_POSEIDON_DEBUG("Created a low level timer which will be triggered ", saturated_sub(first, get_fast_mono_clock()),
@@ -259,6 +485,13 @@ void TimerDaemon::set_absolute_time(const boost::shared_ptr<TimerItem> &item,
 	if(period != PERIOD_NOT_MODIFIED){
 		item->period = period;
 	}
+	if(item->low_level){
+		g_wheel.remove(item.get());
+		item->wheel_time = first;
+		g_wheel.insert(item.get(), get_fast_mono_clock());
+		g_new_timer.signal();
+		return;
+	}
 	g_timers.push_back(TimerQueueElement(first, item)); // may throw std::bad_alloc.
 	g_timers.back().stamp = ++(item->stamp);
 	std::push_heap(g_timers.begin(), g_timers.end());
@@ -4,84 +4,293 @@
 #include "precompiled.hpp"
 #include "stream_buffer.hpp"
 #include "profiler.hpp"
+#include "system_exception.hpp"
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 namespace Poseidon {
 
 namespace {
-	::pthread_mutex_t g_pool_mutex = PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP;
-	void *g_pool_head = NULLPTR;
-}
-
-struct StreamBuffer::Chunk FINAL {
-	static void *operator new(std::size_t bytes){
-		assert(bytes == sizeof(Chunk));
-		void *p;
+	// 块的大小按照写入的数据量选择，避免大块数据被拆成大量小块。
+	CONSTEXPR const std::size_t CHUNK_CLASS_COUNT = 3;
+	CONSTEXPR const unsigned g_chunk_capacities[CHUNK_CLASS_COUNT] = { 0x100, 0x1000, 0x10000 };
+	// 每个线程对每种大小最多缓存这么多块，超出时一次性归还一半到全局池中。
+	CONSTEXPR const std::size_t g_thread_cache_limits[CHUNK_CLASS_COUNT] = { 256, 32, 4 };
+	// 引用外部内存的块不属于任何一种大小。
+	CONSTEXPR const unsigned CHUNK_CLASS_EXTERNAL = CHUNK_CLASS_COUNT;
+	// 一个外部块最多引用这么多字节，更大的数据被拆分成多个共享所有者的块。
+	CONSTEXPR const std::size_t MAX_EXTERNAL_CHUNK_SIZE = 0x40000000;
+	// 小于这个大小的外部数据直接复制。
+	CONSTEXPR const std::size_t MIN_EXTERNAL_CHUNK_SIZE = 0x100;
+
+	typedef boost::shared_ptr<const void> ExternalOwner;
+
+	class FileMapping : NONCOPYABLE {
+	private:
+		void *m_addr;
+		std::size_t m_size;
+
+	public:
+		FileMapping(int fd, boost::uint64_t offset, std::size_t size)
+			: m_addr(NULLPTR), m_size(0)
+		{
+			const AUTO(page_size, static_cast<boost::uint64_t>(::sysconf(_SC_PAGESIZE)));
+			const AUTO(aligned_offset, offset / page_size * page_size);
+			m_size = static_cast<std::size_t>(offset - aligned_offset) + size;
+			m_addr = ::mmap(NULLPTR, m_size, PROT_READ, MAP_PRIVATE, fd, static_cast< ::off_t>(aligned_offset));
+			if(m_addr == MAP_FAILED){
+				const int err_code = errno;
+				DEBUG_THROW(SystemException, err_code);
+			}
+		}
+		~FileMapping(){
+			::munmap(m_addr, m_size);
+		}
 
-		int err_code = ::pthread_mutex_lock(&g_pool_mutex);
+	public:
+		const unsigned char *get_data(boost::uint64_t offset) const NOEXCEPT {
+			const AUTO(page_size, static_cast<boost::uint64_t>(::sysconf(_SC_PAGESIZE)));
+			return static_cast<const unsigned char *>(m_addr) + offset % page_size;
+		}
+	};
+
+	struct FreeChunk {
+		FreeChunk *next;
+	};
+
+	struct GlobalPool {
+		::pthread_mutex_t mutex;
+		FreeChunk *head;
+	};
+	GlobalPool g_pools[CHUNK_CLASS_COUNT] = {
+		{ PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP, NULLPTR },
+		{ PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP, NULLPTR },
+		{ PTHREAD_ERRORCHECK_MUTEX_INITIALIZER_NP, NULLPTR },
+	};
+
+	struct ThreadCache {
+		FreeChunk *heads[CHUNK_CLASS_COUNT];
+		std::size_t counts[CHUNK_CLASS_COUNT];
+		bool registered;
+	};
+	__thread ThreadCache t_cache; // 零初始化。
+
+	::pthread_once_t g_cache_key_once = PTHREAD_ONCE_INIT;
+	::pthread_key_t g_cache_key;
+
+	// 把 list 中的 count 个块放入全局池。
+	void push_to_global_pool(std::size_t size_class, FreeChunk *list, std::size_t count) NOEXCEPT {
+		if(count == 0){
+			return;
+		}
+		AUTO(last, list);
+		for(std::size_t i = 1; i < count; ++i){
+			last = last->next;
+		}
+		AUTO_REF(pool, g_pools[size_class]);
+		int err_code = ::pthread_mutex_lock(&(pool.mutex));
 		(void)err_code;
 		assert(err_code == 0);
-		try {
-			const AUTO(head, static_cast<Chunk *>(g_pool_head));
-			if(head){
-				g_pool_head = head->prev;
-				p = head;
-			} else {
-				p = ::operator new(bytes);
-			}
-			err_code = ::pthread_mutex_unlock(&g_pool_mutex);
-			assert(err_code == 0);
-		} catch(...){
-			err_code = ::pthread_mutex_unlock(&g_pool_mutex);
-			assert(err_code == 0);
-			throw;
+		{
+			last->next = pool.head;
+			pool.head = list;
 		}
-		return p;
+		err_code = ::pthread_mutex_unlock(&(pool.mutex));
+		assert(err_code == 0);
 	}
-	static void operator delete(void *p) NOEXCEPT {
-		if(!p){
-			return;
-		}
-		const AUTO(head, static_cast<Chunk *>(p));
-
-		int err_code = ::pthread_mutex_lock(&g_pool_mutex);
+	// 从全局池中取出至多 count 个块，返回实际取出的数量。
+	std::size_t pop_from_global_pool(FreeChunk *&list, std::size_t size_class, std::size_t count) NOEXCEPT {
+		std::size_t taken = 0;
+		AUTO_REF(pool, g_pools[size_class]);
+		int err_code = ::pthread_mutex_lock(&(pool.mutex));
 		(void)err_code;
 		assert(err_code == 0);
 		{
-			head->prev = static_cast<Chunk *>(g_pool_head);
-			g_pool_head = head;
+			list = pool.head;
+			AUTO(last, static_cast<FreeChunk *>(NULLPTR));
+			for(AUTO(it, pool.head); it && (taken < count); it = it->next){
+				last = it;
+				++taken;
+			}
+			if(last){
+				pool.head = last->next;
+				last->next = NULLPTR;
+			}
 		}
-		err_code = ::pthread_mutex_unlock(&g_pool_mutex);
+		err_code = ::pthread_mutex_unlock(&(pool.mutex));
 		assert(err_code == 0);
+		return taken;
+	}
+
+	void thread_cache_destructor(void *p) NOEXCEPT {
+		const AUTO(cache, static_cast<ThreadCache *>(p));
+		for(std::size_t i = 0; i < CHUNK_CLASS_COUNT; ++i){
+			push_to_global_pool(i, cache->heads[i], cache->counts[i]);
+			cache->heads[i] = NULLPTR;
+			cache->counts[i] = 0;
+		}
+		cache->registered = false;
+	}
+	void create_cache_key() NOEXCEPT {
+		const int err_code = ::pthread_key_create(&g_cache_key, &thread_cache_destructor);
+		if(err_code != 0){
+			std::abort();
+		}
+	}
+	ThreadCache *get_thread_cache() NOEXCEPT {
+		const AUTO(cache, &t_cache);
+		if(!cache->registered){
+			// 线程退出时把缓存的块归还到全局池。
+			::pthread_once(&g_cache_key_once, &create_cache_key);
+			if(::pthread_setspecific(g_cache_key, cache) == 0){
+				cache->registered = true;
+			}
+		}
+		return cache;
+	}
+
+	std::size_t get_size_class(std::size_t min_capacity) NOEXCEPT {
+		for(std::size_t i = 0; i < CHUNK_CLASS_COUNT - 1; ++i){
+			if(min_capacity <= g_chunk_capacities[i]){
+				return i;
+			}
+		}
+		return CHUNK_CLASS_COUNT - 1;
+	}
+	// 追加数据时按剩余的数据量选择块的大小。超过 4 KiB 时用 4 KiB 的块填充，
+	// 剩余的数据至少有 64 KiB 的四分之三时才使用 64 KiB 的块，避免浪费大块的空间。
+	std::size_t get_fill_capacity(std::size_t bytes_remaining) NOEXCEPT {
+		if(bytes_remaining >= g_chunk_capacities[CHUNK_CLASS_COUNT - 1] / 4 * 3){
+			return bytes_remaining;
+		}
+		return std::min<std::size_t>(bytes_remaining, g_chunk_capacities[CHUNK_CLASS_COUNT - 2]);
+	}
+}
+
+struct StreamBuffer::Chunk FINAL {
+	// 分配一个能容纳 min_capacity 字节的块，如果超过最大的块的大小，则分配最大的块。
+	static Chunk *create(std::size_t min_capacity){
+		const AUTO(size_class, get_size_class(min_capacity));
+		const AUTO(capacity, g_chunk_capacities[size_class]);
+
+		void *p;
+		const AUTO(cache, get_thread_cache());
+		if(!cache->heads[size_class]){
+			cache->counts[size_class] = pop_from_global_pool(cache->heads[size_class], size_class, g_thread_cache_limits[size_class] / 2);
+		}
+		const AUTO(head, cache->heads[size_class]);
+		if(head){
+			cache->heads[size_class] = head->next;
+			cache->counts[size_class] -= 1;
+			p = head;
+		} else {
+			p = ::operator new(sizeof(Chunk) + capacity);
+		}
+		const AUTO(chunk, static_cast<Chunk *>(p));
+		chunk->base = reinterpret_cast<unsigned char *>(chunk + 1);
+		chunk->capacity = capacity;
+		chunk->size_class = static_cast<unsigned>(size_class);
+		return chunk;
+	}
+	// 创建一个引用外部内存的块，数据在 owner 被释放之前保持有效，并且不会被修改。
+	static Chunk *create_external(const ExternalOwner &owner, const void *data, std::size_t bytes){
+		assert(bytes <= MAX_EXTERNAL_CHUNK_SIZE);
+
+		const AUTO(chunk, static_cast<Chunk *>(::operator new(sizeof(Chunk) + sizeof(ExternalOwner))));
+		new(static_cast<void *>(chunk + 1)) ExternalOwner(owner);
+		chunk->base = const_cast<unsigned char *>(static_cast<const unsigned char *>(data));
+		chunk->begin = 0;
+		chunk->end = static_cast<unsigned>(bytes);
+		chunk->capacity = static_cast<unsigned>(bytes);
+		chunk->size_class = CHUNK_CLASS_EXTERNAL;
+		return chunk;
+	}
+	static void destroy(Chunk *chunk) NOEXCEPT {
+		if(!chunk){
+			return;
+		}
+		if(chunk->is_external()){
+			chunk->get_owner().~ExternalOwner();
+			::operator delete(chunk);
+			return;
+		}
+		const std::size_t size_class = chunk->size_class;
+		const AUTO(head, reinterpret_cast<FreeChunk *>(chunk));
+
+		const AUTO(cache, get_thread_cache());
+		head->next = cache->heads[size_class];
+		cache->heads[size_class] = head;
+		cache->counts[size_class] += 1;
+		if(cache->counts[size_class] > g_thread_cache_limits[size_class]){
+			const AUTO(count_to_spill, cache->counts[size_class] / 2);
+			AUTO(last, cache->heads[size_class]);
+			for(std::size_t i = 1; i < count_to_spill; ++i){
+				last = last->next;
+			}
+			const AUTO(spilled, cache->heads[size_class]);
+			cache->heads[size_class] = last->next;
+			cache->counts[size_class] -= count_to_spill;
+			push_to_global_pool(size_class, spilled, count_to_spill);
+		}
 	}
 
 	__attribute__((__destructor__(101)))
 	static void pool_destructor() NOEXCEPT {
-		for(;;){
-			const AUTO(head, static_cast<Chunk *>(g_pool_head));
-			if(!head){
-				break;
+		thread_cache_destructor(&t_cache);
+		for(std::size_t i = 0; i < CHUNK_CLASS_COUNT; ++i){
+			for(;;){
+				const AUTO(head, g_pools[i].head);
+				if(!head){
+					break;
+				}
+				g_pools[i].head = head->next;
+				::operator delete(head);
 			}
-			g_pool_head = head->prev;
-			::operator delete(head);
 		}
 	}
 
 	Chunk *prev;
 	Chunk *next;
+	unsigned char *base; // 对于普通的块，数据紧跟在块头之后。
 	unsigned begin;
 	unsigned end;
-	unsigned char data[0x100];
+	unsigned capacity;
+	unsigned size_class;
+
+	unsigned char *data() NOEXCEPT {
+		return base;
+	}
+	const unsigned char *data() const NOEXCEPT {
+		return base;
+	}
+
+	bool is_external() const NOEXCEPT {
+		return size_class == CHUNK_CLASS_EXTERNAL;
+	}
+	const ExternalOwner &get_owner() NOEXCEPT {
+		assert(is_external());
+		return *reinterpret_cast<ExternalOwner *>(this + 1);
+	}
+
+	// 外部块是只读的，不能在其前后写入数据。
+	std::size_t get_head_room() const NOEXCEPT {
+		return is_external() ? 0 : begin;
+	}
+	std::size_t get_tail_room() const NOEXCEPT {
+		return is_external() ? 0 : capacity - end;
+	}
 };
 
 unsigned char *StreamBuffer::ChunkEnumerator::begin() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->begin;
+	return m_chunk->data() + m_chunk->begin;
 }
 unsigned char *StreamBuffer::ChunkEnumerator::end() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->end;
+	return m_chunk->data() + m_chunk->end;
 }
 
 StreamBuffer::ChunkEnumerator &StreamBuffer::ChunkEnumerator::operator++() NOEXCEPT {
@@ -94,12 +303,12 @@ StreamBuffer::ChunkEnumerator &StreamBuffer::ChunkEnumerator::operator++() NOEXC
 const unsigned char *StreamBuffer::ConstChunkEnumerator::begin() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->begin;
+	return m_chunk->data() + m_chunk->begin;
 }
 const unsigned char *StreamBuffer::ConstChunkEnumerator::end() const NOEXCEPT {
 	assert(m_chunk);
 
-	return m_chunk->data + m_chunk->end;
+	return m_chunk->data() + m_chunk->end;
 }
 
 StreamBuffer::ConstChunkEnumerator &StreamBuffer::ConstChunkEnumerator::operator++() NOEXCEPT {
@@ -133,8 +342,12 @@ StreamBuffer::StreamBuffer(const std::basic_string<unsigned char> &str)
 StreamBuffer::StreamBuffer(const StreamBuffer &rhs)
 	: m_first(NULLPTR), m_last(NULLPTR), m_size(0)
 {
-	for(AUTO(ce, rhs.get_chunk_enumerator()); ce; ++ce){
-		put(ce.data(), ce.size());
+	for(AUTO(chunk, rhs.m_first); chunk; chunk = chunk->next){
+		if(chunk->is_external()){
+			put_shared(chunk->get_owner(), chunk->data() + chunk->begin, chunk->end - chunk->begin);
+		} else {
+			put(chunk->data() + chunk->begin, chunk->end - chunk->begin);
+		}
 	}
 }
 StreamBuffer &StreamBuffer::operator=(const StreamBuffer &rhs){
@@ -166,7 +379,7 @@ int StreamBuffer::front() const NOEXCEPT {
 	AUTO(chunk, m_first);
 	do {
 		if(chunk->end != chunk->begin){
-			ret = chunk->data[chunk->begin];
+			ret = chunk->data()[chunk->begin];
 		}
 		chunk = chunk->next;
 	} while(ret < 0);
@@ -181,7 +394,7 @@ int StreamBuffer::back() const NOEXCEPT {
 	AUTO(chunk, m_last);
 	do {
 		if(chunk->end != chunk->begin){
-			ret = chunk->data[chunk->end - 1];
+			ret = chunk->data()[chunk->end - 1];
 		}
 		chunk = chunk->prev;
 	} while(ret < 0);
@@ -192,7 +405,7 @@ void StreamBuffer::clear() NOEXCEPT {
 	while(m_first){
 		const AUTO(chunk, m_first);
 		m_first = chunk->next;
-		delete chunk;
+		Chunk::destroy(chunk);
 	}
 	m_last = NULLPTR;
 	m_size = 0;
@@ -207,12 +420,12 @@ int StreamBuffer::get() NOEXCEPT {
 	AUTO(chunk, m_first);
 	do {
 		if(chunk->end != chunk->begin){
-			ret = chunk->data[chunk->begin];
+			ret = chunk->data()[chunk->begin];
 			++(chunk->begin);
 		}
 		if(chunk->begin == chunk->end){
 			chunk = chunk->next;
-			delete m_first;
+			Chunk::destroy(m_first);
 			m_first = chunk;
 
 			if(chunk){
@@ -228,13 +441,13 @@ int StreamBuffer::get() NOEXCEPT {
 void StreamBuffer::put(unsigned char by){
 	std::size_t last_avail = 0;
 	if(m_last){
-		last_avail = sizeof(m_last->data) - m_last->end;
+		last_avail = m_last->get_tail_room();
 	}
 	Chunk *last_chunk = NULLPTR;
 	if(last_avail != 0){
 		last_chunk = m_last;
 	} else {
-		AUTO(chunk, new Chunk);
+		AUTO(chunk, Chunk::create(1));
 		chunk->next = NULLPTR;
 		// chunk->prev = NULLPTR;
 		chunk->begin = 0;
@@ -254,7 +467,7 @@ void StreamBuffer::put(unsigned char by){
 	}
 
 	AUTO(chunk, last_chunk);
-	chunk->data[chunk->end] = by;
+	chunk->data()[chunk->end] = by;
 	++(chunk->end);
 	++m_size;
 }
@@ -268,11 +481,11 @@ int StreamBuffer::unput() NOEXCEPT {
 	do {
 		if(chunk->end != chunk->begin){
 			--(chunk->end);
-			ret = chunk->data[chunk->end];
+			ret = chunk->data()[chunk->end];
 		}
 		if(chunk->begin == chunk->end){
 			chunk = chunk->prev;
-			delete m_last;
+			Chunk::destroy(m_last);
 			m_last = chunk;
 
 			if(chunk){
@@ -288,17 +501,17 @@ int StreamBuffer::unput() NOEXCEPT {
 void StreamBuffer::unget(unsigned char by){
 	std::size_t first_avail = 0;
 	if(m_first){
-		first_avail = m_first->begin;
+		first_avail = m_first->get_head_room();
 	}
 	Chunk *first_chunk = NULLPTR;
 	if(first_avail != 0){
 		first_chunk = m_first;
 	} else {
-		AUTO(chunk, new Chunk);
+		AUTO(chunk, Chunk::create(1));
 		// chunk->next = NULLPTR;
 		chunk->prev = NULLPTR;
-		chunk->begin = sizeof(chunk->data);
-		chunk->end = sizeof(chunk->data);
+		chunk->begin = chunk->capacity;
+		chunk->end = chunk->capacity;
 
 		if(m_first){
 			m_first->prev = chunk;
@@ -315,7 +528,7 @@ void StreamBuffer::unget(unsigned char by){
 
 	AUTO(chunk, first_chunk);
 	--(chunk->begin);
-	chunk->data[chunk->begin] = by;
+	chunk->data()[chunk->begin] = by;
 	++m_size;
 }
 
@@ -330,7 +543,7 @@ std::size_t StreamBuffer::peek(void *data, std::size_t bytes) const NOEXCEPT {
 	do {
 		const AUTO(write, static_cast<unsigned char *>(data) + bytes_copied);
 		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, chunk->end - chunk->begin));
-		std::memcpy(write, chunk->data + chunk->begin, bytes_to_copy_this_time);
+		std::memcpy(write, chunk->data() + chunk->begin, bytes_to_copy_this_time);
 		bytes_copied += bytes_to_copy_this_time;
 		chunk = chunk->next;
 	} while(bytes_copied < bytes_to_copy);
@@ -347,12 +560,12 @@ std::size_t StreamBuffer::get(void *data, std::size_t bytes) NOEXCEPT {
 	do {
 		const AUTO(write, static_cast<unsigned char *>(data) + bytes_copied);
 		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, chunk->end - chunk->begin));
-		std::memcpy(write, chunk->data + chunk->begin, bytes_to_copy_this_time);
+		std::memcpy(write, chunk->data() + chunk->begin, bytes_to_copy_this_time);
 		bytes_copied += bytes_to_copy_this_time;
 		chunk->begin += bytes_to_copy_this_time;
 		if(chunk->begin == chunk->end){
 			chunk = chunk->next;
-			delete m_first;
+			Chunk::destroy(m_first);
 			m_first = chunk;
 
 			if(chunk){
@@ -379,7 +592,7 @@ std::size_t StreamBuffer::discard(std::size_t bytes) NOEXCEPT {
 		chunk->begin += bytes_to_copy_this_time;
 		if(chunk->begin == chunk->end){
 			chunk = chunk->next;
-			delete m_first;
+			Chunk::destroy(m_first);
 			m_first = chunk;
 
 			if(chunk){
@@ -400,30 +613,32 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 
 	std::size_t last_avail = 0;
 	if(m_last){
-		last_avail = sizeof(m_last->data) - m_last->end;
+		last_avail = m_last->get_tail_room();
 	}
 	Chunk *last_chunk = NULLPTR;
 	if(last_avail != 0){
 		last_chunk = m_last;
 	}
 	if(bytes_to_copy > last_avail){
-		const AUTO(new_chunks, (bytes_to_copy - last_avail - 1) / sizeof(last_chunk->data) + 1);
-		assert(new_chunks != 0);
+		// 按照剩余的数据量选择块的大小。
+		std::size_t bytes_remaining = bytes_to_copy - last_avail;
 
-		AUTO(chunk, new Chunk);
+		AUTO(chunk, Chunk::create(get_fill_capacity(bytes_remaining)));
 		chunk->next = NULLPTR;
 		chunk->prev = NULLPTR;
 		chunk->begin = 0;
 		chunk->end = 0;
+		bytes_remaining -= std::min<std::size_t>(bytes_remaining, chunk->capacity);
 
 		AUTO(splice_first, chunk), splice_last = chunk;
 		try {
-			for(std::size_t i = 1; i < new_chunks; ++i){
-				chunk = new Chunk;
+			while(bytes_remaining != 0){
+				chunk = Chunk::create(get_fill_capacity(bytes_remaining));
 				chunk->next = NULLPTR;
 				chunk->prev = splice_last;
 				chunk->begin = 0;
 				chunk->end = 0;
+				bytes_remaining -= std::min<std::size_t>(bytes_remaining, chunk->capacity);
 
 				splice_last->next = chunk;
 				splice_last = chunk;
@@ -432,7 +647,7 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 			do {
 				chunk = splice_first;
 				splice_first = chunk->next;
-				delete chunk;
+				Chunk::destroy(chunk);
 			} while(splice_first);
 
 			throw;
@@ -454,8 +669,8 @@ void StreamBuffer::put(const void *data, std::size_t bytes){
 	AUTO(chunk, last_chunk);
 	do {
 		const AUTO(read, static_cast<const unsigned char *>(data) + bytes_copied);
-		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, sizeof(chunk->data) - chunk->end));
-		std::memcpy(chunk->data + chunk->end, read, bytes_to_copy_this_time);
+		const AUTO(bytes_to_copy_this_time, std::min<std::size_t>(bytes_to_copy - bytes_copied, chunk->capacity - chunk->end));
+		std::memcpy(chunk->data() + chunk->end, read, bytes_to_copy_this_time);
 		chunk->end += bytes_to_copy_this_time;
 		bytes_copied += bytes_to_copy_this_time;
 		chunk = chunk->next;
@@ -472,6 +687,141 @@ void StreamBuffer::put(const std::basic_string<unsigned char> &str){
 	put(str.data(), str.size());
 }
 
+void StreamBuffer::put_shared(const boost::shared_ptr<const void> &owner, const void *data, std::size_t bytes){
+	if(bytes < MIN_EXTERNAL_CHUNK_SIZE){
+		put(data, bytes);
+		return;
+	}
+
+	AUTO(splice_first, static_cast<Chunk *>(NULLPTR)), splice_last = splice_first;
+	try {
+		std::size_t bytes_added = 0;
+		while(bytes_added < bytes){
+			const AUTO(bytes_this_time, std::min(bytes - bytes_added, MAX_EXTERNAL_CHUNK_SIZE));
+			const AUTO(chunk, Chunk::create_external(owner, static_cast<const unsigned char *>(data) + bytes_added, bytes_this_time));
+			chunk->next = NULLPTR;
+			chunk->prev = splice_last;
+			if(splice_last){
+				splice_last->next = chunk;
+			} else {
+				splice_first = chunk;
+			}
+			splice_last = chunk;
+			bytes_added += bytes_this_time;
+		}
+	} catch(...){
+		while(splice_first){
+			const AUTO(chunk, splice_first);
+			splice_first = chunk->next;
+			Chunk::destroy(chunk);
+		}
+		throw;
+	}
+	if(m_last){
+		m_last->next = splice_first;
+	} else {
+		m_first = splice_first;
+	}
+	splice_first->prev = m_last;
+	m_last = splice_last;
+	m_size += bytes;
+}
+void StreamBuffer::put_file(int fd, boost::uint64_t offset, std::size_t bytes){
+	PROFILE_ME;
+
+	if(bytes == 0){
+		return;
+	}
+	const AUTO(mapping, boost::make_shared<FileMapping>(fd, offset, bytes));
+	put_shared(mapping, mapping->get_data(offset), bytes);
+}
+
+std::size_t StreamBuffer::peek_iovec(::iovec *vecs, std::size_t count, std::size_t bytes) const NOEXCEPT {
+	std::size_t vecs_filled = 0;
+	std::size_t bytes_remaining = bytes;
+	for(AUTO(chunk, m_first); chunk && (vecs_filled < count) && (bytes_remaining != 0); chunk = chunk->next){
+		const AUTO(bytes_this_time, std::min<std::size_t>(bytes_remaining, chunk->end - chunk->begin));
+		if(bytes_this_time == 0){
+			continue;
+		}
+		AUTO_REF(vec, vecs[vecs_filled++]);
+		vec.iov_base = const_cast<unsigned char *>(chunk->data() + chunk->begin);
+		vec.iov_len = bytes_this_time;
+		bytes_remaining -= bytes_this_time;
+	}
+	return vecs_filled;
+}
+std::size_t StreamBuffer::reserve_write(::iovec *vecs, std::size_t count, std::size_t bytes){
+	std::size_t vecs_filled = 0;
+	std::size_t bytes_reserved = 0;
+	// 先使用最后一个块剩余的空间，然后追加空的块。commit_write() 依赖于这个顺序。
+	if(m_last && (m_last->get_tail_room() != 0) && (vecs_filled < count)){
+		AUTO_REF(vec, vecs[vecs_filled++]);
+		vec.iov_base = m_last->data() + m_last->end;
+		vec.iov_len = m_last->get_tail_room();
+		bytes_reserved += vec.iov_len;
+	}
+	try {
+		while((bytes_reserved < bytes) && (vecs_filled < count)){
+			const AUTO(chunk, Chunk::create(get_fill_capacity(bytes - bytes_reserved)));
+			chunk->next = NULLPTR;
+			chunk->prev = m_last;
+			chunk->begin = 0;
+			chunk->end = 0;
+
+			if(m_last){
+				m_last->next = chunk;
+			} else {
+				m_first = chunk;
+			}
+			m_last = chunk;
+
+			AUTO_REF(vec, vecs[vecs_filled++]);
+			vec.iov_base = chunk->data();
+			vec.iov_len = chunk->capacity;
+			bytes_reserved += vec.iov_len;
+		}
+	} catch(...){
+		commit_write(0);
+		throw;
+	}
+	return vecs_filled;
+}
+void StreamBuffer::commit_write(std::size_t bytes) NOEXCEPT {
+	// 除了 reserve_write() 追加的块以外，不存在空的块。
+	Chunk *first_empty = NULLPTR;
+	AUTO(chunk, m_last);
+	while(chunk && (chunk->begin == chunk->end)){
+		first_empty = chunk;
+		chunk = chunk->prev;
+	}
+	if(!chunk || (chunk->get_tail_room() == 0)){
+		chunk = first_empty;
+	}
+
+	std::size_t bytes_remaining = bytes;
+	while(chunk && (bytes_remaining != 0)){
+		const AUTO(bytes_this_time, std::min<std::size_t>(bytes_remaining, chunk->get_tail_room()));
+		chunk->end += bytes_this_time;
+		bytes_remaining -= bytes_this_time;
+		chunk = chunk->next;
+	}
+	assert(bytes_remaining == 0);
+	m_size += bytes - bytes_remaining;
+
+	while(m_last && (m_last->begin == m_last->end)){
+		chunk = m_last->prev;
+		Chunk::destroy(m_last);
+		m_last = chunk;
+
+		if(chunk){
+			chunk->next = NULLPTR;
+		} else {
+			m_first = NULLPTR;
+		}
+	}
+}
+
 StreamBuffer StreamBuffer::cut_off(std::size_t bytes){
 	StreamBuffer ret;
 
@@ -494,13 +844,18 @@ StreamBuffer StreamBuffer::cut_off(std::size_t bytes){
 			if(bytes_remaining == bytes_avail){
 				cut_end = cut_end->next;
 			} else {
-				const AUTO(chunk, new Chunk);
+				Chunk *chunk;
+				if(cut_end->is_external()){
+					// 外部块不需要复制，两个块引用同一块内存即可。
+					chunk = Chunk::create_external(cut_end->get_owner(), cut_end->data() + cut_end->begin, bytes_remaining);
+				} else {
+					chunk = Chunk::create(bytes_remaining);
+					chunk->begin = 0;
+					chunk->end = bytes_remaining;
+					std::memcpy(chunk->data(), cut_end->data() + cut_end->begin, bytes_remaining);
+				}
 				chunk->next = cut_end;
 				chunk->prev = cut_end->prev;
-				chunk->begin = 0;
-				chunk->end = bytes_remaining;
-
-				std::memcpy(chunk->data, cut_end->data + cut_end->begin, bytes_remaining);
 				cut_end->begin += bytes_remaining;
 
 				if(cut_end->prev){
@@ -557,7 +912,7 @@ std::string StreamBuffer::dump_string() const {
 	std::string str;
 	str.reserve(size());
 	for(AUTO(chunk, m_first); chunk; chunk = chunk->next){
-		str.append(reinterpret_cast<const char *>(chunk->data + chunk->begin), chunk->end - chunk->begin);
+		str.append(reinterpret_cast<const char *>(chunk->data() + chunk->begin), chunk->end - chunk->begin);
 	}
 	return str;
 }
@@ -567,7 +922,7 @@ std::basic_string<unsigned char> StreamBuffer::dump_byte_string() const {
 	std::basic_string<unsigned char> str;
 	str.reserve(size());
 	for(AUTO(chunk, m_first); chunk; chunk = chunk->next){
-		str.append(chunk->data + chunk->begin, chunk->end - chunk->begin);
+		str.append(chunk->data() + chunk->begin, chunk->end - chunk->begin);
 	}
 	return str;
 }
@@ -575,7 +930,7 @@ void StreamBuffer::dump(std::ostream &os) const {
 	PROFILE_ME;
 
 	for(AUTO(chunk, m_first); chunk; chunk = chunk->next){
-		os.write(reinterpret_cast<const char *>(chunk->data + chunk->begin), chunk->end - chunk->begin);
+		os.write(reinterpret_cast<const char *>(chunk->data() + chunk->begin), chunk->end - chunk->begin);
 	}
 }
 
@@ -5,12 +5,16 @@
 #define POSEIDON_STREAM_BUFFER_HPP_
 
 #include "cxx_ver.hpp"
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
 #include <string>
 #include <utility>
 #include <iterator>
 #include <iosfwd>
 #include <cstddef>
 
+struct iovec;
+
 namespace Poseidon {
 
 class StreamBuffer {
@@ -204,6 +208,19 @@ public:
 	void put(const char *str);
 	void put(const std::string &str);
 	void put(const std::basic_string<unsigned char> &str);
+	// 引用外部的只读数据而不复制。数据在 owner 被释放之前必须保持有效且不被修改。
+	// 通过 ChunkEnumerator 得到的指向这些数据的指针不能用于写入。
+	void put_shared(const boost::shared_ptr<const void> &owner, const void *data, std::size_t bytes);
+	// 把文件的一部分映射到内存中并以只读的方式引用。文件在此期间不应被截断。
+	void put_file(int fd, boost::uint64_t offset, std::size_t bytes);
+
+	// 用于 writev() 等。把开头的至多 bytes 字节以 iovec 的形式写入 vecs（最多 count 个），返回写入的个数。
+	std::size_t peek_iovec(::iovec *vecs, std::size_t count, std::size_t bytes) const NOEXCEPT;
+	// 用于 readv() 等。在末尾预留至少 bytes 字节（受 count 限制）的可写空间，返回写入 vecs 的个数。
+	// 写入数据之后必须调用 commit_write()，在此之间不能对该对象进行其他修改。
+	std::size_t reserve_write(::iovec *vecs, std::size_t count, std::size_t bytes);
+	// 确认已经写入了 bytes 字节，释放未使用的空间。
+	void commit_write(std::size_t bytes) NOEXCEPT;
 
 	ConstChunkEnumerator get_chunk_enumerator() const NOEXCEPT {
 		return ConstChunkEnumerator(*this);
@@ -6,8 +6,12 @@
 #include "ssl_filter_base.hpp"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <boost/container/map.hpp>
 #include "singletons/epoll_daemon.hpp"
 #include "singletons/main_config.hpp"
 #include "log.hpp"
@@ -20,41 +24,307 @@
 
 namespace Poseidon {
 
-void TcpSessionBase::shutdown_timer_proc(const boost::weak_ptr<TcpSessionBase> &weak, boost::uint64_t now){
-	PROFILE_ME;
+namespace {
+	CONSTEXPR const std::size_t MIN_READ_HINT = 4096;
+	CONSTEXPR const std::size_t MAX_IO_VECS = 64;
+	CONSTEXPR const boost::uint64_t DEADLINE_SWEEP_INTERVAL = 100;
+
+	struct IoConfig {
+		std::size_t max_io_bytes;
+		std::size_t read_budget;
+		boost::uint64_t send_high_watermark;
+		boost::uint64_t send_low_watermark;
+		boost::uint64_t recv_high_watermark;
+		boost::uint64_t recv_low_watermark;
+		boost::uint64_t response_timeout;
+
+		IoConfig(){
+			max_io_bytes = std::max<std::size_t>(MainConfig::get<std::size_t>("tcp_max_io_bytes_per_wakeup", 262144), MIN_READ_HINT);
+			read_budget = std::max<std::size_t>(MainConfig::get<std::size_t>("tcp_read_budget_per_wakeup", 1048576), 1);
+			send_high_watermark = MainConfig::get<boost::uint64_t>("tcp_send_buffer_high_watermark", 262144);
+			send_low_watermark = std::min(MainConfig::get<boost::uint64_t>("tcp_send_buffer_low_watermark", 65536), send_high_watermark);
+			recv_high_watermark = MainConfig::get<boost::uint64_t>("tcp_recv_queue_high_watermark", 1048576);
+			recv_low_watermark = std::min(MainConfig::get<boost::uint64_t>("tcp_recv_queue_low_watermark", 262144), recv_high_watermark);
+			response_timeout = MainConfig::get<boost::uint64_t>("tcp_response_timeout", 30000);
+		}
+	};
 
-	const AUTO(session, weak.lock());
-	if(!session){
-		return;
+	const IoConfig &get_io_config(){
+		static const IoConfig s_config;
+		return s_config;
+	}
+	std::size_t get_max_io_bytes(){
+		return get_io_config().max_io_bytes;
 	}
 
-	try {
-		session->on_shutdown_timer(now);
-	} catch(std::exception &e){
-		LOG_POSEIDON_WARNING("std::exception thrown: what = ", e.what());
-		session->force_shutdown();
+	// SSL 没有分散读写的接口，只能逐块调用，遇到不完整的读写时停止。
+	::ssize_t ssl_readv(SslFilterBase *ssl_filter, const ::iovec *vecs, std::size_t count){
+		std::size_t total = 0;
+		for(std::size_t i = 0; i < count; ++i){
+			const AUTO(result, ssl_filter->recv(vecs[i].iov_base, vecs[i].iov_len));
+			if(result < 0){
+				if(total != 0){
+					break;
+				}
+				return -1;
+			}
+			total += static_cast<std::size_t>(result);
+			if(static_cast<std::size_t>(result) < vecs[i].iov_len){
+				break;
+			}
+		}
+		return static_cast< ::ssize_t>(total);
+	}
+	::ssize_t ssl_writev(SslFilterBase *ssl_filter, const ::iovec *vecs, std::size_t count){
+		std::size_t total = 0;
+		for(std::size_t i = 0; i < count; ++i){
+			const AUTO(result, ssl_filter->send(vecs[i].iov_base, vecs[i].iov_len));
+			if(result < 0){
+				if(total != 0){
+					break;
+				}
+				return -1;
+			}
+			total += static_cast<std::size_t>(result);
+			if(static_cast<std::size_t>(result) < vecs[i].iov_len){
+				break;
+			}
+		}
+		return static_cast< ::ssize_t>(total);
+	}
+}
+
+// 同一超时类别的连接按照截止时间放入环形的槽中，每个槽是一个侵入式双向链表。
+// 活动只更新时间戳；检查到某个连接时如果它还没有超时，就按照新的截止时间移到后面的槽中。
+// 因此每次检查的开销只与到期和需要推迟的连接数有关，与连接总数无关。
+class TcpSessionBase::DeadlineList : NONCOPYABLE {
+public:
+	static Mutex s_mutex;
+	static boost::scoped_ptr<DeadlineList> s_response_list;
+	static boost::container::map<boost::uint64_t, boost::shared_ptr<DeadlineList> > s_shutdown_lists;
+	static boost::weak_ptr<TimerItem> s_sweep_timer;
+
+	static DeadlineList *get_response_list(boost::uint64_t now){
+		if(!s_response_list){
+			const AUTO(timeout, get_io_config().response_timeout);
+			s_response_list.reset(new DeadlineList(&TcpSessionBase::m_response_link, &TcpSessionBase::m_last_use_time, timeout, timeout, now));
+		}
+		return s_response_list.get();
+	}
+	// 超时时间向上取整到 DEADLINE_SWEEP_INTERVAL 乘以 2 的幂，因此链表的数量是有限的。
+	static boost::uint64_t get_timeout_class(boost::uint64_t timeout){
+		boost::uint64_t timeout_class = DEADLINE_SWEEP_INTERVAL;
+		while((timeout_class < timeout) && (timeout_class < DEADLINE_SWEEP_INTERVAL * 0x10000)){
+			timeout_class <<= 1;
+		}
+		return timeout_class;
+	}
+	static DeadlineList *get_shutdown_list(boost::uint64_t timeout, boost::uint64_t now){
+		AUTO_REF(list, s_shutdown_lists[timeout]);
+		if(!list){
+			list = boost::make_shared<DeadlineList>(&TcpSessionBase::m_shutdown_link, &TcpSessionBase::m_shutdown_time, 0, timeout, now);
+		}
+		return list.get();
+	}
+
+private:
+	DeadlineLink TcpSessionBase::*const m_link;
+	volatile boost::uint64_t TcpSessionBase::*const m_base_time;
+	const boost::uint64_t m_offset;
+
+	std::vector<TcpSessionBase *> m_buckets;
+	boost::uint64_t m_slot; // 下一个要检查的槽的编号。
+	std::size_t m_count;
+
+public:
+	DeadlineList(DeadlineLink TcpSessionBase::*link, volatile boost::uint64_t TcpSessionBase::*base_time,
+		boost::uint64_t offset, boost::uint64_t span, boost::uint64_t now)
+		: m_link(link), m_base_time(base_time), m_offset(offset)
+		, m_buckets(static_cast<std::size_t>(std::min<boost::uint64_t>(span / DEADLINE_SWEEP_INTERVAL, 0x10000) + 2))
+		, m_slot(now / DEADLINE_SWEEP_INTERVAL), m_count(0)
+	{ }
+
+private:
+	boost::uint64_t get_deadline(const TcpSessionBase *session) const NOEXCEPT {
+		return saturated_add(atomic_load(session->*m_base_time, ATOMIC_CONSUME), m_offset);
+	}
+	void link(TcpSessionBase *session) NOEXCEPT {
+		const AUTO(deadline, get_deadline(session));
+		AUTO(slot, deadline / DEADLINE_SWEEP_INTERVAL + 1);
+		if(slot < m_slot){
+			slot = m_slot;
+		}
+		if(slot - m_slot >= m_buckets.size()){
+			// 超出范围的先放在最后一个槽中，检查到时再重新计算。
+			slot = m_slot + m_buckets.size() - 1;
+		}
+		AUTO_REF(bucket, m_buckets[static_cast<std::size_t>(slot % m_buckets.size())]);
+		AUTO_REF(node, session->*m_link);
+		node.list = this;
+		node.bucket = &bucket;
+		node.prev = NULLPTR;
+		node.next = bucket;
+		if(bucket){
+			(bucket->*m_link).prev = session;
+		}
+		bucket = session;
+		++m_count;
+	}
+
+public:
+	bool empty() const NOEXCEPT {
+		return m_count == 0;
+	}
+
+	void insert(TcpSessionBase *session, boost::uint64_t now) NOEXCEPT {
+		assert(!(session->*m_link).list);
+
+		if(m_count == 0){
+			m_slot = now / DEADLINE_SWEEP_INTERVAL;
+		}
+		link(session);
+	}
+	void erase(TcpSessionBase *session) NOEXCEPT {
+		AUTO_REF(node, session->*m_link);
+		if(node.list != this){
+			return;
+		}
+		if(node.prev){
+			(node.prev->*m_link).next = node.next;
+		} else {
+			*(node.bucket) = node.next;
+		}
+		if(node.next){
+			(node.next->*m_link).prev = node.prev;
+		}
+		node = DeadlineLink();
+		--m_count;
+	}
+
+	// 检查到 now 为止的所有槽，把超时的连接从链表中移除并追加到 expired 中。
+	void sweep(boost::uint64_t now, std::vector<boost::shared_ptr<TcpSessionBase> > &expired){
+		const AUTO(now_slot, now / DEADLINE_SWEEP_INTERVAL);
+		while(m_slot <= now_slot){
+			if(m_count == 0){
+				m_slot = now_slot + 1;
+				break;
+			}
+			AUTO_REF(bucket, m_buckets[static_cast<std::size_t>(m_slot % m_buckets.size())]);
+			AUTO(session, bucket);
+			bucket = NULLPTR;
+			++m_slot;
+			while(session){
+				const AUTO(next, (session->*m_link).next);
+				session->*m_link = DeadlineLink();
+				--m_count;
+				if(get_deadline(session) >= now){
+					link(session);
+				} else {
+					// 如果为空，该连接正在析构，不再放回链表即可。
+					AUTO(strong, session->m_weak_self.lock());
+					if(strong){
+						expired.push_back(STD_MOVE(strong));
+					}
+				}
+				session = next;
+			}
+		}
+	}
+};
+
+Mutex TcpSessionBase::DeadlineList::s_mutex;
+boost::scoped_ptr<TcpSessionBase::DeadlineList> TcpSessionBase::DeadlineList::s_response_list;
+boost::container::map<boost::uint64_t, boost::shared_ptr<TcpSessionBase::DeadlineList> > TcpSessionBase::DeadlineList::s_shutdown_lists;
+boost::weak_ptr<TimerItem> TcpSessionBase::DeadlineList::s_sweep_timer;
+
+void TcpSessionBase::sweep_deadlines(boost::uint64_t now){
+	PROFILE_ME;
+
+	std::vector<boost::shared_ptr<TcpSessionBase> > expired;
+	{
+		const Mutex::UniqueLock lock(DeadlineList::s_mutex);
+		if(DeadlineList::s_response_list){
+			DeadlineList::s_response_list->sweep(now, expired);
+		}
+		AUTO(it, DeadlineList::s_shutdown_lists.begin());
+		while(it != DeadlineList::s_shutdown_lists.end()){
+			it->second->sweep(now, expired);
+			// 没有连接的链表直接释放，需要时再创建。
+			if(it->second->empty()){
+				it = DeadlineList::s_shutdown_lists.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+	// 一个连接可能同时在两个链表中到期。
+	std::sort(expired.begin(), expired.end());
+	expired.erase(std::unique(expired.begin(), expired.end()), expired.end());
+
+	for(AUTO(it, expired.begin()); it != expired.end(); ++it){
+		const AUTO_REF(session, *it);
+		try {
+			session->on_shutdown_timer(now);
+			// 仍然没有关闭的连接按照新的截止时间放回链表中。
+			const Mutex::UniqueLock lock(DeadlineList::s_mutex);
+			session->arm_deadlines_unlocked(now);
+		} catch(std::exception &e){
+			LOG_POSEIDON_WARNING("std::exception thrown: what = ", e.what());
+			session->force_shutdown();
+		}
 	}
 }
 
 TcpSessionBase::TcpSessionBase(Move<UniqueFile> socket)
 	: SocketBase(STD_MOVE(socket)), SessionBase()
-	, m_connected_notified(false), m_read_hup_notified(false)
+	, m_connected_notified(false), m_read_hup_notified(false), m_read_hint(MIN_READ_HINT)
+	, m_recv_queue_size(0), m_send_throttled(false), m_recv_throttled(false)
 	, m_shutdown_time((boost::uint64_t)-1), m_last_use_time((boost::uint64_t)-1)
+	, m_deadlines_armed(false), m_shutdown_timeout(0)
 { }
-TcpSessionBase::~TcpSessionBase(){ }
+TcpSessionBase::~TcpSessionBase(){
+	if(atomic_load(m_deadlines_armed, ATOMIC_CONSUME)){
+		const Mutex::UniqueLock lock(DeadlineList::s_mutex);
+		if(m_response_link.list){
+			m_response_link.list->erase(this);
+		}
+		if(m_shutdown_link.list){
+			m_shutdown_link.list->erase(this);
+		}
+	}
+}
 
 void TcpSessionBase::init_ssl(Move<boost::scoped_ptr<SslFilterBase> > ssl_filter){
 	swap(m_ssl_filter, ssl_filter);
 }
+void TcpSessionBase::arm_deadlines_unlocked(boost::uint64_t now){
+	if(!m_sweep_timer){
+		m_sweep_timer = DeadlineList::s_sweep_timer.lock();
+		if(!m_sweep_timer){
+			m_sweep_timer = TimerDaemon::register_low_level_timer(DEADLINE_SWEEP_INTERVAL, DEADLINE_SWEEP_INTERVAL,
+				boost::bind(&sweep_deadlines, _2));
+			DeadlineList::s_sweep_timer = m_sweep_timer;
+		}
+		m_weak_self = virtual_weak_from_this<TcpSessionBase>();
+	}
+	if(!m_response_link.list){
+		DeadlineList::get_response_list(now)->insert(this, now);
+	}
+	const AUTO(shutdown_timeout, atomic_load(m_shutdown_timeout, ATOMIC_CONSUME));
+	if(!m_shutdown_link.list && (shutdown_timeout != 0)){
+		DeadlineList::get_shutdown_list(shutdown_timeout, now)->insert(this, now);
+	}
+	atomic_store(m_deadlines_armed, true, ATOMIC_RELEASE);
+}
 void TcpSessionBase::create_shutdown_timer(){
 	PROFILE_ME;
 
-	const Mutex::UniqueLock lock(m_shutdown_mutex);
-	if(m_shutdown_timer){
+	if(atomic_load(m_deadlines_armed, ATOMIC_CONSUME)){
 		return;
 	}
-	m_shutdown_timer = TimerDaemon::register_low_level_timer(1000, 5000,
-		boost::bind(&shutdown_timer_proc, virtual_weak_from_this<TcpSessionBase>(), _2));
+	const AUTO(now, get_fast_mono_clock());
+	const Mutex::UniqueLock lock(DeadlineList::s_mutex);
+	arm_deadlines_unlocked(now);
 }
 
 int TcpSessionBase::poll_read_and_process(bool readable){
@@ -62,39 +332,73 @@ int TcpSessionBase::poll_read_and_process(bool readable){
 
 	(void)readable;
 
-	std::vector<unsigned char> temp;
-
 	StreamBuffer data;
 	try {
-		temp.resize(4096);
-		::ssize_t result;
-		if(m_ssl_filter){
-			result = m_ssl_filter->recv(temp.data(), temp.size());
-		} else {
-			result = ::recv(get_fd(), temp.data(), temp.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		// 每次唤醒最多读取 read_budget 字节，然后让出给其他连接。
+		const AUTO_REF(config, get_io_config());
+		int err_code = 0;
+		bool hung_up = false;
+		while(data.size() < config.read_budget){
+			// 直接读入新分配的块中，不再经过临时缓冲区。
+			::iovec vecs[MAX_IO_VECS];
+			const AUTO(reserved, std::min(m_read_hint, config.max_io_bytes));
+			const AUTO(vec_count, data.reserve_write(vecs, MAX_IO_VECS, reserved));
+			::ssize_t result;
+			if(m_ssl_filter){
+				result = ssl_readv(m_ssl_filter.get(), vecs, vec_count);
+			} else {
+				::msghdr msg = VAL_INIT;
+				msg.msg_iov = vecs;
+				msg.msg_iovlen = vec_count;
+				result = ::recvmsg(get_fd(), &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			}
+			if(result < 0){
+				err_code = errno;
+				data.commit_write(0);
+				break;
+			}
+			data.commit_write(static_cast<std::size_t>(result));
+			LOG_POSEIDON_TRACE("Read ", result, " byte(s) from ", get_remote_info());
+			if(result == 0){
+				hung_up = true;
+				break;
+			}
+
+			// 根据上一次读取的数据量调整下一次预留的大小。
+			if(static_cast<std::size_t>(result) >= reserved){
+				m_read_hint = std::min(reserved * 2, config.max_io_bytes);
+			} else if(static_cast<std::size_t>(result) < reserved / 4){
+				m_read_hint = std::max(reserved / 2, MIN_READ_HINT);
+			}
+			if(static_cast<std::size_t>(result) < reserved){
+				// SSL 可能还有缓存的数据，因此这里不能认为已经读完了。
+				break;
+			}
 		}
-		if(result < 0){
-			return errno;
+		if(data.empty() && !hung_up){
+			return err_code;
 		}
-		temp.resize(static_cast<std::size_t>(result));
-		data.put(temp.data(), temp.size());
-		LOG_POSEIDON_TRACE("Read ", result, " byte(s) from ", get_remote_info());
 
 		const AUTO(now, get_fast_mono_clock());
 		atomic_store(m_last_use_time, now, ATOMIC_RELEASE);
 		create_shutdown_timer();
 
-		if(data.empty() && !m_read_hup_notified){
-			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
-				"TCP connection read hung up: local = ", get_local_info(), ", remote = ", get_remote_info());
-			shutdown_read();
-			on_read_hup();
-			m_read_hup_notified = true;
+		if(!data.empty()){
+			on_receive(STD_MOVE(data));
 		}
-		if(data.empty()){
+		if(hung_up){
+			if(!m_read_hup_notified){
+				LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+					"TCP connection read hung up: local = ", get_local_info(), ", remote = ", get_remote_info());
+				shutdown_read();
+				on_read_hup();
+				m_read_hup_notified = true;
+			}
 			return EWOULDBLOCK;
 		}
-		on_receive(STD_MOVE(data));
+		if(err_code != 0){
+			return err_code;
+		}
 	} catch(std::exception &e){
 		LOG_POSEIDON_ERROR("std::exception thrown: what = ", e.what());
 		force_shutdown();
@@ -111,9 +415,6 @@ int TcpSessionBase::poll_write(Mutex::UniqueLock &write_lock, bool writeable){
 
 	assert(!write_lock);
 
-	std::vector<unsigned char> temp;
-
-	StreamBuffer data;
 	try {
 		if(writeable && !m_connected_notified){
 			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
@@ -122,10 +423,26 @@ int TcpSessionBase::poll_write(Mutex::UniqueLock &write_lock, bool writeable){
 			m_connected_notified = true;
 		}
 
-		temp.resize(4096);
+		::iovec vecs[MAX_IO_VECS];
 		Mutex::UniqueLock lock(m_send_mutex);
-		const std::size_t avail = m_send_buffer.peek(temp.data(), temp.size());
-		if(avail == 0){
+		AUTO(vec_count, m_send_buffer.peek_iovec(vecs, MAX_IO_VECS, get_max_io_bytes()));
+		int file_fd = -1;
+		boost::uint64_t file_offset = 0;
+		std::size_t file_bytes = 0;
+		while((vec_count == 0) && !m_send_files.empty()){
+			// 缓冲区中的数据发送完之后才能发送文件。
+			AUTO_REF(segment, m_send_files.front());
+			if(segment.remaining != 0){
+				file_fd = segment.file->get();
+				file_offset = segment.offset;
+				file_bytes = static_cast<std::size_t>(std::min<boost::uint64_t>(segment.remaining, get_max_io_bytes()));
+				break;
+			}
+			m_send_buffer.splice(segment.trailing);
+			m_send_files.pop_front();
+			vec_count = m_send_buffer.peek_iovec(vecs, MAX_IO_VECS, get_max_io_bytes());
+		}
+		if((vec_count == 0) && (file_fd < 0)){
 _check_shutdown:
 			if(should_really_shutdown_write()){
 				if(m_ssl_filter){
@@ -136,14 +453,24 @@ _check_shutdown:
 			}
 			return EWOULDBLOCK;
 		}
+		// 其他线程只会在末尾追加数据，只有 epoll 线程会移除开头的数据，因此解锁之后 vecs 仍然有效。
 		lock.unlock();
-		temp.resize(avail);
 
 		::ssize_t result;
-		if(m_ssl_filter){
-			result = m_ssl_filter->send(temp.data(), temp.size());
+		if(file_fd >= 0){
+			::off_t off = static_cast< ::off_t>(file_offset);
+			result = ::sendfile(get_fd(), file_fd, &off, file_bytes);
+			if(result == 0){
+				LOG_POSEIDON_ERROR("File truncated while being sent: remote = ", get_remote_info());
+				DEBUG_THROW(Exception, sslit("File truncated while being sent"));
+			}
+		} else if(m_ssl_filter){
+			result = ssl_writev(m_ssl_filter.get(), vecs, vec_count);
 		} else {
-			result = ::send(get_fd(), temp.data(), temp.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+			::msghdr msg = VAL_INIT;
+			msg.msg_iov = vecs;
+			msg.msg_iovlen = vec_count;
+			result = ::sendmsg(get_fd(), &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
 		}
 		if(result < 0){
 			return errno;
@@ -155,9 +482,23 @@ _check_shutdown:
 		create_shutdown_timer();
 
 		lock.lock();
-		m_send_buffer.discard(static_cast<std::size_t>(result));
+		if(file_fd >= 0){
+			// 其他线程只会在末尾追加文件片段，因此开头的片段仍然是刚才发送的那个。
+			AUTO_REF(segment, m_send_files.front());
+			segment.offset += static_cast<boost::uint64_t>(result);
+			segment.remaining -= static_cast<boost::uint64_t>(result);
+		} else {
+			m_send_buffer.discard(static_cast<std::size_t>(result));
+		}
+		if(atomic_load(m_send_throttled, ATOMIC_CONSUME) && (get_buffered_send_size_unlocked() < get_io_config().send_low_watermark)){
+			// 发送缓冲区已经降到低水位以下，立即恢复读取，不必等待 epoll 线程重试。
+			atomic_store(m_send_throttled, false, ATOMIC_RELEASE);
+			if(!atomic_load(m_recv_throttled, ATOMIC_CONSUME)){
+				EpollDaemon::mark_socket_readable(this);
+			}
+		}
 		swap(write_lock, lock);
-		if(m_send_buffer.empty()){
+		if(m_send_buffer.empty() && m_send_files.empty()){
 			goto _check_shutdown;
 		}
 	} catch(std::exception &e){
@@ -177,10 +518,13 @@ void TcpSessionBase::on_shutdown_timer(boost::uint64_t now){
 
 	const AUTO(shutdown_time, atomic_load(m_shutdown_time, ATOMIC_CONSUME));
 	if(shutdown_time < now){
-		std::size_t send_buffer_size;
+		boost::uint64_t send_buffer_size;
 		{
 			const Mutex::UniqueLock lock(m_send_mutex);
 			send_buffer_size = m_send_buffer.size();
+			for(AUTO(it, m_send_files.begin()); it != m_send_files.end(); ++it){
+				send_buffer_size += it->remaining + it->trailing.size();
+			}
 		}
 		if(send_buffer_size == 0){
 			LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
@@ -194,8 +538,7 @@ void TcpSessionBase::on_shutdown_timer(boost::uint64_t now){
 	}
 
 	const AUTO(last_use_time, atomic_load(m_last_use_time, ATOMIC_CONSUME));
-	const AUTO(tcp_response_timeout, MainConfig::get<boost::uint64_t>("tcp_response_timeout", 30000));
-	if(saturated_add(last_use_time, tcp_response_timeout) < now){
+	if(saturated_add(last_use_time, get_io_config().response_timeout) < now){
 		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
 			"The connection seems dead: remote = ", get_remote_info());
 		force_shutdown();
@@ -220,11 +563,47 @@ void TcpSessionBase::force_shutdown() NOEXCEPT {
 	SocketBase::force_shutdown();
 }
 
+boost::uint64_t TcpSessionBase::get_buffered_send_size_unlocked() const NOEXCEPT {
+	// 文件片段不占用内存，只计算排在它们之后的数据。
+	boost::uint64_t size = m_send_buffer.size();
+	for(AUTO(it, m_send_files.begin()); it != m_send_files.end(); ++it){
+		size += it->trailing.size();
+	}
+	return size;
+}
+
+void TcpSessionBase::notify_receive_queued(boost::uint64_t bytes) NOEXCEPT {
+	const AUTO(size, atomic_add(m_recv_queue_size, bytes, ATOMIC_RELAXED));
+	if(size >= get_io_config().recv_high_watermark){
+		atomic_store(m_recv_throttled, true, ATOMIC_RELEASE);
+	}
+}
+void TcpSessionBase::notify_receive_consumed(boost::uint64_t bytes) NOEXCEPT {
+	const AUTO(size, atomic_sub(m_recv_queue_size, bytes, ATOMIC_RELAXED));
+	if((size < get_io_config().recv_low_watermark) && atomic_exchange(m_recv_throttled, false, ATOMIC_ACQ_REL)){
+		if(!atomic_load(m_send_throttled, ATOMIC_CONSUME)){
+			EpollDaemon::mark_socket_readable(this);
+		}
+	}
+}
+
 bool TcpSessionBase::is_throttled() const {
-	const Mutex::UniqueLock lock(m_send_mutex);
-	if(m_send_buffer.size() >= 65536){
+	if(atomic_load(m_recv_throttled, ATOMIC_CONSUME)){
 		return true;
 	}
+	{
+		const Mutex::UniqueLock lock(m_send_mutex);
+		const AUTO(size, get_buffered_send_size_unlocked());
+		if(atomic_load(m_send_throttled, ATOMIC_CONSUME)){
+			if(size >= get_io_config().send_low_watermark){
+				return true;
+			}
+			atomic_store(m_send_throttled, false, ATOMIC_RELEASE);
+		} else if(size >= get_io_config().send_high_watermark){
+			atomic_store(m_send_throttled, true, ATOMIC_RELEASE);
+			return true;
+		}
+	}
 	return SocketBase::is_throttled();
 }
 
@@ -244,8 +623,23 @@ void TcpSessionBase::set_timeout(boost::uint64_t timeout){
 	PROFILE_ME;
 
 	const AUTO(now, get_fast_mono_clock());
-	atomic_store(m_shutdown_time, saturated_add(now, timeout), ATOMIC_RELEASE);
-	create_shutdown_timer();
+	const AUTO(shutdown_time, saturated_add(now, timeout));
+	const AUTO(shutdown_timeout, DeadlineList::get_timeout_class(timeout));
+	// 类别不变并且截止时间没有提前时只更新时间戳，检查到时再移到后面的槽中。
+	if(atomic_load(m_deadlines_armed, ATOMIC_CONSUME) && (atomic_load(m_shutdown_timeout, ATOMIC_CONSUME) == shutdown_timeout) &&
+		(atomic_load(m_shutdown_time, ATOMIC_CONSUME) <= shutdown_time))
+	{
+		atomic_store(m_shutdown_time, shutdown_time, ATOMIC_RELEASE);
+		return;
+	}
+	const Mutex::UniqueLock lock(DeadlineList::s_mutex);
+	atomic_store(m_shutdown_time, shutdown_time, ATOMIC_RELEASE);
+	// 截止时间可能提前了，因此需要放入对应类别的链表中。
+	if(m_shutdown_link.list){
+		m_shutdown_link.list->erase(this);
+	}
+	atomic_store(m_shutdown_timeout, shutdown_timeout, ATOMIC_RELEASE);
+	arm_deadlines_unlocked(now);
 }
 
 bool TcpSessionBase::send(StreamBuffer buffer){
@@ -258,9 +652,63 @@ bool TcpSessionBase::send(StreamBuffer buffer){
 	}
 
 	const Mutex::UniqueLock lock(m_send_mutex);
-	m_send_buffer.splice(buffer);
+	if(m_send_files.empty()){
+		m_send_buffer.splice(buffer);
+	} else {
+		m_send_files.back().trailing.splice(buffer);
+	}
 	EpollDaemon::mark_socket_writeable(this);
 	return true;
 }
+bool TcpSessionBase::send_file(int fd, boost::uint64_t offset, boost::uint64_t bytes){
+	PROFILE_ME;
+
+	return send_file(StreamBuffer(), fd, offset, bytes);
+}
+bool TcpSessionBase::send_file(StreamBuffer leading, int fd, boost::uint64_t offset, boost::uint64_t bytes){
+	PROFILE_ME;
+
+	if(has_been_shutdown_write()){
+		LOG_POSEIDON(Logger::SP_MAJOR | Logger::LV_DEBUG,
+			"TCP socket has been shut down for writing: local = ", get_local_info(), ", remote = ", get_remote_info());
+		return false;
+	}
+	if(bytes == 0){
+		if(leading.empty()){
+			return true;
+		}
+		return send(STD_MOVE(leading));
+	}
+
+	if(m_ssl_filter){
+		// SSL 需要在用户态加密，映射到内存中之后按普通数据发送。
+		if(bytes > SIZE_MAX){
+			LOG_POSEIDON_ERROR("File segment is too large: bytes = ", bytes);
+			DEBUG_THROW(Exception, sslit("File segment is too large"));
+		}
+		leading.put_file(fd, offset, static_cast<std::size_t>(bytes));
+		return send(STD_MOVE(leading));
+	}
+
+	FileSegment segment;
+	UniqueFile file(::dup(fd));
+	if(!file){
+		const int err_code = errno;
+		LOG_POSEIDON_ERROR("::dup() failed: err_code = ", err_code);
+		DEBUG_THROW(SystemException, err_code);
+	}
+	segment.file = boost::make_shared<UniqueFile>(STD_MOVE(file));
+	segment.offset = offset;
+	segment.remaining = bytes;
 
+	const Mutex::UniqueLock lock(m_send_mutex);
+	if(m_send_files.empty()){
+		m_send_buffer.splice(leading);
+	} else {
+		m_send_files.back().trailing.splice(leading);
+	}
+	m_send_files.push_back(STD_MOVE(segment));
+	EpollDaemon::mark_socket_writeable(this);
+	return true;
+}
 }
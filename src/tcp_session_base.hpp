@@ -9,6 +9,8 @@
 #include "socket_base.hpp"
 #include "session_base.hpp"
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <deque>
 
 namespace Poseidon {
 
@@ -20,28 +22,68 @@ class TcpSessionBase : public SocketBase, public SessionBase {
 	friend TcpServerBase;
 
 private:
-	static void shutdown_timer_proc(const boost::weak_ptr<TcpSessionBase> &weak, boost::uint64_t now);
+	class DeadlineList;
+
+	// 超时链表的节点，由 DeadlineList 的锁保护。
+	struct DeadlineLink {
+		DeadlineList *list;
+		TcpSessionBase **bucket;
+		TcpSessionBase *prev;
+		TcpSessionBase *next;
+
+		DeadlineLink()
+			: list(NULLPTR), bucket(NULLPTR), prev(NULLPTR), next(NULLPTR)
+		{ }
+	};
+
+	static void sweep_deadlines(boost::uint64_t now);
+
+private:
+	struct FileSegment {
+		boost::shared_ptr<const UniqueFile> file;
+		boost::uint64_t offset;
+		boost::uint64_t remaining;
+		// 在这个文件片段之后排队的数据。
+		StreamBuffer trailing;
+	};
 
 private:
 	boost::scoped_ptr<SslFilterBase> m_ssl_filter;
 
 	bool m_connected_notified;
 	bool m_read_hup_notified;
+	std::size_t m_read_hint;
+
+	volatile boost::uint64_t m_recv_queue_size;
+	mutable volatile bool m_send_throttled;
+	volatile bool m_recv_throttled;
 
 	mutable Mutex m_send_mutex;
 	StreamBuffer m_send_buffer;
+	std::deque<FileSegment> m_send_files;
 
 	volatile boost::uint64_t m_shutdown_time;
 	volatile boost::uint64_t m_last_use_time;
-	mutable Mutex m_shutdown_mutex;
-	boost::shared_ptr<TimerItem> m_shutdown_timer;
+
+	// 以下成员由 DeadlineList 的锁保护。
+	volatile bool m_deadlines_armed;
+	volatile boost::uint64_t m_shutdown_timeout; // 在锁外读取。
+	boost::weak_ptr<TcpSessionBase> m_weak_self;
+	DeadlineLink m_response_link;
+	DeadlineLink m_shutdown_link;
+	boost::shared_ptr<TimerItem> m_sweep_timer; // 所有连接共享同一个计时器。
 
 public:
 	explicit TcpSessionBase(Move<UniqueFile> socket);
 	~TcpSessionBase();
 
+private:
+	boost::uint64_t get_buffered_send_size_unlocked() const NOEXCEPT;
+	void arm_deadlines_unlocked(boost::uint64_t now);
+
 protected:
 	void init_ssl(Move<boost::scoped_ptr<SslFilterBase> > ssl_filter);
+	// 把连接加入超时链表。之后的活动只更新时间戳，不需要加锁。
 	void create_shutdown_timer();
 
 	// 注意，只能在 epoll 线程中调用这些函数。
@@ -54,6 +96,7 @@ protected:
 	void on_receive(StreamBuffer data) OVERRIDE = 0;
 
 	// 注意，只能在 timer 线程中调用这些函数。
+	// 在 set_timeout() 设定的时间或者响应超时到达时调用。
 	virtual void on_shutdown_timer(boost::uint64_t now);
 
 public:
@@ -70,7 +113,17 @@ public:
 	void set_no_delay(bool enabled = true);
 	void set_timeout(boost::uint64_t timeout);
 
+	// 收到的数据排队等待处理时调用 notify_receive_queued()，处理完之后调用 notify_receive_consumed()。
+	// 排队的数据超过高水位时停止读取，降到低水位以下时立即恢复。升级后的会话通过父会话调用。
+	void notify_receive_queued(boost::uint64_t bytes) NOEXCEPT;
+	void notify_receive_consumed(boost::uint64_t bytes) NOEXCEPT;
+
 	bool send(StreamBuffer buffer) OVERRIDE;
+	// 发送文件 fd 中从 offset 开始的 bytes 字节，与 send() 的数据按调用顺序排队。
+	// fd 会被复制，调用者可以在返回后关闭它。非 SSL 连接使用 sendfile() 发送，文件内容不经过用户态内存。
+	bool send_file(int fd, boost::uint64_t offset, boost::uint64_t bytes);
+	// 同上，leading 和文件在同一次加锁中排队，其他线程的数据不会插入两者之间。
+	bool send_file(StreamBuffer leading, int fd, boost::uint64_t offset, boost::uint64_t bytes);
 };
 
 }
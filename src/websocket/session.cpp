@@ -20,11 +20,21 @@ namespace WebSocket {
 	private:
 		const SocketBase::DelayedShutdownGuard m_guard;
 		const boost::weak_ptr<Session> m_weak_session;
+		const boost::uint64_t m_queued_size;
 
 	protected:
-		explicit SyncJobBase(const boost::shared_ptr<Session> &session)
-			: m_guard(boost::shared_ptr<SocketBase>(session->get_weak_parent())), m_weak_session(session)
-		{ }
+		explicit SyncJobBase(const boost::shared_ptr<Session> &session, boost::uint64_t queued_size = 0)
+			: m_guard(boost::shared_ptr<SocketBase>(session->get_weak_parent())), m_weak_session(session), m_queued_size(queued_size)
+		{
+			session->notify_receive_queued(m_queued_size);
+		}
+		~SyncJobBase(){
+			// 无论任务是否被执行，都要归还排队的数据量。
+			const AUTO(session, m_weak_session.lock());
+			if(session){
+				session->notify_receive_consumed(m_queued_size);
+			}
+		}
 
 	private:
 		boost::weak_ptr<const void> get_category() const FINAL {
@@ -65,6 +75,11 @@ namespace WebSocket {
 			: SyncJobBase(session)
 		{ }
 
+		// 只关闭连接，不会让出，不需要纤程。
+		bool may_yield() const OVERRIDE {
+			return false;
+		}
+
 	protected:
 		void really_perform(const boost::shared_ptr<Session> &session) OVERRIDE {
 			PROFILE_ME;
@@ -80,7 +95,7 @@ namespace WebSocket {
 
 	public:
 		DataMessageJob(const boost::shared_ptr<Session> &session, OpCode opcode, StreamBuffer payload)
-			: SyncJobBase(session)
+			: SyncJobBase(session, payload.size())
 			, m_opcode(opcode), m_payload(STD_MOVE(payload))
 		{ }
 
@@ -103,7 +118,7 @@ namespace WebSocket {
 
 	public:
 		ControlMessageJob(const boost::shared_ptr<Session> &session, OpCode opcode, StreamBuffer payload)
-			: SyncJobBase(session)
+			: SyncJobBase(session, payload.size())
 			, m_opcode(opcode), m_payload(STD_MOVE(payload))
 		{ }
 
@@ -0,0 +1,74 @@
+// 这个文件是 Poseidon 服务器应用程序框架的一部分。
+// Copyleft 2014 - 2017, LH_Mouse. All wrongs reserved.
+
+// 这个文件被置于公有领域（public domain）。
+
+// 比较两种纤程上下文切换的延迟。
+
+#include "../src/fiber_context.cpp"
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <time.h>
+
+namespace {
+
+const unsigned long g_round_count = 1000000;
+
+double get_time(){
+	::timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) / 1e9;
+}
+
+template<typename ContextT>
+struct Bench {
+	static ContextT s_outer;
+	static ContextT s_inner;
+	static unsigned long s_counter;
+
+	static void proc(void *){
+		for(;;){
+			++s_counter;
+			s_inner.switch_to(s_outer);
+		}
+	}
+
+	static void run(const char *name){
+		static char stack[65536];
+		s_counter = 0;
+		s_inner.prepare(stack, sizeof(stack), &proc, NULLPTR);
+
+		const double begin = get_time();
+		for(unsigned long i = 0; i < g_round_count; ++i){
+			s_outer.switch_to(s_inner);
+		}
+		const double end = get_time();
+		if(s_counter != g_round_count){
+			std::cout <<name <<": counter mismatch: " <<s_counter <<std::endl;
+			std::exit(1);
+		}
+		// 每一轮包含两次切换。
+		std::cout <<std::setw(10) <<name <<": " <<std::fixed <<std::setprecision(1)
+		          <<(end - begin) * 1e9 / static_cast<double>(g_round_count * 2) <<" ns per switch" <<std::endl;
+	}
+};
+
+template<typename ContextT>
+ContextT Bench<ContextT>::s_outer;
+template<typename ContextT>
+ContextT Bench<ContextT>::s_inner;
+template<typename ContextT>
+unsigned long Bench<ContextT>::s_counter;
+
+}
+
+int main(){
+	Bench<Poseidon::UcontextFiberContext>::run("ucontext");
+#ifdef POSEIDON_HAS_ASM_FIBER_CONTEXT
+	Bench<Poseidon::AsmFiberContext>::run("asm");
+#else
+	std::cout <<"Assembly fiber context is not available on this architecture." <<std::endl;
+#endif
+	return 0;
+}